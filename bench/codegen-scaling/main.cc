@@ -0,0 +1,345 @@
+#include <google/protobuf/descriptor.pb.h>
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Times protoc over the corpus proto-corpus writes: once with --cpp_out
+// alone, and then with --cpp_out and each plugin, so the difference is the
+// time the plugin took. Usage:
+//
+//   codegen-scaling-bench --protoc=PATH --corpus=DIR [--include=DIR]...
+//       [--plugin=NAME=PATH]... [--opt=NAME=OPTIONS]... [--repeat=N]
+//       [--cxx=PATH [--cxxflag=FLAG]... [--compile=N]]
+//
+// NAME is the name of the plugin as in --NAME_out. Each run prints a line of
+// JSON, e.g.
+//
+//   {"variant": "basic-options", "files": 1000, "messages": 8000,
+//    "fields": 96000, "seconds": 9.1, "messages_per_second": 879,
+//    "fields_per_second": 10549, "plugin_seconds": 2.3,
+//    "plugin_messages_per_second": 3478, "plugin_fields_per_second": 41739}
+//
+// seconds is the fastest of --repeat (default 1) runs, and the rates are of
+// the whole protoc run; the plugin_ ones are of the plugin alone. What protoc
+// and the plugins print to stderr goes to DIR/out/<variant>.log.
+//
+// With --cxx, the code generated for N files of the corpus (default 3, spread
+// from the first to the last, which imports the most) is then compiled with
+// it and the --cxxflag flags, for each variant, and the benchmark fails if
+// any does not compile. What the compiler prints goes to
+// DIR/out/<variant>.compile.log.
+
+namespace {
+
+struct Counts {
+  long files = 0;
+  long messages = 0;
+  long fields = 0;
+};
+
+struct Variant {
+  std::string name;
+  std::vector<std::string> args;
+};
+
+
+std::string Quote(const std::string& s) {
+  std::string quoted = "'";
+  for (char c : s) {
+    if (c == '\'') {
+      quoted += "'\\''";
+    } else {
+      quoted += c;
+    }
+  }
+  return quoted + "'";
+}
+
+
+bool MakeDirectory(const std::string& path) {
+  return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+}
+
+
+// Runs protoc with args, passed through an argument file (protoc @FILE) as
+// the corpus has too many files for a command line, and returns how long it
+// took, or a negative number if it failed.
+double RunProtoc(const std::string& protoc, const std::string& out_dir,
+                 const std::string& name,
+                 const std::vector<std::string>& args) {
+  auto args_path = out_dir + "/" + name + ".args";
+  auto log_path = out_dir + "/" + name + ".log";
+  {
+    std::ofstream args_file(args_path);
+    for (auto& arg : args) {
+      args_file << arg << "\n";
+    }
+  }
+
+  auto command = Quote(protoc) + " " + Quote("@" + args_path) + " 2> " +
+                 Quote(log_path);
+
+  auto start = std::chrono::steady_clock::now();
+  int status = std::system(command.c_str());
+  auto end = std::chrono::steady_clock::now();
+
+  if (status != 0) {
+    std::cerr << name << ": protoc failed, see " << log_path << "\n";
+    return -1;
+  }
+  return std::chrono::duration<double>(end - start).count();
+}
+
+
+// Messages that have generated classes (map entries do not), and their
+// fields.
+void Count(const google::protobuf::DescriptorProto& message, Counts* counts) {
+  if (message.options().map_entry()) {
+    return;
+  }
+  ++counts->messages;
+  counts->fields += message.field_size();
+  for (auto& nested : message.nested_type()) {
+    Count(nested, counts);
+  }
+}
+
+
+// Compiles the code variant_out holds for the .proto file, appending what the
+// compiler prints to log_path, and returns whether it compiled.
+bool Compile(const std::string& cxx, const std::vector<std::string>& flags,
+             const std::string& variant_out, const std::string& file,
+             const std::string& log_path) {
+  auto source = variant_out + "/" + file.substr(0, file.size() - 6) + ".pb.cc";
+  auto command = Quote(cxx);
+  for (auto& flag : flags) {
+    command += " " + Quote(flag);
+  }
+  command += " " + Quote("-I" + variant_out) + " -c " + Quote(source) +
+             " -o " + Quote(source + ".o") + " 2>> " + Quote(log_path);
+  return std::system(command.c_str()) == 0;
+}
+
+
+long Rate(long count, double seconds) {
+  return static_cast<long>(static_cast<double>(count) / seconds);
+}
+
+
+void Print(const std::string& variant, const Counts& counts, double seconds,
+           double plugin_seconds) {
+  std::cout << "{\"variant\": \"" << variant << "\""
+            << ", \"files\": " << counts.files
+            << ", \"messages\": " << counts.messages
+            << ", \"fields\": " << counts.fields
+            << ", \"seconds\": " << seconds
+            << ", \"messages_per_second\": "
+            << Rate(counts.messages, seconds)
+            << ", \"fields_per_second\": "
+            << Rate(counts.fields, seconds);
+  // Within noise of protoc alone, a plugin has no meaningful rate of its own.
+  if (plugin_seconds > 0) {
+    std::cout << ", \"plugin_seconds\": " << plugin_seconds
+              << ", \"plugin_messages_per_second\": "
+              << Rate(counts.messages, plugin_seconds)
+              << ", \"plugin_fields_per_second\": "
+              << Rate(counts.fields, plugin_seconds);
+  }
+  std::cout << "}\n";
+}
+
+
+bool StartsWith(const std::string& s, const std::string& prefix) {
+  return s.compare(0, prefix.size(), prefix) == 0;
+}
+
+
+// Splits NAME=VALUE at the first '='.
+bool SplitNameValue(const std::string& s,
+                    std::pair<std::string, std::string>* pair) {
+  auto eq = s.find('=');
+  if (eq == std::string::npos || eq == 0) {
+    return false;
+  }
+  *pair = {s.substr(0, eq), s.substr(eq + 1)};
+  return true;
+}
+
+}  // namespace
+
+
+int main(int argc, char** argv) {
+  std::string protoc;
+  std::string corpus_dir;
+  std::vector<std::string> includes;
+  std::vector<std::pair<std::string, std::string>> plugins;
+  std::vector<std::pair<std::string, std::string>> plugin_options;
+  long repeat = 1;
+  std::string cxx;
+  std::vector<std::string> cxx_flags;
+  long compile = 3;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    std::pair<std::string, std::string> pair;
+    if (StartsWith(arg, "--protoc=")) {
+      protoc = arg.substr(9);
+    } else if (StartsWith(arg, "--corpus=")) {
+      corpus_dir = arg.substr(9);
+    } else if (StartsWith(arg, "--include=")) {
+      includes.push_back(arg.substr(10));
+    } else if (StartsWith(arg, "--plugin=") &&
+               SplitNameValue(arg.substr(9), &pair)) {
+      plugins.push_back(pair);
+    } else if (StartsWith(arg, "--opt=") &&
+               SplitNameValue(arg.substr(6), &pair)) {
+      plugin_options.push_back(pair);
+    } else if (StartsWith(arg, "--repeat=")) {
+      repeat = atol(arg.c_str() + 9);
+    } else if (StartsWith(arg, "--cxx=")) {
+      cxx = arg.substr(6);
+    } else if (StartsWith(arg, "--cxxflag=")) {
+      cxx_flags.push_back(arg.substr(10));
+    } else if (StartsWith(arg, "--compile=")) {
+      compile = atol(arg.c_str() + 10);
+    } else {
+      std::cerr << "unknown argument: " << arg << "\n";
+      return 2;
+    }
+  }
+
+  if (protoc.empty() || corpus_dir.empty() || repeat < 1 || compile < 0) {
+    std::cerr << "usage: " << argv[0] << " --protoc=PATH --corpus=DIR "
+              << "[--include=DIR]... [--plugin=NAME=PATH]... "
+              << "[--opt=NAME=OPTIONS]... [--repeat=N] "
+              << "[--cxx=PATH [--cxxflag=FLAG]... [--compile=N]]\n";
+    return 2;
+  }
+
+  std::vector<std::string> files;
+  {
+    std::ifstream list(corpus_dir + "/corpus.list");
+    std::string file;
+    while (std::getline(list, file)) {
+      files.push_back(file);
+    }
+  }
+  if (files.empty()) {
+    std::cerr << corpus_dir << "/corpus.list: no files, run proto-corpus\n";
+    return 1;
+  }
+
+  auto out_dir = corpus_dir + "/out";
+  if (!MakeDirectory(out_dir)) {
+    std::cerr << out_dir << ": cannot be created\n";
+    return 1;
+  }
+
+  std::vector<std::string> common_args = {"-I" + corpus_dir};
+  for (auto& include : includes) {
+    common_args.push_back("-I" + include);
+  }
+  common_args.insert(common_args.end(), files.begin(), files.end());
+
+  // Counts the messages and fields from the corpus' descriptors ...
+  auto descriptor_set_path = out_dir + "/corpus.pb";
+  auto count_args = common_args;
+  count_args.push_back("--descriptor_set_out=" + descriptor_set_path);
+  if (RunProtoc(protoc, out_dir, "descriptors", count_args) < 0) {
+    return 1;
+  }
+
+  google::protobuf::FileDescriptorSet descriptor_set;
+  std::ifstream descriptor_input(descriptor_set_path, std::ios::binary);
+  if (!descriptor_set.ParseFromIstream(&descriptor_input)) {
+    std::cerr << descriptor_set_path << ": not a FileDescriptorSet\n";
+    return 1;
+  }
+
+  Counts counts;
+  for (auto& file : descriptor_set.file()) {
+    ++counts.files;
+    for (auto& message : file.message_type()) {
+      Count(message, &counts);
+    }
+  }
+
+  // The files whose generated code is compiled, if any.
+  std::vector<std::string> compiled;
+  if (!cxx.empty()) {
+    auto n = std::min(static_cast<size_t>(compile), files.size());
+    for (size_t i = 0; i < n; ++i) {
+      compiled.push_back(files[n == 1 ? 0 : i * (files.size() - 1) / (n - 1)]);
+    }
+  }
+
+  // ... then times protoc alone, and with each plugin.
+  std::vector<Variant> variants = {{"protoc", {}}};
+  for (auto& plugin : plugins) {
+    Variant variant = {plugin.first, {}};
+    auto plugin_out = out_dir + "/" + plugin.first;
+    variant.args.push_back("--plugin=protoc-gen-" + plugin.first + "=" +
+                           plugin.second);
+    variant.args.push_back("--" + plugin.first + "_out=" + plugin_out);
+    for (auto& options : plugin_options) {
+      if (options.first == plugin.first) {
+        variant.args.push_back("--" + plugin.first + "_opt=" + options.second);
+      }
+    }
+    variants.push_back(variant);
+  }
+
+  double protoc_seconds = 0;
+  for (auto& variant : variants) {
+    auto variant_out = out_dir + "/" + variant.name;
+    if (!MakeDirectory(variant_out)) {
+      std::cerr << variant_out << ": cannot be created\n";
+      return 1;
+    }
+
+    auto args = common_args;
+    args.push_back("--cpp_out=" + variant_out);
+    args.insert(args.end(), variant.args.begin(), variant.args.end());
+
+    double seconds = 0;
+    for (long run = 0; run < repeat; ++run) {
+      double run_seconds = RunProtoc(protoc, out_dir, variant.name, args);
+      if (run_seconds < 0) {
+        return 1;
+      }
+      seconds = run == 0 ? run_seconds : std::min(seconds, run_seconds);
+    }
+
+    if (variant.name == "protoc") {
+      protoc_seconds = seconds;
+      Print(variant.name, counts, seconds, 0);
+    } else {
+      Print(variant.name, counts, seconds, seconds - protoc_seconds);
+    }
+
+    // Code that is generated fast but does not build is no use, so check
+    // that it does, on files with imports and with messages that refer to
+    // messages declared after them.
+    auto compile_log = out_dir + "/" + variant.name + ".compile.log";
+    std::remove(compile_log.c_str());
+    for (auto& file : compiled) {
+      if (!Compile(cxx, cxx_flags, variant_out, file, compile_log)) {
+        std::cerr << variant.name << ": the code generated for " << file
+                  << " does not compile, see " << compile_log << "\n";
+        return 1;
+      }
+    }
+  }
+
+  return 0;
+}
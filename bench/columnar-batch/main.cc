@@ -0,0 +1,85 @@
+#include <protos/foo.pb.h>
+#include <google/protobuf/repeated_field.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Compares scanning rows of example::Foo one message at a time, against
+// scanning the same rows as the columns of an example::FooBatch.
+//
+// Each case is run `passes` times over the same rows, and reports the rate
+// at which rows were scanned. The conversion into a batch is measured on its
+// own, as it is paid once for any number of scans.
+
+namespace {
+
+volatile double sink = 0;
+
+
+template <typename Fn>
+void Run(const std::string& name, long rows, int passes, Fn fn) {
+  auto start = std::chrono::steady_clock::now();
+  for (int pass = 0; pass < passes; ++pass) {
+    fn();
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  auto seconds = std::chrono::duration<double>(end - start).count();
+  std::cout << name << ": " << static_cast<long>(rows * passes / seconds)
+            << " rows/s\n";
+}
+
+}  // namespace
+
+
+int main(int argc, char** argv) {
+  long rows = argc > 1 ? atol(argv[1]) : 1000000;
+  int passes = argc > 2 ? atoi(argv[2]) : 20;
+
+  google::protobuf::RepeatedPtrField<example::Foo> foos;
+  foos.Reserve(static_cast<int>(rows));
+  for (long i = 0; i < rows; ++i) {
+    auto* foo = foos.Add();
+    foo->set_a(static_cast<int32_t>(i % 1000));
+    foo->set_b(static_cast<float>(i % 100) / 4);
+    foo->set_c("row " + std::to_string(i));
+  }
+
+  example::FooBatch batch;
+  Run("convert", rows, 1, [&] {
+    batch = example::FooBatch::From(foos);
+  });
+
+  Run("sum a (rows)", rows, passes, [&] {
+    int64_t sum = 0;
+    for (const auto& foo : foos) {
+      sum += foo.a();
+    }
+    sink += static_cast<double>(sum);
+  });
+
+  Run("sum a (batch)", rows, passes, [&] {
+    sink += static_cast<double>(batch.SumA());
+  });
+
+  Run("filter b (rows)", rows, passes, [&] {
+    std::vector<uint32_t> selection;
+    for (int i = 0; i < foos.size(); ++i) {
+      if (foos.Get(i).b() > 12.0f) {
+        selection.push_back(static_cast<uint32_t>(i));
+      }
+    }
+    sink += static_cast<double>(selection.size());
+  });
+
+  Run("filter b (batch)", rows, passes, [&] {
+    auto selection =
+        batch.FilterB(columnar_batch::Compare::kGreater, 12.0f);
+    sink += static_cast<double>(selection.size());
+  });
+
+  return 0;
+}
@@ -0,0 +1,66 @@
+#include <protos/foo.pb.h>
+#include <google/protobuf/util/message_differencer.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <string>
+
+// Compares the equality and hash fast-hash generates for example::Foo,
+// against MessageDifferencer and hashing the serialized message.
+
+namespace {
+
+volatile size_t sink = 0;
+
+
+template <typename Fn>
+void Run(const std::string& name, long iterations, Fn fn) {
+  auto start = std::chrono::steady_clock::now();
+  for (long i = 0; i < iterations; ++i) {
+    fn();
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  auto seconds = std::chrono::duration<double>(end - start).count();
+  std::cout << name << ": " << static_cast<long>(iterations / seconds)
+            << " ops/s\n";
+}
+
+}  // namespace
+
+
+int main(int argc, char** argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+
+  example::Foo lhs;
+  lhs.set_version("2.0");
+  lhs.set_a(42);
+  lhs.set_b(2.5f);
+  lhs.set_c("a cache key of a moderate length, like a path or a query");
+  example::Foo rhs = lhs;
+
+  Run("equal: MessageDifferencer", iterations, [&] {
+    sink += google::protobuf::util::MessageDifferencer::Equals(lhs, rhs);
+  });
+
+  Run("equal: operator==", iterations, [&] {
+    sink += lhs == rhs;
+  });
+
+  Run("hash: serialize + std::hash", iterations, [&] {
+    sink += std::hash<std::string>()(lhs.SerializeAsString());
+  });
+
+  Run("hash: FastHash", iterations, [&] {
+    lhs.InvalidateFastHash();
+    sink += example::FastHash(lhs);
+  });
+
+  Run("hash: FastHash (cached)", iterations, [&] {
+    sink += example::FastHash(lhs);
+  });
+
+  return 0;
+}
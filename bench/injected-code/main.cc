@@ -0,0 +1,205 @@
+#include <protos/foo.pb.h>
+#include <google/protobuf/arena.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Measures what the generated example::Foo costs at runtime. The same
+// benchmarks are built once against each variant of the protos (see
+// bench/CMakeLists.txt), and BENCH_VARIANT names the variant, so comparing the
+// variants gives the cost of the code each plugin inserts.
+//
+// Every benchmark runs on one thread and then on all cores, and prints a line
+// of JSON, e.g.
+//
+//   {"variant": "plain", "benchmark": "ByteSizeLong", "threads": 1,
+//    "iterations": 1000000, "ns_per_op": 4.1, "ops_per_second": 243902439}
+//
+// ns_per_op is the time each thread took per operation, and ops_per_second
+// is the total rate across all threads.
+
+#ifndef BENCH_VARIANT
+#define BENCH_VARIANT "unknown"
+#endif
+
+namespace {
+
+constexpr long kArenaBatch = 1000;
+
+const std::string kValue(64, 'c');
+
+// Keeps the results of the benchmarks alive, summed once per thread.
+std::atomic<size_t> sink(0);
+
+
+void Fill(example::Foo* foo, long i) {
+  foo->set_a(static_cast<int32_t>(i));
+  foo->set_b(1.5f);
+  foo->set_c(kValue);
+}
+
+
+// Runs body(iterations) on each of threads threads at once, and prints the
+// results of benchmark.
+void Run(const std::string& benchmark, unsigned threads, long iterations,
+         const std::function<size_t(long)>& body) {
+  std::atomic<unsigned> ready(0);
+  std::atomic<bool> go(false);
+
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < threads; ++t) {
+    workers.emplace_back([&]() {
+      ++ready;
+      while (!go) {
+      }
+      sink += body(iterations);
+    });
+  }
+
+  while (ready < threads) {
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  go = true;
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  auto seconds = std::chrono::duration<double>(end - start).count();
+  std::cout << "{\"variant\": \"" << BENCH_VARIANT << "\""
+            << ", \"benchmark\": \"" << benchmark << "\""
+            << ", \"threads\": " << threads
+            << ", \"iterations\": " << iterations
+            << ", \"ns_per_op\": " << seconds * 1e9 / iterations
+            << ", \"ops_per_second\": "
+            << static_cast<long>(threads * iterations / seconds) << "}\n";
+}
+
+
+size_t ConstructDestruct(long iterations) {
+  size_t result = 0;
+  for (long i = 0; i < iterations; ++i) {
+    example::Foo foo;
+    result += foo.version().size();
+  }
+  return result;
+}
+
+
+size_t ArenaConstruct(long iterations) {
+  size_t result = 0;
+  google::protobuf::Arena arena;
+  for (long i = 0; i < iterations; ++i) {
+    auto* foo = google::protobuf::Arena::CreateMessage<example::Foo>(&arena);
+    result += foo->version().size();
+    if (i % kArenaBatch == kArenaBatch - 1) {
+      arena.Reset();
+    }
+  }
+  return result;
+}
+
+
+// Clears a message with its fields set, setting them again each time.
+size_t Clear(long iterations) {
+  size_t result = 0;
+  example::Foo foo;
+  for (long i = 0; i < iterations; ++i) {
+    Fill(&foo, i);
+    foo.Clear();
+    result += foo.version().size();
+  }
+  return result;
+}
+
+
+size_t ByteSizeLong(long iterations) {
+  size_t result = 0;
+  example::Foo foo;
+  Fill(&foo, 1);
+  for (long i = 0; i < iterations; ++i) {
+    result += foo.ByteSizeLong();
+  }
+  return result;
+}
+
+
+size_t SerializeToArray(long iterations) {
+  size_t result = 0;
+  example::Foo foo;
+  Fill(&foo, 1);
+  std::vector<char> buffer(foo.ByteSizeLong());
+  for (long i = 0; i < iterations; ++i) {
+    result += foo.SerializeToArray(buffer.data(),
+                                   static_cast<int>(buffer.size()));
+  }
+  return result;
+}
+
+
+size_t ParseFromArray(long iterations) {
+  size_t result = 0;
+  example::Foo from;
+  Fill(&from, 1);
+  auto bytes = from.SerializeAsString();
+
+  example::Foo foo;
+  for (long i = 0; i < iterations; ++i) {
+    result += foo.ParseFromArray(bytes.data(), static_cast<int>(bytes.size()));
+  }
+  return result;
+}
+
+
+size_t MergeFrom(long iterations) {
+  size_t result = 0;
+  example::Foo from;
+  Fill(&from, 1);
+
+  example::Foo foo;
+  for (long i = 0; i < iterations; ++i) {
+    foo.MergeFrom(from);
+    result += static_cast<size_t>(foo.a());
+  }
+  return result;
+}
+
+}  // namespace
+
+
+int main(int argc, char** argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+  unsigned cores = argc > 2 ? static_cast<unsigned>(atoi(argv[2]))
+                            : std::thread::hardware_concurrency();
+  if (cores == 0) {
+    cores = 1;
+  }
+
+  const std::vector<std::pair<std::string, std::function<size_t(long)>>>
+      benchmarks = {
+          {"ConstructDestruct", ConstructDestruct},
+          {"ArenaConstruct", ArenaConstruct},
+          {"Clear", Clear},
+          {"ByteSizeLong", ByteSizeLong},
+          {"SerializeToArray", SerializeToArray},
+          {"ParseFromArray", ParseFromArray},
+          {"MergeFrom", MergeFrom},
+      };
+
+  for (auto& benchmark : benchmarks) {
+    Run(benchmark.first, 1, iterations, benchmark.second);
+    if (cores > 1) {
+      Run(benchmark.first, cores, iterations, benchmark.second);
+    }
+  }
+
+  return sink == 0;
+}
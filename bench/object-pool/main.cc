@@ -0,0 +1,75 @@
+#include <protos/foo.pb.h>
+#include <google/protobuf/arena.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+// Compares getting an example::Foo, filling in its fields and giving it back
+// through the pool that object-pool generates, against plain new/delete and
+// against allocating on an arena that is reset every kArenaBatch messages.
+//
+// The string field is longer than the small string buffer, so each message
+// that is not recycled costs a string allocation as well.
+
+namespace {
+
+constexpr long kArenaBatch = 1000;
+
+volatile size_t sink = 0;
+
+const std::string kValue(64, 'c');
+
+
+void Fill(example::Foo* foo, long i) {
+  foo->set_a(static_cast<int32_t>(i));
+  foo->set_b(1.5f);
+  foo->set_c(kValue);
+  sink += foo->c().size();
+}
+
+
+template <typename Fn>
+void Run(const std::string& name, long iterations, Fn fn) {
+  auto start = std::chrono::steady_clock::now();
+  for (long i = 0; i < iterations; ++i) {
+    fn(i);
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  auto seconds = std::chrono::duration<double>(end - start).count();
+  std::cout << name << ": " << static_cast<long>(iterations / seconds)
+            << " messages/s\n";
+}
+
+}  // namespace
+
+
+int main(int argc, char** argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+
+  Run("new/delete", iterations, [](long i) {
+    auto* foo = new example::Foo();
+    Fill(foo, i);
+    delete foo;
+  });
+
+  Run("Acquire/Release", iterations, [](long i) {
+    auto* foo = example::Foo::Acquire();
+    Fill(foo, i);
+    example::Foo::Release(foo);
+  });
+
+  google::protobuf::Arena arena;
+
+  Run("arena", iterations, [&arena](long i) {
+    auto* foo = google::protobuf::Arena::CreateMessage<example::Foo>(&arena);
+    Fill(foo, i);
+    if (i % kArenaBatch == kArenaBatch - 1) {
+      arena.Reset();
+    }
+  });
+
+  return 0;
+}
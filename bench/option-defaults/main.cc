@@ -0,0 +1,80 @@
+#include <protos/foo.pb.h>
+#include <protos/options.pb.h>
+#include <google/protobuf/arena.h>
+#include <google/protobuf/message.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+// Compares constructing an example::Foo whose version default is assigned
+// from the constant basic-options generates, against the per-construction
+// descriptor lookup basic-options used to insert into the constructor.
+//
+// The "descriptor lookup" case replays the old inserted code on top of the
+// generated constructor, so the difference between the two rates is the
+// cost of the lookup itself.
+
+namespace {
+
+volatile size_t sink = 0;
+
+
+// The code basic-options used to insert at arena_constructor:example.Foo.
+void LookupDefaultVersion(example::Foo* foo) {
+  auto* version_desc = foo->descriptor()->FindFieldByName("version");
+  auto version_opts = version_desc->options();
+  auto version_default =
+      version_opts.GetExtension(example::field_options).default_value();
+  foo->set_version(version_default);
+}
+
+
+template <typename Fn>
+void Run(const std::string& name, long iterations, Fn fn) {
+  auto start = std::chrono::steady_clock::now();
+  for (long i = 0; i < iterations; ++i) {
+    fn();
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  auto seconds = std::chrono::duration<double>(end - start).count();
+  std::cout << name << ": " << static_cast<long>(iterations / seconds)
+            << " constructions/s\n";
+}
+
+}  // namespace
+
+
+int main(int argc, char** argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+
+  Run("generated constant", iterations, [] {
+    example::Foo foo;
+    sink += foo.version().size();
+  });
+
+  Run("descriptor lookup", iterations, [] {
+    example::Foo foo;
+    LookupDefaultVersion(&foo);
+    sink += foo.version().size();
+  });
+
+  google::protobuf::Arena arena;
+
+  Run("generated constant (arena)", iterations, [&arena] {
+    auto* foo = google::protobuf::Arena::CreateMessage<example::Foo>(&arena);
+    sink += foo->version().size();
+  });
+
+  arena.Reset();
+
+  Run("descriptor lookup (arena)", iterations, [&arena] {
+    auto* foo = google::protobuf::Arena::CreateMessage<example::Foo>(&arena);
+    LookupDefaultVersion(foo);
+    sink += foo->version().size();
+  });
+
+  return 0;
+}
@@ -0,0 +1,85 @@
+# add_proto_library(<name>
+#     OUTPUT_DIR <dir>
+#     PROTOS <proto>...
+#     [PLUGINS <plugin target>...]
+#     [PLUGIN_OPTIONS <plugin target> <options> [<plugin target> <options>...]])
+#
+# Generates c++ sources for each of PROTOS (paths relative to the project
+# root) into OUTPUT_DIR and builds them into the static library <name>. Every
+# plugin in PLUGINS runs in the same protoc invocation as --cpp_out, so the
+# code they insert ends up in the generated files.
+#
+# Each plugin is passed the parameter in its PROTOC_PLUGIN_OPTIONS target
+# property, unless PLUGIN_OPTIONS gives it different options for this library.
+function(add_proto_library name)
+    cmake_parse_arguments(ARG "" "OUTPUT_DIR" "PROTOS;PLUGINS;PLUGIN_OPTIONS"
+        ${ARGN})
+
+    set(plugin_args)
+    foreach(target ${ARG_PLUGINS})
+        get_target_property(plugin_name ${target} PROTOC_PLUGIN_NAME)
+        get_target_property(plugin_protoc_gen_name ${target} PROTOC_GEN_NAME)
+        get_target_property(plugin_path ${target} PROTOC_PLUGIN_PATH)
+        get_target_property(plugin_options ${target} PROTOC_PLUGIN_OPTIONS)
+
+        list(FIND ARG_PLUGIN_OPTIONS ${target} options_index)
+        if (NOT options_index EQUAL -1)
+            math(EXPR options_index "${options_index} + 1")
+            list(GET ARG_PLUGIN_OPTIONS ${options_index} plugin_options)
+        endif()
+
+        list(APPEND plugin_args
+            "--plugin=${plugin_name}=${plugin_path}"
+            "--${plugin_protoc_gen_name}_out=${ARG_OUTPUT_DIR}")
+
+        if (plugin_options)
+            list(APPEND plugin_args
+                "--${plugin_protoc_gen_name}_opt=${plugin_options}")
+        endif()
+    endforeach(target ${ARG_PLUGINS})
+
+    set(sources)
+    set(headers)
+    foreach(proto ${ARG_PROTOS})
+        get_filename_component(proto_dir "${proto}" DIRECTORY)
+        get_filename_component(proto_name "${proto}" NAME_WE)
+        set(proto_header "${ARG_OUTPUT_DIR}/${proto_dir}/${proto_name}.pb.h")
+        set(proto_src    "${ARG_OUTPUT_DIR}/${proto_dir}/${proto_name}.pb.cc")
+
+        if (CMAKE_BUILD_TYPE STREQUAL "Debug")
+            string(CONCAT cmd
+                "protoc -I ${PROJECT_SOURCE_DIR} "
+                "${PROJECT_SOURCE_DIR}/${proto} "
+                "--cpp_out=${ARG_OUTPUT_DIR} "
+                "${plugin_args}"
+            )
+            message(STATUS "${cmd}")
+        endif()
+
+        add_custom_command(
+            OUTPUT "${proto_src}" "${proto_header}"
+            COMMAND ${CMAKE_COMMAND} -E make_directory ${ARG_OUTPUT_DIR}
+            COMMAND LIBRARY_PATH=${Protobuf_LIBRARY} ${Protobuf_PROTOC_EXECUTABLE}
+            ARGS -I ${PROJECT_SOURCE_DIR}
+                ${PROJECT_SOURCE_DIR}/${proto}
+                --cpp_out=${ARG_OUTPUT_DIR}
+                ${plugin_args}
+            WORKING_DIRECTORY "${CMAKE_CURRENT_BINARY_DIR}"
+            DEPENDS "${PROJECT_SOURCE_DIR}/${proto}" ${ARG_PLUGINS}
+            COMMENT "${proto} -> ${proto_src} ${proto_header}"
+        )
+
+        list(APPEND sources "${proto_src}")
+        list(APPEND headers "${proto_header}")
+    endforeach()
+
+    add_library(${name} STATIC ${sources} ${headers})
+
+    target_compile_options(${name} PRIVATE -std=c++11)
+
+    target_link_libraries(${name} PRIVATE
+        ${Protobuf_LIBRARIES} ${Protobuf_PROTOC_LIBRARIES})
+
+    target_include_directories(${name} PUBLIC
+        ${ARG_OUTPUT_DIR} ${Protobuf_INCLUDE_DIR})
+endfunction()
@@ -0,0 +1,32 @@
+#include <protos/foo.pb.h>
+#include <protos/options.pb.h>
+#include <google/protobuf/arena.h>
+
+#include <iostream>
+#include <memory>
+#include <vector>
+
+int main(int argc, char** argv) {
+  // Some messages on the heap, one of them copied, ...
+  std::vector<std::unique_ptr<example::Foo>> heap;
+  for (int i = 0; i < 1000; ++i) {
+    heap.emplace_back(new example::Foo());
+    heap.back()->set_a(i);
+  }
+  example::Foo copy(*heap.front());
+  heap.resize(10);
+
+  // ... and some on an arena, which are never destroyed one by one.
+  google::protobuf::Arena arena;
+  for (int i = 0; i < 1000; ++i) {
+    google::protobuf::Arena::CreateMessage<example::Foo>(&arena)->set_a(i);
+  }
+
+  auto stats = example::Foo::AllocationSnapshot();
+  std::cout << "example.Foo heap constructions: " << stats.heap_constructions
+            << "\n\n";
+
+  basic_insertions::WriteAllocationReport(std::cout);
+
+  return 0;
+}
@@ -2,8 +2,23 @@
 #include <protos/options.pb.h>
 #include <google/protobuf/message.h>
 
+#include <array>
+#include <cstdint>
 #include <iostream>
 #include <string>
+#include <utility>
+
+// Prints a field of a Foo, given the FieldMetadata type of the field (a
+// generic lambda, as of c++14).
+struct PrintField {
+  const example::Foo& foo;
+
+  template <typename Field>
+  void operator()(Field) const {
+    std::cout << Field::number() << " " << Field::name() << ": "
+              << Field::get(foo) << "\n";
+  }
+};
 
 int main(int argc, char** argv) {
   std::cout << "\n ------------- Before initializing Foo ------------- \n";
@@ -29,7 +44,45 @@ int main(int argc, char** argv) {
   std::cout << "--- version_opts ---\n" << version_opts.DebugString() << "\n";
   std::cout << "--- version_def ---\n" << version_def << "\n";
 
+  // basic-options resolves the same default while generating the code.
+  std::cout << "--- Foo::kVersionDefaultValue ---\n"
+            << example::Foo::kVersionDefaultValue << "\n";
+
   // foo.set_version(version_def);
 
+  // ... and the metadata of every field, without Descriptor or Reflection.
+  std::cout << "--- Foo::for_each_field ---\n";
+  example::Foo::for_each_field(PrintField{foo});
+  static_assert(example::Foo::FieldMetadata::version::has_default_value(),
+                "version has a default_value option");
+
+  // ... and lets a Foo be built from all of its fields at once.
+  example::Foo::initializable_type init{"2.0", 1, 2.5f, "moved into place"};
+  example::Foo built(std::move(init));
+  std::cout << "--- Foo(initializable_type&&) ---\n" << built.DebugString();
+
+  // Fields left out keep their defaults: version is still "1.2".
+  example::Foo::initializable_type partial{{}, 7};
+  std::cout << "--- Foo(initializable_type) without version ---\n"
+            << example::Foo(partial).DebugString();
+
+  // ... and, as its strings have a max_size, encode it into a buffer on the
+  // stack that always has room for it.
+  std::array<uint8_t, example::Foo::kMaxEncodedSize> buffer;
+  auto size = built.SerializeToFixedBuffer(buffer);
+  std::cout << "--- Foo::SerializeToFixedBuffer ---\n"
+            << size << " of " << buffer.size() << " bytes\n";
+
+  // ... and check the constraints of the fields of one Foo, or of many.
+  example::Foo invalid(built);
+  invalid.set_a(-1);
+  std::string error;
+  std::cout << "--- Foo::Validate ---\n"
+            << (built.Validate() ? "valid" : "invalid") << "\n"
+            << (invalid.Validate(&error) ? "valid" : error) << "\n";
+  const example::Foo* foos[] = {&built, &invalid, &built};
+  std::cout << "--- Foo::ValidateBatch ---\n"
+            << example::Foo::ValidateBatch(foos, 3)[0] << "\n";
+
   return 0;
 }
@@ -0,0 +1,209 @@
+#include <protos/foo.pb.h>
+#include <google/protobuf/io/coded_stream.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Writes a log of example::Foo records of the given size with FooWriter, and
+// reads it back with a loop around ParseFromString (a copy and a new message
+// per record) and with each way of reading it FooReader has, printing the
+// throughput of each.
+//
+// Usage: basic-records <file> [gigabytes, default 2]
+//
+// The file is read right after it is written, so it is likely still in the
+// page cache: the rates are of parsing, not of the disk.
+
+namespace {
+
+const double kGigabyte = 1024.0 * 1024.0 * 1024.0;
+
+
+class Timer {
+ public:
+  Timer() : start_(std::chrono::steady_clock::now()) {}
+
+  void Print(const std::string& name, uint64_t bytes, uint64_t records,
+             int64_t sum) const {
+    auto seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start_).count();
+    printf("%-28s %6.2f GB, %10llu records in %6.2f s: %7.0f MB/s, "
+           "%6.2fM records/s (sum %lld)\n",
+           name.c_str(), static_cast<double>(bytes) / kGigabyte,
+           static_cast<unsigned long long>(records), seconds,
+           static_cast<double>(bytes) / seconds / (1024 * 1024),
+           static_cast<double>(records) / seconds / 1e6,
+           static_cast<long long>(sum));
+  }
+
+ private:
+  std::chrono::steady_clock::time_point start_;
+};
+
+
+// What each consumer used to write: read a size, copy the record into a
+// string, and parse it into a new message.
+bool ParseFromStringLoop(const std::string& path, uint64_t* records,
+                         int64_t* sum) {
+  std::ifstream in(path, std::ios::binary);
+  std::string record;
+  while (in.peek() != EOF) {
+    uint32_t size = 0;
+    for (int shift = 0;; shift += 7) {
+      int byte = in.get();
+      if (byte == EOF || shift > 28) {
+        return false;
+      }
+      size |= static_cast<uint32_t>(byte & 0x7f) << shift;
+      if (byte < 0x80) {
+        break;
+      }
+    }
+
+    record.resize(size);
+    if (!in.read(&record[0], size)) {
+      return false;
+    }
+
+    example::Foo foo;
+    if (!foo.ParseFromString(record)) {
+      return false;
+    }
+    ++*records;
+    *sum += foo.a();
+  }
+  return true;
+}
+
+}  // namespace
+
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0] << " <file> [gigabytes, default 2]\n";
+    return 2;
+  }
+  std::string path = argv[1];
+  double gigabytes = argc > 2 ? atof(argv[2]) : 2;
+  auto target = static_cast<uint64_t>(gigabytes * kGigabyte);
+
+  // Write the log ...
+  uint64_t written = 0;
+  int64_t written_sum = 0;
+  {
+    Timer timer;
+    example::FooWriter writer(path);
+    example::Foo foo;
+    foo.set_version("1.2");
+    std::string c;
+    uint64_t bytes = 0;
+    while (bytes < target) {
+      foo.set_a(static_cast<int32_t>(written % 100000));
+      foo.set_b(static_cast<float>(written % 1000) / 4);
+      c.assign(16 + written % 64, static_cast<char>('a' + written % 26));
+      foo.set_c(c);
+      if (!writer.Write(foo)) {
+        break;
+      }
+      auto size = foo.ByteSizeLong();
+      bytes += size + google::protobuf::io::CodedOutputStream::VarintSize32(
+                          static_cast<uint32_t>(size));
+      written_sum += foo.a();
+      ++written;
+    }
+    if (!writer.Close()) {
+      std::cerr << "writing " << path << ": " << writer.error() << "\n";
+      return 1;
+    }
+    timer.Print("FooWriter", bytes, written, written_sum);
+  }
+
+  example::FooReader reader(path);
+  if (!reader.ok()) {
+    std::cerr << "reading " << path << ": " << reader.error() << "\n";
+    return 1;
+  }
+
+  // ... and read it back every way.
+  {
+    Timer timer;
+    uint64_t records = 0;
+    int64_t sum = 0;
+    if (!ParseFromStringLoop(path, &records, &sum)) {
+      std::cerr << path << ": malformed record\n";
+      return 1;
+    }
+    timer.Print("ParseFromString loop", reader.size(), records, sum);
+  }
+
+  {
+    Timer timer;
+    uint64_t records = 0;
+    int64_t sum = 0;
+    bool ok = reader.ForEach([&](const example::Foo& foo) {
+      ++records;
+      sum += foo.a();
+    });
+    if (!ok) {
+      std::cerr << path << ": malformed record\n";
+      return 1;
+    }
+    timer.Print("FooReader::ForEach", reader.size(), records, sum);
+  }
+
+  {
+    Timer timer;
+    uint64_t records = 0;
+    int64_t sum = 0;
+    bool ok = reader.ForEachBatch(
+        1024, [&](const std::vector<example::Foo*>& batch) {
+          records += batch.size();
+          for (auto* foo : batch) {
+            sum += foo->a();
+          }
+        });
+    if (!ok) {
+      std::cerr << path << ": malformed record\n";
+      return 1;
+    }
+    timer.Print("FooReader::ForEachBatch", reader.size(), records, sum);
+  }
+
+  {
+    Timer timer;
+    // The counts of each shard, padded to a cache line of their own.
+    struct Shard {
+      uint64_t records;
+      int64_t sum;
+      char padding[48];
+    };
+    unsigned threads = std::thread::hardware_concurrency();
+    std::vector<Shard> shards(threads > 0 ? threads : 1);
+    bool ok = reader.ParallelForEach(
+        static_cast<unsigned>(shards.size()),
+        [&](unsigned shard, const example::Foo& foo) {
+          ++shards[shard].records;
+          shards[shard].sum += foo.a();
+        });
+    if (!ok) {
+      std::cerr << path << ": malformed record\n";
+      return 1;
+    }
+    uint64_t records = 0;
+    int64_t sum = 0;
+    for (auto& shard : shards) {
+      records += shard.records;
+      sum += shard.sum;
+    }
+    timer.Print("FooReader::ParallelForEach", reader.size(), records, sum);
+  }
+
+  return 0;
+}
@@ -0,0 +1,42 @@
+#include <protos/foo.pb.h>
+#include <protos/options.pb.h>
+
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+int main(int argc, char** argv) {
+  // Exercise example::Foo from a few threads ...
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([t] {
+      for (int i = 0; i < 1000; ++i) {
+        example::Foo foo;
+        foo.set_a(t * i);
+
+        std::string bytes;
+        foo.SerializeToString(&bytes);
+
+        example::Foo copy(foo);
+        copy.Clear();
+        copy.MergeFrom(foo);
+      }
+    });
+  }
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  // ... and read the per-thread counters back without stopping anyone.
+  auto counters = example::Foo::SnapshotCounters();
+
+  std::cout << "--- example.Foo counters ---\n";
+  for (int i = 0; i < example::Foo::kCounterEventCount; ++i) {
+    std::cout << example::Foo::CounterEventName(i) << ": "
+              << counters.counts[i] << "\n";
+  }
+
+  return 0;
+}
@@ -0,0 +1,33 @@
+#include <protos/foo.pb.h>
+#include <protos/options.pb.h>
+
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+int main(int argc, char** argv) {
+  // A workload that mostly touches c, and version only now and then ...
+  example::Foo foo;
+  int64_t total = 0;
+  for (int i = 0; i < 100000; ++i) {
+    foo.set_c(i % 2 == 0 ? "even" : "odd");
+    total += static_cast<int64_t>(foo.c().size());
+    if (i % 100 == 0) {
+      total += static_cast<int64_t>(foo.version().size());
+      foo.set_a(i);
+    }
+  }
+  std::cout << "checksum " << total << "\n\n";
+
+  // ... and its field accesses, to stdout or to the file named by the first
+  // argument, for field-renumber.
+  if (argc > 1) {
+    std::ofstream out(argv[1]);
+    basic_insertions::WriteFieldAccessReport(out);
+  } else {
+    basic_insertions::WriteFieldAccessReport(std::cout);
+  }
+
+  return 0;
+}
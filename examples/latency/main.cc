@@ -0,0 +1,26 @@
+#include <protos/foo.pb.h>
+#include <protos/options.pb.h>
+
+#include <iostream>
+#include <string>
+
+int main(int argc, char** argv) {
+  example::Foo foo;
+  foo.set_a(42);
+  foo.set_b(3.5f);
+
+  // Serialize messages of growing size, so the histograms have some spread.
+  std::string bytes;
+  for (int i = 0; i < 100000; ++i) {
+    foo.mutable_c()->append(i % 100 == 0 ? "x" : "");
+    foo.SerializeToString(&bytes);
+  }
+
+  auto& latency = example::Foo::SerializationHistograms();
+  std::cout << "example.Foo serialized " << latency.serialize.Count()
+            << " times\n\n";
+
+  basic_insertions::WriteLatencyReport(std::cout);
+
+  return 0;
+}
@@ -0,0 +1,58 @@
+#include <protos/foo.pb.h>
+#include <protos/options.pb.h>
+#include <protos/tags.pb.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+
+#include <iostream>
+#include <string>
+#include <utility>
+
+// The encoding of message as it is now: deterministic serialization bypasses
+// the cache.
+std::string Encode(const google::protobuf::Message& message) {
+  std::string bytes;
+  google::protobuf::io::StringOutputStream output(&bytes);
+  google::protobuf::io::CodedOutputStream stream(&output);
+  stream.SetSerializationDeterministic(true);
+  message.SerializeWithCachedSizes(&stream);
+  return bytes;
+}
+
+// Serializes message the usual way, through the cache, and checks that it
+// gives the same size and bytes as Encode.
+bool Check(const char* what, const google::protobuf::Message& message) {
+  auto size = message.ByteSizeLong();
+  auto bytes = message.SerializeAsString();
+  bool ok = size == bytes.size() && bytes == Encode(message);
+  std::cout << what << ": " << (ok ? "ok" : "stale") << "\n";
+  return ok;
+}
+
+int main() {
+  bool ok = true;
+
+  // Foo is cached: serializing it again comes from the cache, and its
+  // setters invalidate it ...
+  example::Foo foo;
+  foo.set_a(1);
+  ok = Check("Foo", foo) && ok;
+  ok = Check("Foo again", foo) && ok;
+  foo.set_c(std::string("set through an rvalue"));
+  ok = Check("Foo after set_c(std::string&&)", foo) && ok;
+
+  // ... while Tagged is not, as add_tags(std::string&&) and
+  // set_tags(int, std::string&&) could not invalidate a cache.
+  example::Tagged tagged;
+  tagged.set_name("tagged");
+  tagged.add_tags("first");
+  ok = Check("Tagged", tagged) && ok;
+  std::string tag = "second";
+  tagged.add_tags(std::move(tag));
+  ok = Check("Tagged after add_tags(std::string&&)", tagged) && ok;
+  tag = "replaced";
+  tagged.set_tags(0, std::move(tag));
+  ok = Check("Tagged after set_tags(int, std::string&&)", tagged) && ok;
+
+  return ok ? 0 : 1;
+}
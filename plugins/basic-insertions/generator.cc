@@ -1,44 +1,22 @@
 #include "generator.h"
 
+#include "common/insertion.h"
+#include "common/trace.h"
+
 #include <google/protobuf/compiler/code_generator.h>
 #include <google/protobuf/compiler/cpp/cpp_generator.h>
 #include <google/protobuf/compiler/plugin.h>
 #include <google/protobuf/descriptor.h>
 #include <google/protobuf/io/printer.h>
 
+#include <cstdlib>
+#include <map>
 #include <memory>
 #include <string>
 #include <utility>
 #include <vector>
 
-
-// Helper function to get the full name for an insertion point.
-std::string GetFullInsertionPoint(
-    const std::string& point_name,
-    const google::protobuf::Descriptor* message = nullptr) {
-  return message == nullptr ? point_name
-                            : point_name + ":" + message->full_name();
-}
-
-
-// Helper function to return a pointer to an inserter stream
-google::protobuf::io::ZeroCopyOutputStream* GetInserter(
-    const std::string& file_name, const std::string& insertion_point,
-    google::protobuf::compiler::GeneratorContext* context,
-    const google::protobuf::Descriptor* message = nullptr) {
-  auto full_insertion_point = GetFullInsertionPoint(insertion_point, message);
-  return context->OpenForInsert(file_name, full_insertion_point);
-}
-
-
-// Helper function to return a printer for an insertion point
-std::shared_ptr<google::protobuf::io::Printer> GetPrinter(
-    const std::string& file_name, const std::string& insertion_point,
-    google::protobuf::compiler::GeneratorContext* context,
-    const google::protobuf::Descriptor* message = nullptr) {
-  auto* inserter = GetInserter(file_name, insertion_point, context, message);
-  return std::make_shared<google::protobuf::io::Printer>(inserter, '$');
-}
+namespace basic_insertions {
 
 
 void InsertBasicStatement(
@@ -65,7 +43,12 @@ void InsertBasicStatement(
 }
 
 
-bool Generator::GenerateFor(
+std::string Generator::Version() const {
+  return "basic-insertions/1";
+}
+
+
+bool Generator::GeneratePrints(
     const google::protobuf::Descriptor* message,
     const google::protobuf::FileDescriptor* file,
     google::protobuf::compiler::GeneratorContext* context) const {
@@ -109,20 +92,14 @@ bool Generator::GenerateFor(
   // global_scope
 
   using google::protobuf::compiler::StripProto;
-  auto hh_filename = StripProto(file->name()) + ".pb.h";
   auto cc_filename = StripProto(file->name()) + ".pb.cc";
 
   // ---------------------------------------------------------------------
   // Insert print statements into each of the insertion points so that it's
-  // clear when these insertion points are relevant.
+  // clear when these insertion points are relevant. The includes and the
+  // namespace and global scopes are per file, so GenerateFile inserts into
+  // those once rather than once per message.
 
-  // HEADER INSERTIONS
-
-  InsertBasicStatement(hh_filename, "includes", context, nullptr, "#include <iostream>");
-
-  // IMPLEMENTATION INSERTIONS
-
-  InsertBasicStatement(cc_filename, "includes", context, nullptr, "#include <iostream>");
   InsertBasicStatement(cc_filename, "arena_constructor", context, message);
   InsertBasicStatement(cc_filename, "copy_constructor", context, message);
   InsertBasicStatement(cc_filename, "destructor", context, message);
@@ -132,25 +109,1232 @@ bool Generator::GenerateFor(
   InsertBasicStatement(cc_filename, "message_byte_size_start", context, message);
   InsertBasicStatement(cc_filename, "class_specific_merge_from_start", context, message);
   InsertBasicStatement(cc_filename, "class_specific_copy_from_start", context, message);
-  InsertBasicStatement(cc_filename, "namespace_scope", context, nullptr,
-                       "// THIS WAS INSERTED INTO THE NAMESPACE SCOPE\n");
-  InsertBasicStatement(cc_filename, "global_scope", context, nullptr,
-                       "// THIS WAS INSERTER INTO THE GLOBAL SCOPE\n");
 
   return true;
 }
 
 
-bool Generator::Generate(const google::protobuf::FileDescriptor* file,
-                         const std::string& parameter,
-                         google::protobuf::compiler::GeneratorContext* context,
-                         std::string* error) const {
-  // Generate for each message. Short circuit on any failures.
-  for (int i = 0; i < file->message_type_count(); ++i) {
-    if (!GenerateFor(file->message_type(i), file, context)) {
+// The .pb.cc insertion points of a message that mode=counters counts, in
+// the order of the generated CounterEvent enum.
+const std::vector<std::pair<std::string, std::string>> kCounterEvents = {
+    {"arena_constructor", "kArenaConstructorEvent"},
+    {"copy_constructor", "kCopyConstructorEvent"},
+    {"destructor", "kDestructorEvent"},
+    {"message_clear_start", "kClearEvent"},
+    {"class_specific_merge_from_start", "kMergeFromEvent"},
+    {"class_specific_copy_from_start", "kCopyFromEvent"},
+    {"message_byte_size_start", "kByteSizeEvent"},
+    {"serialize_to_array_start", "kSerializeEvent"},
+};
+
+
+// Support code shared by the counters of all messages. It is emitted into the
+// includes of every generated header, so it is guarded against being defined
+// more than once per translation unit.
+const char* const kCountersRuntime = R"(
+#ifndef BASIC_INSERTIONS_EVENT_COUNTERS_
+#define BASIC_INSERTIONS_EVENT_COUNTERS_
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <new>
+
+namespace basic_insertions {
+
+// Per-thread event counters for messages of type T.
+//
+// Each thread counts into its own cache line aligned block, so counting is a
+// relaxed load and store to memory that no other thread writes. Blocks are
+// linked into a list that never shrinks, which lets Snapshot() sum them
+// without a lock. A block is handed to a new thread when its thread exits, so
+// its counts are kept and thread churn does not grow the list. Events counted
+// after a thread has given its block back, e.g. from the destructor of
+// another thread_local, go to an overflow block shared by all threads.
+template <typename T, int N>
+class EventCounters {
+ public:
+  static void Increment(int event) {
+    auto* block = Local();
+    auto& count = block->counts[event];
+    if (block == Overflow()) {
+      count.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    count.store(count.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+  }
+
+  static void Snapshot(uint64_t (&counts)[N]) {
+    for (int i = 0; i < N; ++i) {
+      counts[i] = 0;
+    }
+    for (auto* block = head_.load(std::memory_order_acquire); block;
+         block = block->next) {
+      for (int i = 0; i < N; ++i) {
+        counts[i] += block->counts[i].load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+ private:
+  struct alignas(64) Block {
+    std::atomic<uint64_t> counts[N];
+    Block* next;
+    Block* next_free;
+  };
+
+  struct Registration {
+    ~Registration() {
+      std::lock_guard<std::mutex> lock(Mutex());
+      local_->next_free = free_;
+      free_ = local_;
+      local_ = nullptr;
+      destroyed_ = true;
+    }
+  };
+
+  static Block* Local() {
+    if (local_ != nullptr) {
+      return local_;
+    }
+    // The registration of this thread is gone, and would not be constructed
+    // again.
+    return destroyed_ ? Overflow() : Register();
+  }
+
+  static Block* Register() {
+    static thread_local Registration registration;
+    (void)registration;
+
+    std::lock_guard<std::mutex> lock(Mutex());
+    if (free_ != nullptr) {
+      local_ = free_;
+      free_ = free_->next_free;
+      return local_;
+    }
+    local_ = NewBlock();
+    return local_;
+  }
+
+  static Block* Overflow() {
+    static Block* overflow = [] {
+      std::lock_guard<std::mutex> lock(Mutex());
+      return NewBlock();
+    }();
+    return overflow;
+  }
+
+  // Allocates a block and links it into the list. Called with the mutex held.
+  static Block* NewBlock() {
+    // operator new is only required to honor alignas(64) as of c++17.
+    auto* memory = static_cast<char*>(::operator new(sizeof(Block) + 63));
+    auto aligned = (reinterpret_cast<uintptr_t>(memory) + 63) & ~uintptr_t(63);
+    auto* block = new (reinterpret_cast<void*>(aligned)) Block();
+    block->next = head_.load(std::memory_order_relaxed);
+    head_.store(block, std::memory_order_release);
+    return block;
+  }
+
+  static std::mutex& Mutex() {
+    static std::mutex mutex;
+    return mutex;
+  }
+
+  static thread_local Block* local_;
+  static thread_local bool destroyed_;
+  static std::atomic<Block*> head_;
+  static Block* free_;
+};
+
+template <typename T, int N>
+thread_local typename EventCounters<T, N>::Block* EventCounters<T, N>::local_ =
+    nullptr;
+
+template <typename T, int N>
+thread_local bool EventCounters<T, N>::destroyed_ = false;
+
+template <typename T, int N>
+std::atomic<typename EventCounters<T, N>::Block*> EventCounters<T, N>::head_{
+    nullptr};
+
+template <typename T, int N>
+typename EventCounters<T, N>::Block* EventCounters<T, N>::free_ = nullptr;
+
+}  // namespace basic_insertions
+#endif  // BASIC_INSERTIONS_EVENT_COUNTERS_
+)";
+
+
+bool Generator::GenerateCounters(
+    const google::protobuf::Descriptor* message,
+    const google::protobuf::FileDescriptor* file,
+    google::protobuf::compiler::GeneratorContext* context) const {
+  using google::protobuf::compiler::StripProto;
+  auto hh_filename = StripProto(file->name()) + ".pb.h";
+  auto cc_filename = StripProto(file->name()) + ".pb.cc";
+
+  std::map<std::string, std::string> vars;
+  vars["class"] = ClassName(message);
+  vars["counters"] = "::basic_insertions::EventCounters<" +
+                     ClassName(message, true) + ", " +
+                     ClassName(message, true) + "::kCounterEventCount>";
+
+  // The events and the snapshot API in the class ...
+  auto printer = GetPrinter(hh_filename, "class_scope", context, message);
+  printer->Print("// Event counters (basic-insertions mode=counters)\n");
+  printer->Print("enum CounterEvent {\n");
+  printer->Indent();
+  for (auto& event : kCounterEvents) {
+    printer->Print("$name$,\n", "name", event.second);
+  }
+  printer->Print("kCounterEventCount\n");
+  printer->Outdent();
+  printer->Print("};\n\n");
+
+  printer->Print(
+      "struct Counters {\n"
+      "  uint64_t counts[kCounterEventCount];\n"
+      "};\n\n"
+      "static const char* CounterEventName(int event) {\n"
+      "  static const char* const names[] = {\n");
+  printer->Indent();
+  for (auto& event : kCounterEvents) {
+    printer->Print("  \"$name$\",\n", "name", event.first);
+  }
+  printer->Outdent();
+  printer->Print(vars,
+      "  };\n"
+      "  return names[event];\n"
+      "}\n\n"
+      "// Sums the counts of all threads. Never blocks the counting threads.\n"
+      "static Counters SnapshotCounters() {\n"
+      "  Counters counters;\n"
+      "  $counters$::Snapshot(counters.counts);\n"
+      "  return counters;\n"
+      "}\n\n");
+
+  // ... and a count at each insertion point of the implementation.
+  for (auto& event : kCounterEvents) {
+    vars["event"] = event.second;
+    auto inserter = GetPrinter(cc_filename, event.first, context, message);
+    inserter->Print(vars, "$counters$::Increment($class$::$event$);\n");
+  }
+
+  return true;
+}
+
+
+// Support code shared by the latency histograms of all messages. Guarded for
+// the same reason as kCountersRuntime.
+const char* const kLatencyRuntime = R"(
+#ifndef BASIC_INSERTIONS_LATENCY_
+#define BASIC_INSERTIONS_LATENCY_
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <thread>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace basic_insertions {
+
+// A cheap timestamp: the (invariant) time stamp counter on x86 and the steady
+// clock in nanoseconds elsewhere.
+inline uint64_t LatencyClock() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
+// The LatencyClock() and steady clock readings LatencyTicksPerNanosecond()
+// measures from, taken at the first call. That happens during static
+// initialization (see LatencyRegistration), so there is a long baseline by
+// the time a report is written.
+struct LatencyBaseline {
+  uint64_t ticks;
+  std::chrono::steady_clock::time_point time;
+};
+
+inline const LatencyBaseline& StartLatencyBaseline() {
+  static const LatencyBaseline baseline = {LatencyClock(),
+                                           std::chrono::steady_clock::now()};
+  return baseline;
+}
+
+// LatencyClock() ticks per nanosecond, measured against the steady clock
+// since the baseline. If that was less than 10 ms ago, waits for the rest
+// first.
+inline double LatencyTicksPerNanosecond() {
+  using Clock = std::chrono::steady_clock;
+  auto& baseline = StartLatencyBaseline();
+
+  auto elapsed = Clock::now() - baseline.time;
+  if (elapsed < std::chrono::milliseconds(10)) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10) - elapsed);
+    elapsed = Clock::now() - baseline.time;
+  }
+
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed);
+  return static_cast<double>(LatencyClock() - baseline.ticks) /
+         static_cast<double>(ns.count());
+}
+
+// A lock-free log-linear histogram of LatencyClock() ticks. Values below 16
+// get a bucket each; above that every power of two is split into 8 buckets,
+// so a bucket is never more than 12.5% wide.
+class LatencyHistogram {
+ public:
+  static constexpr int kBuckets = 16 + 60 * 8;
+
+  void Record(uint64_t ticks) {
+    buckets_[Bucket(ticks)].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  uint64_t Count() const {
+    uint64_t count = 0;
+    for (int i = 0; i < kBuckets; ++i) {
+      count += buckets_[i].load(std::memory_order_relaxed);
+    }
+    return count;
+  }
+
+  // The q-th quantile (0 < q <= 1) of the recorded values in ticks, as the
+  // middle of the bucket it falls in. 0 when nothing has been recorded.
+  double Quantile(double q) const {
+    uint64_t counts[kBuckets];
+    uint64_t total = 0;
+    for (int i = 0; i < kBuckets; ++i) {
+      counts[i] = buckets_[i].load(std::memory_order_relaxed);
+      total += counts[i];
+    }
+
+    auto rank = static_cast<uint64_t>(q * static_cast<double>(total) + 0.5);
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets && total > 0; ++i) {
+      seen += counts[i];
+      if (seen >= rank && counts[i] > 0) {
+        return (static_cast<double>(LowerBound(i)) +
+                static_cast<double>(LowerBound(i + 1))) / 2;
+      }
+    }
+
+    return 0;
+  }
+
+ private:
+  static int Bucket(uint64_t ticks) {
+    if (ticks < 16) {
+      return static_cast<int>(ticks);
+    }
+    int exponent = 63 - __builtin_clzll(ticks);
+    int mantissa = static_cast<int>(ticks >> (exponent - 3)) & 7;
+    return 16 + (exponent - 4) * 8 + mantissa;
+  }
+
+  static uint64_t LowerBound(int bucket) {
+    if (bucket < 16) {
+      return static_cast<uint64_t>(bucket);
+    }
+    int exponent = (bucket - 16) / 8 + 4;
+    uint64_t mantissa = static_cast<uint64_t>((bucket - 16) % 8);
+    return (8 + mantissa) << (exponent - 3);
+  }
+
+  std::atomic<uint64_t> buckets_[kBuckets];
+};
+
+// The serialization latencies of one message type.
+struct SerializationLatency {
+  // From the start to the end of a ByteSizeLong() that the program called
+  // rather than another message's, and that an encode of the message
+  // followed, i.e. the size pass.
+  LatencyHistogram byte_size;
+  // From the start to the end of the encode.
+  LatencyHistogram serialize;
+};
+
+// The size passes and encodes of any message type in progress on a thread,
+// so that those of a message nested in another can be told from those the
+// program asked for.
+struct LatencyThreadState {
+  int byte_size_depth;
+  int serialize_depth;
+  // The latencies of the type of the last size pass the program asked for,
+  // if no size pass or encode started since, or nullptr; and its ticks.
+  const SerializationLatency* pending;
+  uint64_t pending_ticks;
+};
+
+inline LatencyThreadState& ThreadLatencyState() {
+  static thread_local LatencyThreadState state = {0, 0, nullptr, 0};
+  return state;
+}
+
+// The latencies of messages of type T and the hooks that record them.
+template <typename T>
+class MessageLatency {
+ public:
+  static const SerializationLatency& Histograms() { return latency_; }
+
+  // Lives for the whole of a ByteSizeLong(). The size pass is only kept
+  // until the next one or encode starts, which records it if it is an
+  // encode of the same type.
+  class ByteSizeScope {
+   public:
+    ByteSizeScope() : state_(ThreadLatencyState()), start_(0) {
+      top_level_ =
+          state_.byte_size_depth++ == 0 && state_.serialize_depth == 0;
+      if (top_level_) {
+        state_.pending = nullptr;
+        start_ = LatencyClock();
+      }
+    }
+
+    ~ByteSizeScope() {
+      --state_.byte_size_depth;
+      if (top_level_) {
+        state_.pending = &latency_;
+        state_.pending_ticks = LatencyClock() - start_;
+      }
+    }
+
+   private:
+    LatencyThreadState& state_;
+    bool top_level_;
+    uint64_t start_;
+  };
+
+  static uint64_t SerializeStart() {
+    auto& state = ThreadLatencyState();
+    if (state.serialize_depth++ == 0 && state.byte_size_depth == 0) {
+      if (state.pending == &latency_) {
+        latency_.byte_size.Record(state.pending_ticks);
+      }
+      state.pending = nullptr;
+    }
+    return LatencyClock();
+  }
+
+  static void SerializeEnd(uint64_t start) {
+    latency_.serialize.Record(LatencyClock() - start);
+    --ThreadLatencyState().serialize_depth;
+  }
+
+ private:
+  static SerializationLatency latency_;
+};
+
+template <typename T>
+SerializationLatency MessageLatency<T>::latency_;
+
+// The registry of the latencies of every message type generated in mode=latency
+// that is linked into the program.
+struct LatencyEntry {
+  const char* type_name;
+  const SerializationLatency* latency;
+};
+
+inline std::vector<LatencyEntry>& LatencyRegistry() {
+  static std::vector<LatencyEntry> registry;
+  return registry;
+}
+
+struct LatencyRegistration {
+  LatencyRegistration(const char* type_name,
+                      const SerializationLatency* latency) {
+    StartLatencyBaseline();
+    LatencyRegistry().push_back({type_name, latency});
+  }
+};
+
+// Writes count, p50, p99 and p999 in nanoseconds of the size pass and the
+// encode of every registered message type that has been serialized.
+inline void WriteLatencyReport(std::ostream& out) {
+  double ticks_per_ns = LatencyTicksPerNanosecond();
+
+  auto write = [&](const char* name, const char* phase,
+                   const LatencyHistogram& histogram) {
+    out << name << " " << phase << ": count=" << histogram.Count()
+        << " p50=" << histogram.Quantile(0.5) / ticks_per_ns << "ns"
+        << " p99=" << histogram.Quantile(0.99) / ticks_per_ns << "ns"
+        << " p999=" << histogram.Quantile(0.999) / ticks_per_ns << "ns\n";
+  };
+
+  for (auto& entry : LatencyRegistry()) {
+    if (entry.latency->serialize.Count() == 0) {
+      continue;
+    }
+    write(entry.type_name, "byte_size", entry.latency->byte_size);
+    write(entry.type_name, "serialize", entry.latency->serialize);
+  }
+}
+
+}  // namespace basic_insertions
+#endif  // BASIC_INSERTIONS_LATENCY_
+)";
+
+
+bool Generator::GenerateLatency(
+    const google::protobuf::Descriptor* message,
+    const google::protobuf::FileDescriptor* file,
+    google::protobuf::compiler::GeneratorContext* context) const {
+  using google::protobuf::compiler::StripProto;
+  auto hh_filename = StripProto(file->name()) + ".pb.h";
+  auto cc_filename = StripProto(file->name()) + ".pb.cc";
+
+  std::map<std::string, std::string> vars;
+  vars["class"] = ClassName(message);
+  vars["full_name"] = message->full_name();
+  vars["latency"] =
+      "::basic_insertions::MessageLatency<" + ClassName(message, true) + ">";
+
+  GetPrinter(hh_filename, "class_scope", context, message)->Print(vars,
+      "// Serialization latency (basic-insertions mode=latency)\n"
+      "static const ::basic_insertions::SerializationLatency&\n"
+      "SerializationHistograms() {\n"
+      "  return $latency$::Histograms();\n"
+      "}\n\n");
+
+  GetPrinter(cc_filename, "namespace_scope", context)->Print(vars,
+      "static const ::basic_insertions::LatencyRegistration\n"
+      "    $class$_latency_registration(\n"
+      "        \"$full_name$\", &$latency$::Histograms());\n");
+
+  // The point is at the top level of ByteSizeLong, which has no end point,
+  // so the size pass is timed by a local living until it returns.
+  GetPrinter(cc_filename, "message_byte_size_start", context, message)
+      ->Print(vars, "const $latency$::ByteSizeScope _latency_scope;\n");
+
+  // Both points are at the top level of _InternalSerialize, so the start time
+  // can be kept in a local.
+  GetPrinter(cc_filename, "serialize_to_array_start", context, message)
+      ->Print(vars,
+              "const uint64_t _latency_start = $latency$::SerializeStart();\n");
+
+  GetPrinter(cc_filename, "serialize_to_array_end", context, message)
+      ->Print(vars, "$latency$::SerializeEnd(_latency_start);\n");
+
+  return true;
+}
+
+
+// Support code shared by the serialization caches of all messages. Guarded for
+// the same reason as kCountersRuntime.
+const char* const kSerializationCacheRuntime = R"(
+#ifndef BASIC_INSERTIONS_SERIALIZATION_CACHE_
+#define BASIC_INSERTIONS_SERIALIZATION_CACHE_
+#include <atomic>
+#include <string>
+
+namespace basic_insertions {
+
+// The encoding of a message, kept from its last serialization until the
+// message changes.
+//
+// The cache is empty, being filled by one thread, or valid. Serializing a
+// const message from several threads is allowed, so the first thread to
+// find it empty fills it, while the others (and the encode that fills it)
+// serialize as if there were no cache.
+class SerializationCache {
+ public:
+  constexpr SerializationCache() {}
+  SerializationCache(const SerializationCache&) = delete;
+  SerializationCache& operator=(const SerializationCache&) = delete;
+
+  ~SerializationCache() {
+    if (owned_) {
+      delete bytes_;
+    }
+  }
+
+  void Invalidate() { state_.store(kEmpty, std::memory_order_relaxed); }
+
+  // The cached encoding, or nullptr if there is none.
+  const std::string* Get() const {
+    return state_.load(std::memory_order_acquire) == kValid ? bytes_ : nullptr;
+  }
+
+  // The cached encoding, encoding message into the cache first if it is
+  // empty. nullptr if another thread is filling it.
+  template <typename Message>
+  const std::string* GetOrFill(const Message& message) {
+    int state = state_.load(std::memory_order_acquire);
+    if (state == kValid) {
+      return bytes_;
+    }
+    if (state != kEmpty ||
+        !state_.compare_exchange_strong(state, kFilling,
+                                        std::memory_order_acquire)) {
+      return nullptr;
+    }
+
+    // The bytes of a message on an arena belong to the arena, as the
+    // destructors of such messages do not run.
+    if (bytes_ == nullptr) {
+      if (auto* arena = message.GetArena()) {
+        bytes_ = ::google::protobuf::Arena::Create<std::string>(arena);
+      } else {
+        bytes_ = new std::string();
+        owned_ = true;
+      }
+    }
+
+    bytes_->clear();
+    if (!message.AppendPartialToString(bytes_)) {
+      state_.store(kEmpty, std::memory_order_release);
+      return nullptr;
+    }
+    state_.store(kValid, std::memory_order_release);
+    return bytes_;
+  }
+
+ private:
+  enum { kEmpty, kFilling, kValid };
+
+  std::atomic<int> state_{kEmpty};
+  std::string* bytes_ = nullptr;
+  bool owned_ = false;
+};
+
+}  // namespace basic_insertions
+#endif  // BASIC_INSERTIONS_SERIALIZATION_CACHE_
+)";
+
+
+bool Generator::GenerateSerializationCache(
+    const google::protobuf::Descriptor* message,
+    const google::protobuf::FileDescriptor* file,
+    google::protobuf::compiler::GeneratorContext* context) const {
+  using google::protobuf::compiler::StripProto;
+  auto hh_filename = StripProto(file->name()) + ".pb.h";
+  auto cc_filename = StripProto(file->name()) + ".pb.cc";
+
+  // A cache that some setters would leave stale would serve the wrong bytes,
+  // so such a message has none, and invalidating it does nothing.
+  if (!MutatorsHaveInsertionPoints(message)) {
+    GetPrinter(hh_filename, "class_scope", context, message)->Print(
+        "// No serialization cache (basic-insertions mode=serialization_cache):\n"
+        "// the rvalue set_<field>(int, std::string&&) and\n"
+        "// add_<field>(std::string&&) of its repeated string fields could not\n"
+        "// invalidate it.\n"
+        "void InvalidateSerializationCache() {}\n\n");
+    return true;
+  }
+
+  GetPrinter(hh_filename, "class_scope", context, message)->Print(
+      "// Serialization cache (basic-insertions mode=serialization_cache). The\n"
+      "// setters, Clear, CopyFrom and MergeFrom of the message invalidate it;\n"
+      "// anything else that changes the message (Swap, move assignment,\n"
+      "// merging parses, clear_<field>, reflection, or writing through a\n"
+      "// pointer kept from a mutable_<field>) must call\n"
+      "// InvalidateSerializationCache.\n"
+      "mutable ::basic_insertions::SerializationCache _serialization_cache_;\n"
+      "void InvalidateSerializationCache() {\n"
+      "  _serialization_cache_.Invalidate();\n"
+      "}\n\n");
+
+  // Every change to the message invalidates the cache ...
+  for (int i = 0; i < message->field_count(); ++i) {
+    auto* field = message->field(i);
+    for (auto& point : MutatingInsertionPoints(field)) {
+      GetPrinter(point.second ? hh_filename : cc_filename,
+                 point.first + ":" + field->full_name(), context)
+          ->Print("_serialization_cache_.Invalidate();\n");
+    }
+  }
+
+  // Parsing into a message clears it first, and CopyFrom is a Clear and a
+  // MergeFrom.
+  GetPrinter(cc_filename, "message_clear_start", context, message)
+      ->Print("_serialization_cache_.Invalidate();\n");
+  GetPrinter(cc_filename, "class_specific_merge_from_start", context, message)
+      ->Print("_this->_serialization_cache_.Invalidate();\n");
+
+  // ... and while it has not changed, its size and encoding come from it.
+  // Deterministic serialization is left alone, as the cached encoding may
+  // not be deterministic.
+  GetPrinter(cc_filename, "message_byte_size_start", context, message)->Print(
+      "if (const auto* _cached_bytes = _serialization_cache_.Get()) {\n"
+      "  SetCachedSize(static_cast<int>(_cached_bytes->size()));\n"
+      "  return _cached_bytes->size();\n"
+      "}\n");
+
+  GetPrinter(cc_filename, "serialize_to_array_start", context, message)->Print(
+      "if (!stream->IsSerializationDeterministic()) {\n"
+      "  if (const auto* _cached_bytes = _serialization_cache_.GetOrFill(*this)) {\n"
+      "    return stream->WriteRaw(_cached_bytes->data(),\n"
+      "                            static_cast<int>(_cached_bytes->size()),\n"
+      "                            target);\n"
+      "  }\n"
+      "}\n");
+
+  return true;
+}
+
+
+// Support code shared by the field access counters of all messages. It builds
+// on EventCounters, so kCountersRuntime is emitted before it. Guarded for the
+// same reason as kCountersRuntime.
+const char* const kFieldAccessRuntime = R"(
+#ifndef BASIC_INSERTIONS_FIELD_ACCESS_
+#define BASIC_INSERTIONS_FIELD_ACCESS_
+#include <algorithm>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+namespace basic_insertions {
+
+// Whether to count this field access, for roughly one in rate accesses.
+//
+// Each thread counts down to its next sample. The distance between samples is
+// drawn uniformly from [1, 2 * rate - 1] rather than being rate itself, so a
+// loop touching a fixed sequence of fields does not always land its samples on
+// the same one.
+inline bool SampleFieldAccess(uint32_t rate) {
+  struct Sampler {
+    uint32_t countdown;
+    uint32_t random;
+  };
+  static thread_local Sampler sampler = {0, 0};
+
+  if (sampler.countdown > 1) {
+    --sampler.countdown;
+    return false;
+  }
+
+  if (sampler.random == 0) {
+    sampler.random = static_cast<uint32_t>(
+        reinterpret_cast<uintptr_t>(&sampler) >> 4) | 1;
+  }
+  sampler.random ^= sampler.random << 13;
+  sampler.random ^= sampler.random >> 17;
+  sampler.random ^= sampler.random << 5;
+  sampler.countdown = rate <= 1 ? 1 : 1 + sampler.random % (2 * rate - 1);
+  return true;
+}
+
+// Sampled per-thread counts of the reads and writes of each of the N fields of
+// messages of type T, in declaration order: the reads of field i are event
+// 2 * i and its writes event 2 * i + 1.
+template <typename T, int N, uint32_t Rate>
+class FieldAccessCounters {
+ public:
+  static constexpr int kEvents = 2 * N;
+
+  static void Get(int field) {
+    if (SampleFieldAccess(Rate)) {
+      Counters::Increment(2 * field);
+    }
+  }
+
+  static void Set(int field) {
+    if (SampleFieldAccess(Rate)) {
+      Counters::Increment(2 * field + 1);
+    }
+  }
+
+  // The estimated number of accesses: the samples of every thread, scaled up
+  // by the sample rate.
+  static void Snapshot(uint64_t* counts) {
+    uint64_t samples[kEvents];
+    Counters::Snapshot(samples);
+    for (int i = 0; i < kEvents; ++i) {
+      counts[i] = samples[i] * Rate;
+    }
+  }
+
+ private:
+  using Counters = EventCounters<FieldAccessCounters, kEvents>;
+};
+
+// The registry of the field access counters of every message type generated
+// in mode=field_access that is linked into the program.
+struct FieldAccessEntry {
+  const char* type_name;
+  int field_count;
+  const char* const* field_names;
+  void (*snapshot)(uint64_t* counts);
+};
+
+inline std::vector<FieldAccessEntry>& FieldAccessRegistry() {
+  static std::vector<FieldAccessEntry> registry;
+  return registry;
+}
+
+struct FieldAccessRegistration {
+  FieldAccessRegistration(const char* type_name, int field_count,
+                          const char* const* field_names,
+                          void (*snapshot)(uint64_t* counts)) {
+    FieldAccessRegistry().push_back(
+        {type_name, field_count, field_names, snapshot});
+  }
+};
+
+// Writes the estimated reads and writes of every field of every registered
+// message type that has been accessed, one field per line:
+//
+//   <message full name> <field name> <reads> <writes>
+//
+// which is the dump the field-renumber tool reads.
+inline void WriteFieldAccessReport(std::ostream& out) {
+  for (auto& entry : FieldAccessRegistry()) {
+    std::vector<uint64_t> counts(2 * static_cast<size_t>(entry.field_count));
+    entry.snapshot(counts.data());
+    if (std::all_of(counts.begin(), counts.end(),
+                    [](uint64_t count) { return count == 0; })) {
+      continue;
+    }
+
+    for (int i = 0; i < entry.field_count; ++i) {
+      out << entry.type_name << " " << entry.field_names[i] << " "
+          << counts[2 * i] << " " << counts[2 * i + 1] << "\n";
+    }
+  }
+}
+
+}  // namespace basic_insertions
+#endif  // BASIC_INSERTIONS_FIELD_ACCESS_
+)";
+
+
+// Helper function to get the insertion points of the accessors that read a
+// field, all of which are in the header.
+std::vector<std::string> ReadingInsertionPoints(
+    const google::protobuf::FieldDescriptor* field) {
+  if (field->is_map()) {
+    return {"field_map"};
+  }
+  if (field->is_repeated()) {
+    return {"field_get", "field_list"};
+  }
+  return {"field_get"};
+}
+
+
+bool Generator::GenerateFieldAccess(
+    const google::protobuf::Descriptor* message,
+    const google::protobuf::FileDescriptor* file,
+    google::protobuf::compiler::GeneratorContext* context,
+    const Options& options) const {
+  using google::protobuf::compiler::StripProto;
+  auto hh_filename = StripProto(file->name()) + ".pb.h";
+  auto cc_filename = StripProto(file->name()) + ".pb.cc";
+
+  if (message->field_count() == 0) {
+    return true;
+  }
+
+  std::map<std::string, std::string> vars;
+  vars["class"] = ClassName(message);
+  vars["full_name"] = message->full_name();
+  vars["field_count"] = std::to_string(message->field_count());
+  vars["rate"] = std::to_string(options.field_access_sample);
+  vars["counters"] = "::basic_insertions::FieldAccessCounters<" +
+                     ClassName(message, true) + ", " + vars["field_count"] +
+                     ", " + vars["rate"] + ">";
+
+  GetPrinter(hh_filename, "class_scope", context, message)->Print(vars,
+      "// Sampled field access counters (basic-insertions mode=field_access)\n"
+      "using FieldAccessCounters = $counters$;\n\n");
+
+  auto printer = GetPrinter(cc_filename, "namespace_scope", context);
+  printer->Print(vars, "static const char* const $class$_field_names[] = {\n");
+  for (int i = 0; i < message->field_count(); ++i) {
+    printer->Print("    \"$name$\",\n", "name", message->field(i)->name());
+  }
+  printer->Print(vars,
+      "};\n"
+      "static const ::basic_insertions::FieldAccessRegistration\n"
+      "    $class$_field_access_registration(\n"
+      "        \"$full_name$\", $field_count$, $class$_field_names,\n"
+      "        &$class$::FieldAccessCounters::Snapshot);\n");
+
+  // Every accessor of a field counts as a read or a write of it, by the index
+  // of the field in the message.
+  for (int i = 0; i < message->field_count(); ++i) {
+    auto* field = message->field(i);
+    vars["index"] = std::to_string(i);
+
+    for (auto& point : ReadingInsertionPoints(field)) {
+      GetPrinter(hh_filename, point + ":" + field->full_name(), context)
+          ->Print(vars, "FieldAccessCounters::Get($index$);\n");
+    }
+
+    for (auto& point : MutatingInsertionPoints(field)) {
+      GetPrinter(point.second ? hh_filename : cc_filename,
+                 point.first + ":" + field->full_name(), context)
+          ->Print(vars, "FieldAccessCounters::Set($index$);\n");
+    }
+  }
+
+  return true;
+}
+
+
+// Support code shared by the allocation trackers of all messages. It builds on
+// EventCounters, so kCountersRuntime is emitted before it. Guarded for the
+// same reason as kCountersRuntime.
+const char* const kAllocationsRuntime = R"(
+#ifndef BASIC_INSERTIONS_ALLOCATIONS_
+#define BASIC_INSERTIONS_ALLOCATIONS_
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+namespace basic_insertions {
+
+// How the instances of a message type were constructed and how many are
+// alive. Instances on an arena are never destroyed one by one, so live and
+// peak_live only count the others (on the heap, the stack or static).
+struct AllocationStats {
+  uint64_t heap_constructions;
+  uint64_t arena_constructions;
+  // Copy constructions, which are never on an arena.
+  uint64_t copy_constructions;
+  uint64_t destructions;
+  int64_t live;
+  // The most instances alive at once, to within kAllocationBatch per thread.
+  int64_t peak_live;
+};
+
+// Threads count constructions and destructions in their own EventCounters
+// block, and only add to the shared live count once their own count has
+// moved by this much, so constructing a message touches no shared memory.
+constexpr int64_t kAllocationBatch = 64;
+
+// The allocation tracking of messages of type T.
+template <typename T>
+class AllocationTracker {
+ public:
+  static void Construct(bool on_arena) {
+    if (on_arena) {
+      Counters::Increment(kArenaConstruction);
+    } else {
+      Counters::Increment(kHeapConstruction);
+      AddLive(1);
+    }
+  }
+
+  static void CopyConstruct() {
+    Counters::Increment(kCopyConstruction);
+    AddLive(1);
+  }
+
+  static void Destroy(bool on_arena) {
+    if (!on_arena) {
+      Counters::Increment(kDestruction);
+      AddLive(-1);
+    }
+  }
+
+  static AllocationStats Snapshot() {
+    uint64_t counts[kEventCount];
+    Counters::Snapshot(counts);
+
+    AllocationStats stats;
+    stats.heap_constructions = counts[kHeapConstruction];
+    stats.arena_constructions = counts[kArenaConstruction];
+    stats.copy_constructions = counts[kCopyConstruction];
+    stats.destructions = counts[kDestruction];
+    stats.live = static_cast<int64_t>(counts[kHeapConstruction] +
+                                      counts[kCopyConstruction] -
+                                      counts[kDestruction]);
+    stats.peak_live = peak_live_.load(std::memory_order_relaxed);
+    if (stats.live > stats.peak_live) {
+      stats.peak_live = stats.live;
+    }
+    return stats;
+  }
+
+ private:
+  enum Event {
+    kHeapConstruction,
+    kArenaConstruction,
+    kCopyConstruction,
+    kDestruction,
+    kEventCount
+  };
+
+  using Counters = EventCounters<AllocationTracker, kEventCount>;
+
+  static void AddLive(int64_t delta) {
+    pending_live_ += delta;
+    if (pending_live_ < kAllocationBatch && pending_live_ > -kAllocationBatch) {
+      return;
+    }
+
+    auto live = live_.fetch_add(pending_live_, std::memory_order_relaxed) +
+                pending_live_;
+    pending_live_ = 0;
+
+    auto peak = peak_live_.load(std::memory_order_relaxed);
+    while (live > peak && !peak_live_.compare_exchange_weak(
+                              peak, live, std::memory_order_relaxed)) {
+    }
+  }
+
+  static thread_local int64_t pending_live_;
+  static std::atomic<int64_t> live_;
+  static std::atomic<int64_t> peak_live_;
+};
+
+template <typename T>
+thread_local int64_t AllocationTracker<T>::pending_live_ = 0;
+
+template <typename T>
+std::atomic<int64_t> AllocationTracker<T>::live_{0};
+
+template <typename T>
+std::atomic<int64_t> AllocationTracker<T>::peak_live_{0};
+
+// The registry of the allocation trackers of every message type generated in
+// mode=allocations that is linked into the program.
+struct AllocationEntry {
+  const char* type_name;
+  AllocationStats (*snapshot)();
+};
+
+inline std::vector<AllocationEntry>& AllocationRegistry() {
+  static std::vector<AllocationEntry> registry;
+  return registry;
+}
+
+struct AllocationRegistration {
+  AllocationRegistration(const char* type_name, AllocationStats (*snapshot)()) {
+    AllocationRegistry().push_back({type_name, snapshot});
+  }
+};
+
+// Writes the allocation stats of every registered message type that has been
+// constructed.
+inline void WriteAllocationReport(std::ostream& out) {
+  for (auto& entry : AllocationRegistry()) {
+    auto stats = entry.snapshot();
+    if (stats.heap_constructions == 0 && stats.arena_constructions == 0 &&
+        stats.copy_constructions == 0) {
+      continue;
+    }
+    out << entry.type_name << ": live=" << stats.live
+        << " peak_live=" << stats.peak_live
+        << " heap=" << stats.heap_constructions
+        << " arena=" << stats.arena_constructions
+        << " copies=" << stats.copy_constructions
+        << " destroyed=" << stats.destructions << "\n";
+  }
+}
+
+}  // namespace basic_insertions
+#endif  // BASIC_INSERTIONS_ALLOCATIONS_
+)";
+
+
+bool Generator::GenerateAllocations(
+    const google::protobuf::Descriptor* message,
+    const google::protobuf::FileDescriptor* file,
+    google::protobuf::compiler::GeneratorContext* context) const {
+  using google::protobuf::compiler::StripProto;
+  auto hh_filename = StripProto(file->name()) + ".pb.h";
+  auto cc_filename = StripProto(file->name()) + ".pb.cc";
+
+  std::map<std::string, std::string> vars;
+  vars["class"] = ClassName(message);
+  vars["full_name"] = message->full_name();
+  vars["tracker"] =
+      "::basic_insertions::AllocationTracker<" + ClassName(message, true) + ">";
+
+  GetPrinter(hh_filename, "class_scope", context, message)->Print(vars,
+      "// Allocation tracking (basic-insertions mode=allocations)\n"
+      "static ::basic_insertions::AllocationStats AllocationSnapshot() {\n"
+      "  return $tracker$::Snapshot();\n"
+      "}\n\n");
+
+  GetPrinter(cc_filename, "namespace_scope", context)->Print(vars,
+      "static const ::basic_insertions::AllocationRegistration\n"
+      "    $class$_allocation_registration(\n"
+      "        \"$full_name$\", &$tracker$::Snapshot);\n");
+
+  // The default constructor and the move constructor delegate to the arena
+  // constructor, and the copy constructor is the only one that does not.
+  GetPrinter(cc_filename, "arena_constructor", context, message)->Print(vars,
+      "$tracker$::Construct(GetArenaForAllocation() != nullptr);\n");
+  GetPrinter(cc_filename, "copy_constructor", context, message)
+      ->Print(vars, "$tracker$::CopyConstruct();\n");
+  GetPrinter(cc_filename, "destructor", context, message)->Print(vars,
+      "$tracker$::Destroy(GetArenaForAllocation() != nullptr);\n");
+
+  return true;
+}
+
+
+bool Generator::GenerateFor(
+    const google::protobuf::Descriptor* message,
+    const google::protobuf::FileDescriptor* file,
+    google::protobuf::compiler::GeneratorContext* context,
+    const Options& options) const {
+  TraceSpan span("GenerateFor", message->full_name());
+
+  if (options.print && !GeneratePrints(message, file, context)) {
+    return false;
+  }
+
+  if (options.counters && !GenerateCounters(message, file, context)) {
+    return false;
+  }
+
+  if (options.latency && !GenerateLatency(message, file, context)) {
+    return false;
+  }
+
+  if (options.serialization_cache &&
+      !GenerateSerializationCache(message, file, context)) {
+    return false;
+  }
+
+  if (options.field_access &&
+      !GenerateFieldAccess(message, file, context, options)) {
+    return false;
+  }
+
+  if (options.allocations && !GenerateAllocations(message, file, context)) {
+    return false;
+  }
+
+  // Nested messages get the same code as top level ones; map entries have no
+  // generated class to insert into.
+  for (int i = 0; i < message->nested_type_count(); ++i) {
+    auto* nested = message->nested_type(i);
+    if (!nested->options().map_entry() &&
+        !GenerateFor(nested, file, context, options)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+bool Generator::ParseOptions(const std::string& parameter, Options* options,
+                             std::string* error) const {
+  std::vector<std::pair<std::string, std::string>> params;
+  google::protobuf::compiler::ParseGeneratorParameter(parameter, &params);
+
+  for (auto& param : params) {
+    if (param.first == "field_access_sample") {
+      char* end = nullptr;
+      auto value = strtoul(param.second.c_str(), &end, 10);
+      if (param.second.empty() || *end != '\0' || value == 0 ||
+          value > 1u << 30) {
+        *error = "expected a positive number for " + param.first;
+        return false;
+      }
+      options->field_access_sample = static_cast<uint32_t>(value);
+      continue;
+    }
+
+    if (param.first != "mode") {
+      *error = "unknown parameter: " + param.first;
       return false;
     }
+
+    if (param.second == "print") {
+      options->print = true;
+    } else if (param.second == "counters") {
+      options->counters = true;
+    } else if (param.second == "latency") {
+      options->latency = true;
+    } else if (param.second == "serialization_cache") {
+      options->serialization_cache = true;
+    } else if (param.second == "field_access") {
+      options->field_access = true;
+    } else if (param.second == "allocations") {
+      options->allocations = true;
+    } else {
+      *error = "unknown mode: " + param.second;
+      return false;
+    }
+  }
+
+  // Print statements are the default, as they show when each insertion point
+  // runs.
+  if (!options->counters && !options->latency &&
+      !options->serialization_cache && !options->field_access &&
+      !options->allocations) {
+    options->print = true;
+  }
+
+  return true;
+}
+
+
+bool Generator::GenerateFile(const google::protobuf::FileDescriptor* file,
+                             const std::string& parameter,
+                             google::protobuf::compiler::GeneratorContext* context,
+                             std::string* error) const {
+  Options options;
+  if (!ParseOptions(parameter, &options, error)) {
+    return false;
+  }
+
+  using google::protobuf::compiler::StripProto;
+  auto hh_filename = StripProto(file->name()) + ".pb.h";
+  auto cc_filename = StripProto(file->name()) + ".pb.cc";
+
+  if (options.print && file->message_type_count() > 0) {
+    InsertBasicStatement(hh_filename, "includes", context, nullptr, "#include <iostream>");
+    InsertBasicStatement(cc_filename, "includes", context, nullptr, "#include <iostream>");
+    InsertBasicStatement(cc_filename, "namespace_scope", context, nullptr,
+                         "// THIS WAS INSERTED INTO THE NAMESPACE SCOPE\n");
+    InsertBasicStatement(cc_filename, "global_scope", context, nullptr,
+                         "// THIS WAS INSERTER INTO THE GLOBAL SCOPE\n");
+  }
+
+  // The field access counters and the allocation trackers are built on the
+  // event counters.
+  if ((options.counters || options.field_access || options.allocations) &&
+      file->message_type_count() > 0) {
+    GetPrinter(hh_filename, "includes", context)->PrintRaw(kCountersRuntime);
+  }
+
+  if (options.latency && file->message_type_count() > 0) {
+    GetPrinter(hh_filename, "includes", context)->PrintRaw(kLatencyRuntime);
+  }
+
+  if (options.serialization_cache && file->message_type_count() > 0) {
+    GetPrinter(hh_filename, "includes", context)
+        ->PrintRaw(kSerializationCacheRuntime);
+  }
+
+  if (options.field_access && file->message_type_count() > 0) {
+    GetPrinter(hh_filename, "includes", context)->PrintRaw(kFieldAccessRuntime);
+  }
+
+  if (options.allocations && file->message_type_count() > 0) {
+    GetPrinter(hh_filename, "includes", context)->PrintRaw(kAllocationsRuntime);
   }
 
   return true;
 }
+
+
+bool Generator::GenerateMessage(
+    const google::protobuf::Descriptor* message, const std::string& parameter,
+    google::protobuf::compiler::GeneratorContext* context,
+    std::string* error) const {
+  Options options;
+  if (!ParseOptions(parameter, &options, error)) {
+    return false;
+  }
+
+  return GenerateFor(message, message->file(), context, options);
+}
+
+}  // namespace basic_insertions
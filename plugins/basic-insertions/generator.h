@@ -1,28 +1,95 @@
 #ifndef MYAPP_BASIC_INSERTIONS_GENERATOR
 #define MYAPP_BASIC_INSERTIONS_GENERATOR
 
+#include "common/parallel_generator.h"
+
 #include <google/protobuf/compiler/code_generator.h>
 #include <google/protobuf/compiler/plugin.h>
 #include <google/protobuf/descriptor.h>
 #include <google/protobuf/io/printer.h>
 #include <google/protobuf/io/zero_copy_stream.h>
 
+#include <cstdint>
 #include <string>
 
-class Generator : public google::protobuf::compiler::CodeGenerator {
+namespace basic_insertions {
+
+class Generator : public ParallelGenerator {
  public:
   inline Generator() {}
   inline ~Generator() {}
 
-  bool Generate(const google::protobuf::FileDescriptor* file,
-                const std::string& parameter,
-                google::protobuf::compiler::GeneratorContext* context,
-                std::string* error) const override;
+ protected:
+  std::string Version() const override;
+
+  bool GenerateFile(const google::protobuf::FileDescriptor* file,
+                    const std::string& parameter,
+                    google::protobuf::compiler::GeneratorContext* context,
+                    std::string* error) const override;
+
+  bool GenerateMessage(const google::protobuf::Descriptor* message,
+                       const std::string& parameter,
+                       google::protobuf::compiler::GeneratorContext* context,
+                       std::string* error) const override;
 
  private:
+  // What to insert, from the plugin parameter, e.g.
+  // --basic-insertions_opt=mode=counters. Modes can be combined by repeating
+  // the mode parameter.
+  struct Options {
+    // mode=print (the default): print each insertion point as it runs.
+    bool print = false;
+    // mode=counters: per-thread counters of each insertion point.
+    bool counters = false;
+    // mode=latency: histograms of the serialization latency of each message.
+    bool latency = false;
+    // mode=serialization_cache: keep the encoding of each message until it
+    // changes, and serialize unchanged messages from it.
+    bool serialization_cache = false;
+    // mode=field_access: sampled per-thread counts of the reads and writes of
+    // each field, one in field_access_sample=N (default 64) accesses.
+    bool field_access = false;
+    uint32_t field_access_sample = 64;
+    // mode=allocations: live, peak, heap, arena and copy construction counts
+    // of each message.
+    bool allocations = false;
+  };
+
+  bool ParseOptions(const std::string& parameter, Options* options,
+                    std::string* error) const;
+
   bool GenerateFor(const google::protobuf::Descriptor* message,
                    const google::protobuf::FileDescriptor* file,
-                   google::protobuf::compiler::GeneratorContext* context) const;
+                   google::protobuf::compiler::GeneratorContext* context,
+                   const Options& options) const;
+
+  bool GeneratePrints(const google::protobuf::Descriptor* message,
+                      const google::protobuf::FileDescriptor* file,
+                      google::protobuf::compiler::GeneratorContext* context) const;
+
+  bool GenerateCounters(const google::protobuf::Descriptor* message,
+                        const google::protobuf::FileDescriptor* file,
+                        google::protobuf::compiler::GeneratorContext* context) const;
+
+  bool GenerateLatency(const google::protobuf::Descriptor* message,
+                       const google::protobuf::FileDescriptor* file,
+                       google::protobuf::compiler::GeneratorContext* context) const;
+
+  bool GenerateSerializationCache(
+      const google::protobuf::Descriptor* message,
+      const google::protobuf::FileDescriptor* file,
+      google::protobuf::compiler::GeneratorContext* context) const;
+
+  bool GenerateFieldAccess(const google::protobuf::Descriptor* message,
+                           const google::protobuf::FileDescriptor* file,
+                           google::protobuf::compiler::GeneratorContext* context,
+                           const Options& options) const;
+
+  bool GenerateAllocations(const google::protobuf::Descriptor* message,
+                           const google::protobuf::FileDescriptor* file,
+                           google::protobuf::compiler::GeneratorContext* context) const;
 };
 
+}  // namespace basic_insertions
+
 #endif // MYAPP_BASIC_INSERTIONS_GENERATOR
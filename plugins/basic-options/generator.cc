@@ -1,18 +1,35 @@
 #include "generator.h"
 
+#include "common/insertion.h"
+#include "common/trace.h"
+
 #include <google/protobuf/compiler/code_generator.h>
 #include <google/protobuf/compiler/cpp/cpp_generator.h>
 #include <google/protobuf/compiler/plugin.h>
 #include <google/protobuf/descriptor.h>
 #include <google/protobuf/descriptor.pb.h>
 #include <google/protobuf/message.h>
+#include <google/protobuf/io/coded_stream.h>
 #include <google/protobuf/io/printer.h>
+#include <protos/options.pb.h>
 
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
 #include <memory>
+#include <set>
 #include <string>
 #include <utility>
 #include <vector>
 
+namespace basic_options {
+
 
 template <typename T>
 std::string Generator::convert_scoped(const T* message) const {
@@ -55,99 +72,1580 @@ std::string Generator::convert_unscoped(const T* message) const {
 }
 
 
-// Helper function to get the full name for an insertion point.
-std::string GetFullInsertionPoint(
-    const std::string& point_name,
-    const google::protobuf::Descriptor* message = nullptr) {
-  return message == nullptr ? point_name
-                            : point_name + ":" + message->full_name();
-}
+// Helper function to escape bytes into the body of a c++ string literal.
+std::string EscapeStringLiteral(const std::string& value) {
+  std::string s;
 
+  for (unsigned char c : value) {
+    switch (c) {
+      case '\n': s += "\\n"; break;
+      case '\r': s += "\\r"; break;
+      case '\t': s += "\\t"; break;
+      case '\"': s += "\\\""; break;
+      case '\'': s += "\\\'"; break;
+      case '\\': s += "\\\\"; break;
+      case '?': s += "\\?"; break;  // avoid trigraphs
+      default:
+        if (c < 0x20 || c >= 0x7f) {
+          // Always use three octal digits so that a following digit can never
+          // be read as part of the escape.
+          char octal[5];
+          snprintf(octal, sizeof(octal), "\\%03o", c);
+          s += octal;
+        } else {
+          s += static_cast<char>(c);
+        }
+    }
+  }
 
-// Helper function to return a pointer to an inserter stream
-google::protobuf::io::ZeroCopyOutputStream* GetInserter(
-    const std::string& file_name, const std::string& insertion_point,
-    google::protobuf::compiler::GeneratorContext* context,
-    const google::protobuf::Descriptor* message = nullptr) {
-  auto full_insertion_point = GetFullInsertionPoint(insertion_point, message);
-  return context->OpenForInsert(file_name, full_insertion_point);
+  return s;
 }
 
 
-// Helper function to return a printer for an insertion point
-std::shared_ptr<google::protobuf::io::Printer> GetPrinter(
-    const std::string& file_name, const std::string& insertion_point,
-    google::protobuf::compiler::GeneratorContext* context,
-    const google::protobuf::Descriptor* message = nullptr) {
-  auto* inserter = GetInserter(file_name, insertion_point, context, message);
-  return std::make_shared<google::protobuf::io::Printer>(inserter, '$');
+// Helper function to format a floating point default as a c++ literal of the
+// given type ("float" or "double").
+std::string FloatingPointLiteral(double value, const std::string& type) {
+  if (std::isnan(value)) {
+    return "::std::numeric_limits<" + type + ">::quiet_NaN()";
+  }
+  if (std::isinf(value)) {
+    return std::string(value < 0 ? "-" : "") + "::std::numeric_limits<" + type +
+           ">::infinity()";
+  }
+
+  char buffer[64];
+  snprintf(buffer, sizeof(buffer), type == "float" ? "%.9g" : "%.17g", value);
+  std::string s = buffer;
+
+  if (s.find_first_of(".e") == std::string::npos) {
+    s += ".0";
+  }
+
+  return type == "float" ? s + "f" : s;
 }
 
 
 void PrintField(const google::protobuf::FieldDescriptor* field) {
-  std::cerr << "\n-------------------------------------------------------\n";
-  std::cerr << "FIELD: " << field->full_name();
-  std::cerr << "\n-------------------------------------------------------\n";
+  TraceSpan span("PrintField", field->full_name());
+  auto& diagnostics = GenerationDiagnostics();
 
-  // std::cerr << field->DebugString() << "\n";
-  // std::cerr << "\t* is_extension? " << field->is_extension() << "\n";
-  // std::cerr << "\t* is_repeated? " << field->is_repeated() << "\n";
-  // std::cerr << "\t* is_map? " << field->is_map() << "\n";
+  diagnostics << "\n-------------------------------------------------------\n";
+  diagnostics << "FIELD: " << field->full_name();
+  diagnostics << "\n-------------------------------------------------------\n";
+
+  // diagnostics << field->DebugString() << "\n";
+  // diagnostics << "\t* is_extension? " << field->is_extension() << "\n";
+  // diagnostics << "\t* is_repeated? " << field->is_repeated() << "\n";
+  // diagnostics << "\t* is_map? " << field->is_map() << "\n";
 
   //
   // Field Options
   //
   auto opts = field->options();
   auto* opts_desc = opts.GetDescriptor();
-  std::cerr << "\t* Field Options\n";
-  std::cerr << opts.DebugString() << "\n";
+  diagnostics << "\t* Field Options\n";
+  diagnostics << opts.DebugString() << "\n";
 
   //
   // UNINTERPRETED OPTIONS
   //
   auto num_uninterpreted = opts.uninterpreted_option_size();
-  std::cerr << "\t* " << num_uninterpreted << " uninterpreted options\n";
+  diagnostics << "\t* " << num_uninterpreted << " uninterpreted options\n";
   for (auto k = 0; k < num_uninterpreted; ++k) {
     auto uo = opts.uninterpreted_option(k);
-    std::cerr << "\t\t" << uo.DebugString() << "\n";
+    diagnostics << "\t\t" << uo.DebugString() << "\n";
   }
 
   //
   // OPTION FIELDS
   //
   auto opt_field_count = opts_desc->field_count();
-  std::cerr << "\t* " << opt_field_count << " option fields\n";
+  diagnostics << "\t* " << opt_field_count << " option fields\n";
   for (auto j = 0; j < opt_field_count; ++j) {
     auto* opt_fld = opts_desc->field(j);
-    std::cerr << "\t\t" << opt_fld->name() << "\n";
+    diagnostics << "\t\t" << opt_fld->name() << "\n";
   }
 
   //
   // OPTION ENUMS
   //
   auto opt_enum_count = opts_desc->enum_type_count();
-  std::cerr << "\t* " << opt_enum_count << " option enum types\n";
+  diagnostics << "\t* " << opt_enum_count << " option enum types\n";
   for (auto j = 0; j < opt_enum_count; ++j) {
     auto* et = opts_desc->enum_type(j);
-    std::cerr << "\t\t" << et->name() << "\n";
+    diagnostics << "\t\t" << et->name() << "\n";
   }
 
   //
   // OPTION EXTENSIONS
   //
   auto opt_ext_count = opts_desc->extension_count();
-  std::cerr << "\t* " << opt_ext_count << " option extensions\n";
+  diagnostics << "\t* " << opt_ext_count << " option extensions\n";
   for (auto j = 0; j < opt_ext_count; ++j) {
     auto* ext = opts_desc->extension(j);
-    std::cerr << "\t\t" << ext->name() << "\n";
+    diagnostics << "\t\t" << ext->name() << "\n";
   }
 }
 
 
-bool Generator::GenerateFor(
+bool Generator::option_constant(
+    const google::protobuf::FieldDescriptor* field, const std::string& option,
+    const std::string& value, std::string* type, std::string* literal,
+    std::string* error) const {
+  using google::protobuf::FieldDescriptor;
+
+  auto invalid = [&]() {
+    *error = "invalid " + option + " \"" + value + "\" for " +
+             field->cpp_type_name() + " field " + field->full_name();
+    return false;
+  };
+
+  if (field->is_repeated()) {
+    *error = option + " is not supported on repeated field " +
+             field->full_name();
+    return false;
+  }
+
+  const char* begin = value.c_str();
+  char* end = nullptr;
+  errno = 0;
+
+  switch (field->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_INT32: {
+      long long v = strtoll(begin, &end, 10);
+      if (value.empty() || *end != '\0' || errno == ERANGE ||
+          v < INT32_MIN || v > INT32_MAX) {
+        return invalid();
+      }
+      *type = "int32_t";
+      *literal = v == INT32_MIN ? "(-2147483647 - 1)" : std::to_string(v);
+      return true;
+    }
+    case FieldDescriptor::CPPTYPE_INT64: {
+      long long v = strtoll(begin, &end, 10);
+      if (value.empty() || *end != '\0' || errno == ERANGE) {
+        return invalid();
+      }
+      *type = "int64_t";
+      *literal = v == INT64_MIN ? "(-9223372036854775807LL - 1)"
+                                : std::to_string(v) + "LL";
+      return true;
+    }
+    case FieldDescriptor::CPPTYPE_UINT32: {
+      unsigned long long v = strtoull(begin, &end, 10);
+      if (value.empty() || value[0] == '-' || *end != '\0' ||
+          errno == ERANGE || v > UINT32_MAX) {
+        return invalid();
+      }
+      *type = "uint32_t";
+      *literal = std::to_string(v) + "u";
+      return true;
+    }
+    case FieldDescriptor::CPPTYPE_UINT64: {
+      unsigned long long v = strtoull(begin, &end, 10);
+      if (value.empty() || value[0] == '-' || *end != '\0' ||
+          errno == ERANGE) {
+        return invalid();
+      }
+      *type = "uint64_t";
+      *literal = std::to_string(v) + "ULL";
+      return true;
+    }
+    case FieldDescriptor::CPPTYPE_DOUBLE:
+    case FieldDescriptor::CPPTYPE_FLOAT: {
+      double v = strtod(begin, &end);
+      if (value.empty() || *end != '\0') {
+        return invalid();
+      }
+      *type = field->cpp_type_name();
+      *literal = FloatingPointLiteral(v, *type);
+      return true;
+    }
+    case FieldDescriptor::CPPTYPE_BOOL: {
+      if (value != "true" && value != "false") {
+        return invalid();
+      }
+      *type = "bool";
+      *literal = value;
+      return true;
+    }
+    case FieldDescriptor::CPPTYPE_ENUM: {
+      auto* enum_type = field->enum_type();
+      auto* enum_value = enum_type->FindValueByName(value);
+      if (enum_value == nullptr) {
+        return invalid();
+      }
+
+      // Nested enum values are prefixed with the enum's name; top level ones
+      // live directly in the enum's namespace.
+      auto scoped = convert_scoped(enum_type);
+      std::string prefix;
+      if (enum_type->containing_type()) {
+        prefix = scoped + "_";
+      } else if (scoped.rfind("::") != std::string::npos) {
+        prefix = scoped.substr(0, scoped.rfind("::") + 2);
+      }
+
+      *type = "::" + scoped;
+      *literal = "::" + prefix + enum_value->name();
+      return true;
+    }
+    case FieldDescriptor::CPPTYPE_STRING: {
+      *type = "char";
+      *literal = "\"" + EscapeStringLiteral(value) + "\"";
+      return true;
+    }
+    case FieldDescriptor::CPPTYPE_MESSAGE:
+      break;
+  }
+
+  *error = option + " is not supported on message field " +
+           field->full_name();
+  return false;
+}
+
+
+std::string Generator::Version() const {
+  return "basic-options/1";
+}
+
+
+bool Generator::GenerateDefaults(
+    const google::protobuf::Descriptor* message,
+    const google::protobuf::FileDescriptor* file,
+    google::protobuf::compiler::GeneratorContext* context,
+    std::string* error) const {
+  using google::protobuf::FieldDescriptor;
+
+  std::vector<std::map<std::string, std::string>> defaults;
+
+  for (auto i = 0; i < message->field_count(); ++i) {
+    auto* field = message->field(i);
+    auto& opts = field->options().GetExtension(example::field_options);
+
+    if (opts.default_value().empty()) {
+      continue;
+    }
+
+    std::map<std::string, std::string> vars;
+    if (!option_constant(field, "default_value", opts.default_value(),
+                         &vars["type"], &vars["literal"], error)) {
+      return false;
+    }
+
+    vars["class"] = convert_unscoped(message);
+    vars["field"] = field->lowercase_name();
+    vars["constant"] = "k" + CamelCase(field->name()) + "DefaultValue";
+    vars["is_string"] =
+        field->cpp_type() == FieldDescriptor::CPPTYPE_STRING ? "1" : "";
+    defaults.push_back(vars);
+  }
+
+  if (defaults.empty()) {
+    return true;
+  }
+
+  using google::protobuf::compiler::StripProto;
+  auto hh_filename = StripProto(file->name()) + ".pb.h";
+  auto cc_filename = StripProto(file->name()) + ".pb.cc";
+
+  // Declare a typed constant for each default in the class, ...
+  auto class_scope = GetPrinter(hh_filename, "class_scope", context, message);
+  class_scope->Print("// Defaults from (example.field_options).default_value\n");
+  for (auto& vars : defaults) {
+    class_scope->Print(vars, vars["is_string"].empty()
+        ? "static constexpr $type$ $constant$ = $literal$;\n"
+        : "static constexpr $type$ $constant$[] = $literal$;\n");
+  }
+  class_scope->Print("\n");
+
+  // ... define it for odr-uses (c++11 has no inline variables), ...
+  auto namespace_scope = GetPrinter(cc_filename, "namespace_scope", context);
+  for (auto& vars : defaults) {
+    namespace_scope->Print(vars, vars["is_string"].empty()
+        ? "constexpr $type$ $class$::$constant$;\n"
+        : "constexpr $type$ $class$::$constant$[];\n");
+  }
+
+  // ... and assign it to every new instance. Strings are copied straight
+  // from the shared constant, so there is no lookup and no temporary.
+  auto arena_constructor =
+      GetPrinter(cc_filename, "arena_constructor", context, message);
+  for (auto& vars : defaults) {
+    arena_constructor->Print(vars, vars["is_string"].empty()
+        ? "set_$field$($constant$);\n"
+        : "set_$field$($constant$, sizeof($constant$) - 1);\n");
+  }
+
+  return true;
+}
+
+
+// Support code shared by the initializable_types of all messages, guarded
+// like kFieldMetadataRuntime.
+const char* const kInitializerRuntime = R"(
+#ifndef BASIC_OPTIONS_OPTIONAL_
+#define BASIC_OPTIONS_OPTIONAL_
+#include <type_traits>
+#include <utility>
+
+namespace basic_options {
+
+// A value that can be left unset: the initializable_type member of a field
+// that has presence or a default_value, so leaving it out keeps the field
+// unset, or at its default.
+template <typename T>
+class Optional {
+ public:
+  Optional() : has_value_(false), value_() {}
+
+  template <typename U,
+            typename = typename std::enable_if<
+                std::is_convertible<U&&, T>::value>::type>
+  Optional(U&& value) : has_value_(true), value_(std::forward<U>(value)) {}
+
+  bool has_value() const { return has_value_; }
+  const T& value() const { return value_; }
+  T& value() { return value_; }
+
+  void reset() {
+    has_value_ = false;
+    value_ = T();
+  }
+
+ private:
+  bool has_value_;
+  T value_;
+};
+
+}  // namespace basic_options
+#endif  // BASIC_OPTIONS_OPTIONAL_
+)";
+
+
+// Whether the initializable_type member of field is an Optional: singular
+// non-message fields with presence or a default_value. Singular messages are
+// already nullable.
+bool InitializableOptional(const google::protobuf::FieldDescriptor* field) {
+  using google::protobuf::FieldDescriptor;
+
+  if (field->is_repeated() ||
+      field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE) {
+    return false;
+  }
+  auto& opts = field->options().GetExtension(example::field_options);
+  return field->has_presence() || !opts.default_value().empty();
+}
+
+
+std::string Generator::initializable_member_type(
+    const google::protobuf::FieldDescriptor* field) const {
+  using google::protobuf::FieldDescriptor;
+
+  std::string type;
+  switch (field->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_INT32:
+      type = "int32_t";
+      break;
+    case FieldDescriptor::CPPTYPE_INT64:
+      type = "int64_t";
+      break;
+    case FieldDescriptor::CPPTYPE_UINT32:
+      type = "uint32_t";
+      break;
+    case FieldDescriptor::CPPTYPE_UINT64:
+      type = "uint64_t";
+      break;
+    case FieldDescriptor::CPPTYPE_DOUBLE:
+      type = "double";
+      break;
+    case FieldDescriptor::CPPTYPE_FLOAT:
+      type = "float";
+      break;
+    case FieldDescriptor::CPPTYPE_BOOL:
+      type = "bool";
+      break;
+    case FieldDescriptor::CPPTYPE_ENUM:
+      type = "::" + convert_scoped(field->enum_type());
+      break;
+    case FieldDescriptor::CPPTYPE_STRING:
+      type = "::std::string";
+      break;
+    case FieldDescriptor::CPPTYPE_MESSAGE:
+      type = "::" + convert_scoped(field->message_type());
+      break;
+  }
+
+  // Singular messages are held by pointer, so that they can be left unset
+  // and handed over without a copy.
+  if (field->is_repeated()) {
+    return "::std::vector<" + type + ">";
+  } else if (field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE) {
+    return "::std::unique_ptr<" + type + ">";
+  } else if (InitializableOptional(field)) {
+    return "::basic_options::Optional<" + type + ">";
+  }
+  return type;
+}
+
+
+bool Generator::GenerateInitializer(
+    const google::protobuf::Descriptor* message,
+    const google::protobuf::FileDescriptor* file,
+    google::protobuf::compiler::GeneratorContext* context,
+    std::string* error) const {
+  using google::protobuf::FieldDescriptor;
+  using google::protobuf::compiler::StripProto;
+  auto hh_filename = StripProto(file->name()) + ".pb.h";
+
+  std::map<std::string, std::string> vars;
+  vars["class"] = convert_unscoped(message);
+
+  // Declare the struct and the constructors in the class, ...
+  auto class_scope = GetPrinter(hh_filename, "class_scope", context, message);
+  class_scope->Print(vars,
+      "// Every field at once, except for maps and oneofs; unset messages are\n"
+      "// null. Building from an rvalue moves the strings and messages into\n"
+      "// place instead of copying them.\n"
+      "struct initializable_type;\n"
+      "explicit $class$(const initializable_type& t);\n"
+      "explicit $class$(initializable_type&& t);\n"
+      "\n");
+
+  // ... and define them after every class of the file is complete, so that
+  // members can be of any message type.
+  auto namespace_scope = GetPrinter(hh_filename, "namespace_scope", context);
+  namespace_scope->Print(vars, "struct $class$::initializable_type {\n");
+  namespace_scope->Indent();
+
+  std::vector<const FieldDescriptor*> fields;
+  for (auto i = 0; i < message->field_count(); ++i) {
+    auto* field = message->field(i);
+    if (field->is_map() || field->real_containing_oneof() != nullptr) {
+      continue;
+    }
+    fields.push_back(field);
+  }
+
+  // A constructor taking every member in order, each of which defaults to
+  // unset, or zero, so the struct is built like an aggregate whose trailing
+  // members can be left out, and never holds indeterminate values. (The
+  // separators carry the indent, as the printer only indents its text.)
+  namespace_scope->Print("initializable_type(");
+  for (size_t i = 0; i < fields.size(); ++i) {
+    namespace_scope->Print("$separator$$type$ $member$_value = {}",
+                           "separator", i == 0 ? "\n      " : ",\n      ",
+                           "type", initializable_member_type(fields[i]),
+                           "member", fields[i]->lowercase_name());
+  }
+  namespace_scope->Print(")");
+  for (size_t i = 0; i < fields.size(); ++i) {
+    auto* field = fields[i];
+    auto by_value = !field->is_repeated() &&
+                    field->cpp_type() != FieldDescriptor::CPPTYPE_STRING &&
+                    field->cpp_type() != FieldDescriptor::CPPTYPE_MESSAGE &&
+                    !InitializableOptional(field);
+    namespace_scope->Print(by_value
+        ? "$separator$$member$($member$_value)"
+        : "$separator$$member$(::std::move($member$_value))",
+        "separator", i == 0 ? "\n      : " : ",\n        ",
+        "member", field->lowercase_name());
+  }
+  namespace_scope->Print(" {}\n");
+  if (!fields.empty()) {
+    namespace_scope->Print("\n");
+  }
+
+  for (auto* field : fields) {
+    namespace_scope->Print("$type$ $member$;\n",
+                           "type", initializable_member_type(field),
+                           "member", field->lowercase_name());
+  }
+
+  namespace_scope->Outdent();
+  namespace_scope->Print("};\n\n");
+
+  for (auto move : {false, true}) {
+    // t is unnamed when there are no fields to take from it.
+    vars["t"] = fields.empty() ? "" : " t";
+    namespace_scope->Print(vars, move
+        ? "inline $class$::$class$(initializable_type&&$t$) : $class$() {\n"
+        : "inline $class$::$class$(const initializable_type&$t$) : $class$() {\n");
+    namespace_scope->Indent();
+
+    for (auto* field : fields) {
+      std::map<std::string, std::string> field_vars;
+      field_vars["field"] = field->lowercase_name();
+      field_vars["element"] = move ? "::std::move(element)" : "element";
+      field_vars["ref"] = move ? "auto&" : "const auto&";
+
+      auto cpp_type = field->cpp_type();
+      auto is_string = cpp_type == FieldDescriptor::CPPTYPE_STRING;
+      auto is_message = cpp_type == FieldDescriptor::CPPTYPE_MESSAGE;
+
+      if (!field->is_repeated() && is_message) {
+        namespace_scope->Print(field_vars, move
+            ? "set_allocated_$field$(t.$field$.release());\n"
+            : "if (t.$field$) {\n"
+              "  mutable_$field$()->CopyFrom(*t.$field$);\n"
+              "}\n");
+      } else if (!field->is_repeated() && InitializableOptional(field)) {
+        // Left unset, the field keeps its presence and default.
+        namespace_scope->Print(field_vars, move && is_string
+            ? "if (t.$field$.has_value()) {\n"
+              "  set_$field$(::std::move(t.$field$.value()));\n"
+              "}\n"
+            : "if (t.$field$.has_value()) {\n"
+              "  set_$field$(t.$field$.value());\n"
+              "}\n");
+      } else if (!field->is_repeated()) {
+        namespace_scope->Print(field_vars, move && is_string
+            ? "set_$field$(::std::move(t.$field$));\n"
+            : "set_$field$(t.$field$);\n");
+      } else if (is_string || is_message) {
+        namespace_scope->Print(field_vars,
+            "mutable_$field$()->Reserve(static_cast<int>(t.$field$.size()));\n"
+            "for ($ref$ element : t.$field$) {\n");
+        namespace_scope->Print(field_vars, is_string
+            ? "  add_$field$($element$);\n"
+            : "  *add_$field$() = $element$;\n");
+        namespace_scope->Print("}\n");
+      } else {
+        namespace_scope->Print(field_vars,
+            "mutable_$field$()->Add(t.$field$.begin(), t.$field$.end());\n");
+      }
+    }
+
+    namespace_scope->Outdent();
+    namespace_scope->Print("}\n\n");
+  }
+
+  return true;
+}
+
+
+// Support code shared by the field metadata of all messages. It is emitted into
+// the includes of every generated header, so it is guarded against being
+// defined more than once per translation unit.
+const char* const kFieldMetadataRuntime = R"(
+#ifndef BASIC_OPTIONS_FIELD_METADATA_
+#define BASIC_OPTIONS_FIELD_METADATA_
+#include <cstdint>
+#include <google/protobuf/descriptor.h>
+
+namespace basic_options {
+
+// The wire types of the protobuf encoding.
+enum class WireType : uint8_t {
+  kVarint = 0,
+  kFixed64 = 1,
+  kLengthDelimited = 2,
+  kStartGroup = 3,
+  kEndGroup = 4,
+  kFixed32 = 5,
+};
+
+// What Descriptor and Reflection tell about a field, known at compile time.
+struct FieldInfo {
+  const char* name;
+  int number;
+  // The wire type of the field as it is encoded, i.e. kLengthDelimited for
+  // packed repeated fields.
+  WireType wire_type;
+  ::google::protobuf::FieldDescriptor::CppType cpp_type;
+  bool is_repeated;
+  // The (example.field_options).default_value of the field as written in the
+  // .proto file, or nullptr.
+  const char* default_value;
+};
+
+}  // namespace basic_options
+#endif  // BASIC_OPTIONS_FIELD_METADATA_
+)";
+
+
+// Helper function to get the wire type a field is encoded with.
+std::string WireTypeName(const google::protobuf::FieldDescriptor* field) {
+  using google::protobuf::FieldDescriptor;
+
+  if (field->is_packed()) {
+    return "kLengthDelimited";
+  }
+
+  switch (field->type()) {
+    case FieldDescriptor::TYPE_FIXED64:
+    case FieldDescriptor::TYPE_SFIXED64:
+    case FieldDescriptor::TYPE_DOUBLE:
+      return "kFixed64";
+    case FieldDescriptor::TYPE_FIXED32:
+    case FieldDescriptor::TYPE_SFIXED32:
+    case FieldDescriptor::TYPE_FLOAT:
+      return "kFixed32";
+    case FieldDescriptor::TYPE_STRING:
+    case FieldDescriptor::TYPE_BYTES:
+    case FieldDescriptor::TYPE_MESSAGE:
+      return "kLengthDelimited";
+    case FieldDescriptor::TYPE_GROUP:
+      return "kStartGroup";
+    default:
+      return "kVarint";
+  }
+}
+
+
+// Helper function to get the name of the CppType constant of a field.
+std::string CppTypeName(const google::protobuf::FieldDescriptor* field) {
+  std::string name = "CPPTYPE_";
+  for (char c : std::string(field->cpp_type_name())) {
+    name += static_cast<char>(toupper(c));
+  }
+  return name;
+}
+
+
+bool Generator::GenerateFieldMetadata(
+    const google::protobuf::Descriptor* message,
+    const google::protobuf::FileDescriptor* file,
+    google::protobuf::compiler::GeneratorContext* context,
+    std::string* error) const {
+  using google::protobuf::FieldDescriptor;
+  using google::protobuf::compiler::StripProto;
+  auto hh_filename = StripProto(file->name()) + ".pb.h";
+  auto cc_filename = StripProto(file->name()) + ".pb.cc";
+
+  std::map<std::string, std::string> vars;
+  vars["class"] = convert_unscoped(message);
+  vars["field_count"] = std::to_string(message->field_count());
+
+  // The table and the declarations go in the class, ...
+  auto class_scope = GetPrinter(hh_filename, "class_scope", context, message);
+  class_scope->Print(vars,
+      "// Field metadata, in declaration order. FieldMetadata has a type for\n"
+      "// each field, named after it, with its metadata and accessors as\n"
+      "// static members, and for_each_field(f) calls f with an instance of\n"
+      "// each of them in turn.\n"
+      "static constexpr int kFieldCount = $field_count$;\n");
+  if (message->field_count() > 0) {
+    class_scope->Print(vars,
+        "static constexpr ::basic_options::FieldInfo "
+        "kFieldTable[$field_count$] = {\n");
+    class_scope->Indent();
+    for (auto i = 0; i < message->field_count(); ++i) {
+      auto* field = message->field(i);
+      auto& opts = field->options().GetExtension(example::field_options);
+      class_scope->Print(
+          "{\"$name$\", $number$, ::basic_options::WireType::$wire_type$,\n"
+          " ::google::protobuf::FieldDescriptor::$cpp_type$, $repeated$, "
+          "$default$},\n",
+          "name", field->name(), "number", std::to_string(field->number()),
+          "wire_type", WireTypeName(field), "cpp_type", CppTypeName(field),
+          "repeated", field->is_repeated() ? "true" : "false", "default",
+          opts.default_value().empty()
+              ? "nullptr"
+              : "\"" + EscapeStringLiteral(opts.default_value()) + "\"");
+    }
+    class_scope->Outdent();
+    class_scope->Print("};\n");
+
+    // (defined for odr-uses, as c++11 has no inline variables)
+    GetPrinter(cc_filename, "namespace_scope", context)->Print(vars,
+        "constexpr ::basic_options::FieldInfo $class$::kFieldTable[];\n");
+  }
+  class_scope->Print(
+      "struct FieldMetadata;\n"
+      "template <typename F>\n"
+      "static void for_each_field(F&& f);\n"
+      "\n");
+
+  // ... and the types of the fields after every class of the file is
+  // complete, so that their accessors can return any message type.
+  // Each type is a specialization of FieldMetadata::Field, by index, and its
+  // field name only an alias of it: a type named after the field could not
+  // have a static member of the same name, as for fields named "name".
+  auto namespace_scope = GetPrinter(hh_filename, "namespace_scope", context);
+  namespace_scope->Print(vars,
+      "struct $class$::FieldMetadata {\n"
+      "  template <int>\n"
+      "  struct Field;\n");
+  for (auto i = 0; i < message->field_count(); ++i) {
+    namespace_scope->Print("  using $field$ = Field<$index$>;\n",
+                           "field", message->field(i)->lowercase_name(),
+                           "index", std::to_string(i));
+  }
+  namespace_scope->Print("};\n\n");
+
+  for (auto i = 0; i < message->field_count(); ++i) {
+    auto* field = message->field(i);
+    auto& opts = field->options().GetExtension(example::field_options);
+
+    std::map<std::string, std::string> field_vars = vars;
+    field_vars["field"] = field->lowercase_name();
+    field_vars["name"] = field->name();
+    field_vars["index"] = std::to_string(i);
+    field_vars["number"] = std::to_string(field->number());
+    field_vars["wire_type"] = WireTypeName(field);
+    field_vars["cpp_type"] = CppTypeName(field);
+    field_vars["repeated"] = field->is_repeated() ? "true" : "false";
+    field_vars["presence"] =
+        !field->is_repeated() && field->has_presence() ? "true" : "false";
+    field_vars["default"] = opts.default_value().empty() ? "false" : "true";
+
+    namespace_scope->Print(field_vars,
+        "template <>\n"
+        "struct $class$::FieldMetadata::Field<$index$> {\n"
+        "  using message_type = $class$;\n"
+        "  static constexpr int index() { return $index$; }\n"
+        "  static constexpr const char* name() { return \"$name$\"; }\n"
+        "  static constexpr int number() { return $number$; }\n"
+        "  static constexpr ::basic_options::WireType wire_type() {\n"
+        "    return ::basic_options::WireType::$wire_type$;\n"
+        "  }\n"
+        "  static constexpr ::google::protobuf::FieldDescriptor::CppType\n"
+        "  cpp_type() {\n"
+        "    return ::google::protobuf::FieldDescriptor::$cpp_type$;\n"
+        "  }\n"
+        "  static constexpr bool is_repeated() { return $repeated$; }\n"
+        "  static constexpr bool has_presence() { return $presence$; }\n"
+        "  static constexpr bool has_default_value() { return $default$; }\n"
+        "\n"
+        "  static auto get(const $class$& message)\n"
+        "      -> decltype(message.$field$()) {\n"
+        "    return message.$field$();\n"
+        "  }\n");
+
+    if (field_vars["presence"] == "true") {
+      namespace_scope->Print(field_vars,
+          "  static bool has(const $class$& message) {\n"
+          "    return message.has_$field$();\n"
+          "  }\n");
+    }
+
+    if (!field->is_repeated() &&
+        field->cpp_type() != FieldDescriptor::CPPTYPE_MESSAGE) {
+      namespace_scope->Print(field_vars,
+          "  template <typename T>\n"
+          "  static void set($class$* message, T&& value) {\n"
+          "    message->set_$field$(::std::forward<T>(value));\n"
+          "  }\n");
+    }
+
+    // The default is the constant GenerateDefaults declared for it.
+    if (!opts.default_value().empty()) {
+      std::string type, literal;
+      if (!option_constant(field, "default_value", opts.default_value(),
+                           &type, &literal, error)) {
+        return false;
+      }
+      field_vars["type"] = type == "char" ? "const char*" : type;
+      field_vars["constant"] = "k" + CamelCase(field->name()) + "DefaultValue";
+      namespace_scope->Print(field_vars,
+          "  static constexpr $type$ default_value() {\n"
+          "    return $class$::$constant$;\n"
+          "  }\n");
+    }
+
+    namespace_scope->Print("};\n\n");
+  }
+
+  // Every call is a statement of its own, so the compiler can inline f for
+  // each field.
+  namespace_scope->Print(vars,
+      "template <typename F>\n"
+      "inline void $class$::for_each_field(F&& f) {\n");
+  namespace_scope->Indent();
+  if (message->field_count() == 0) {
+    namespace_scope->Print("(void)f;\n");
+  }
+  for (auto i = 0; i < message->field_count(); ++i) {
+    namespace_scope->Print("f(FieldMetadata::$field$());\n",
+                           "field", message->field(i)->lowercase_name());
+  }
+  namespace_scope->Outdent();
+  namespace_scope->Print("}\n\n");
+
+  return true;
+}
+
+
+// The most bytes a message can be encoded in, or why it has no such bound.
+struct EncodedSizeBound {
+  bool bounded;
+  uint64_t size;
+  std::string reason;
+};
+
+// The bounds of the messages seen so far, so every message type is only
+// summed once however many fields refer to it.
+typedef std::map<const google::protobuf::Descriptor*, EncodedSizeBound>
+    EncodedSizeBounds;
+
+const EncodedSizeBound& MaxEncodedSize(
+    const google::protobuf::Descriptor* message, EncodedSizeBounds* bounds);
+
+
+// The most bytes the value of field (a group's end tag included, but not the
+// field's tag) can be encoded in, or 0 and why there is no such bound.
+uint64_t MaxValueSize(const google::protobuf::FieldDescriptor* field,
+                      EncodedSizeBounds* bounds, std::string* reason) {
+  using google::protobuf::FieldDescriptor;
+  using google::protobuf::io::CodedOutputStream;
+
+  switch (field->type()) {
+    case FieldDescriptor::TYPE_DOUBLE:
+    case FieldDescriptor::TYPE_FIXED64:
+    case FieldDescriptor::TYPE_SFIXED64:
+      return 8;
+    case FieldDescriptor::TYPE_FLOAT:
+    case FieldDescriptor::TYPE_FIXED32:
+    case FieldDescriptor::TYPE_SFIXED32:
+      return 4;
+    case FieldDescriptor::TYPE_BOOL:
+      return 1;
+    case FieldDescriptor::TYPE_UINT32:
+    case FieldDescriptor::TYPE_SINT32:
+      return 5;
+    // Negative int32 and enum values are sign extended to 64 bits.
+    case FieldDescriptor::TYPE_INT32:
+    case FieldDescriptor::TYPE_ENUM:
+    case FieldDescriptor::TYPE_INT64:
+    case FieldDescriptor::TYPE_UINT64:
+    case FieldDescriptor::TYPE_SINT64:
+      return 10;
+    case FieldDescriptor::TYPE_STRING:
+    case FieldDescriptor::TYPE_BYTES: {
+      uint64_t max_size =
+          field->options().GetExtension(example::field_options).max_size();
+      if (max_size == 0) {
+        *reason = field->full_name() + " has no max_size option";
+        return 0;
+      }
+      return CodedOutputStream::VarintSize64(max_size) + max_size;
+    }
+    case FieldDescriptor::TYPE_MESSAGE:
+    case FieldDescriptor::TYPE_GROUP: {
+      auto& bound = MaxEncodedSize(field->message_type(), bounds);
+      if (!bound.bounded) {
+        *reason = field->full_name() + " is a " +
+                  field->message_type()->full_name() + ", and " +
+                  bound.reason;
+        return 0;
+      }
+      if (field->type() == FieldDescriptor::TYPE_GROUP) {
+        return bound.size + CodedOutputStream::VarintSize32(
+                                static_cast<uint32_t>(field->number()) << 3);
+      }
+      return CodedOutputStream::VarintSize64(bound.size) + bound.size;
+    }
+  }
+
+  *reason = field->full_name() + " has an unknown type";
+  return 0;
+}
+
+
+const EncodedSizeBound& MaxEncodedSize(
+    const google::protobuf::Descriptor* message, EncodedSizeBounds* bounds) {
+  using google::protobuf::io::CodedOutputStream;
+
+  auto found = bounds->find(message);
+  if (found != bounds->end()) {
+    return found->second;
+  }
+
+  // Marks the message as unbounded while its fields are summed, so a message
+  // that contains itself is.
+  auto& bound = (*bounds)[message];
+  bound.bounded = false;
+  bound.size = 0;
+  bound.reason = message->full_name() + " contains itself";
+
+  EncodedSizeBound result = {true, 0, ""};
+  if (message->extension_range_count() > 0) {
+    result = {false, 0, message->full_name() + " has extensions"};
+  }
+
+  // Only one member of a oneof is encoded, so a oneof takes the size of its
+  // largest member.
+  std::map<int, uint64_t> oneof_sizes;
+  for (int i = 0; i < message->field_count() && result.bounded; ++i) {
+    auto* field = message->field(i);
+    if (field->is_repeated()) {
+      result = {false, 0, field->full_name() + " is " +
+                              (field->is_map() ? "a map" : "repeated")};
+      break;
+    }
+
+    std::string reason;
+    uint64_t value_size = MaxValueSize(field, bounds, &reason);
+    if (value_size == 0) {
+      result = {false, 0, reason};
+      break;
+    }
+
+    uint64_t size = CodedOutputStream::VarintSize32(
+                        static_cast<uint32_t>(field->number()) << 3) +
+                    value_size;
+    if (field->real_containing_oneof() != nullptr) {
+      auto& oneof_size = oneof_sizes[field->real_containing_oneof()->index()];
+      oneof_size = std::max(oneof_size, size);
+    } else {
+      result.size += size;
+    }
+  }
+
+  for (auto& oneof_size : oneof_sizes) {
+    result.size += oneof_size.second;
+  }
+
+  // Messages are serialized with int sizes.
+  if (result.bounded && result.size > INT_MAX) {
+    result = {false, 0,
+              message->full_name() + " can be larger than 2 GB encoded"};
+  }
+
+  // The reference in bounds is stable across the insertions of the nested
+  // calls.
+  bound = result;
+  return bound;
+}
+
+
+bool Generator::GenerateMaxEncodedSize(
     const google::protobuf::Descriptor* message,
     const google::protobuf::FileDescriptor* file,
     google::protobuf::compiler::GeneratorContext* context) const {
+  using google::protobuf::FieldDescriptor;
+  using google::protobuf::compiler::StripProto;
+
+  EncodedSizeBounds bounds;
+  auto& bound = MaxEncodedSize(message, &bounds);
+  if (!bound.bounded) {
+    GenerationDiagnostics() << message->full_name()
+                            << " has no kMaxEncodedSize: " << bound.reason
+                            << "\n";
+    return true;
+  }
+
+  auto hh_filename = StripProto(file->name()) + ".pb.h";
+  auto cc_filename = StripProto(file->name()) + ".pb.cc";
+
+  std::map<std::string, std::string> vars;
+  vars["class"] = convert_unscoped(message);
+  vars["size"] = std::to_string(bound.size);
+
+  // What makes a message larger than its bound (strings over their
+  // max_size, which the setters do not enforce, and unknown fields) is
+  // checked first. Submessages are encoded with their cached sizes, so they
+  // have to be sized anyway, and their sizes are checked against their
+  // bounds.
+  std::vector<std::string> checks = {"!_internal_metadata_.have_unknown_fields()"};
+  for (auto i = 0; i < message->field_count(); ++i) {
+    auto* field = message->field(i);
+    auto name = field->lowercase_name();
+
+    switch (field->type()) {
+      case FieldDescriptor::TYPE_STRING:
+      case FieldDescriptor::TYPE_BYTES: {
+        auto max_size =
+            field->options().GetExtension(example::field_options).max_size();
+        checks.push_back(name + "().size() <= " + std::to_string(max_size) +
+                         "u");
+        break;
+      }
+      case FieldDescriptor::TYPE_MESSAGE:
+      case FieldDescriptor::TYPE_GROUP: {
+        auto max_size = MaxEncodedSize(field->message_type(), &bounds).size;
+        checks.push_back("(!has_" + name + "() || " + name +
+                         "().ByteSizeLong() <= " + std::to_string(max_size) +
+                         "u)");
+        break;
+      }
+      default:
+        break;
+    }
+  }
+
+  // Declare the bound and the serializer in the class, ...
+  auto class_scope = GetPrinter(hh_filename, "class_scope", context, message);
+  class_scope->Print(vars,
+      "// The most bytes the message encodes to, from its field types and the\n"
+      "// (example.field_options).max_size of its strings.\n"
+      "static constexpr size_t kMaxEncodedSize = $size$;\n"
+      "\n"
+      "// Serializes the message into buffer and returns its encoded size. A\n"
+      "// message whose strings are within their max_size and that has no\n"
+      "// unknown fields is encoded without sizing its own fields first. Any\n"
+      "// other is sized first, and is only written if that size is at most\n"
+      "// kMaxEncodedSize.\n"
+      "size_t SerializeToFixedBuffer(\n"
+      "    std::array<uint8_t, kMaxEncodedSize>& buffer) const;\n"
+      "\n");
+
+  // ... defined after every class of the file is complete, as the checks
+  // size message fields whose type may be declared later in the file.
+  auto namespace_scope = GetPrinter(hh_filename, "namespace_scope", context);
+  namespace_scope->Print(vars,
+      "inline size_t $class$::SerializeToFixedBuffer(\n"
+      "    std::array<uint8_t, kMaxEncodedSize>& buffer) const {\n"
+      "  if (");
+  for (size_t i = 0; i < checks.size(); ++i) {
+    namespace_scope->Print(i == 0 ? "$check$" : " &&\n      $check$",
+                           "check", checks[i]);
+  }
+  namespace_scope->Print(vars,
+      ") {\n"
+      "    ::google::protobuf::io::EpsCopyOutputStream stream(\n"
+      "        buffer.data(), static_cast<int>(kMaxEncodedSize),\n"
+      "        ::google::protobuf::io::CodedOutputStream::"
+      "IsDefaultSerializationDeterministic());\n"
+      "    return static_cast<size_t>(\n"
+      "        _InternalSerialize(buffer.data(), &stream) - buffer.data());\n"
+      "  }\n"
+      "\n"
+      "  size_t size = ByteSizeLong();\n"
+      "  if (size <= kMaxEncodedSize) {\n"
+      "    SerializeWithCachedSizesToArray(buffer.data());\n"
+      "  }\n"
+      "  return size;\n"
+      "}\n"
+      "\n");
+
+  // Defined for odr-uses, as c++11 has no inline variables.
+  GetPrinter(cc_filename, "namespace_scope", context)
+      ->Print(vars, "constexpr size_t $class$::kMaxEncodedSize;\n");
+
+  return true;
+}
+
+
+// Support code shared by the validators of all messages, guarded like
+// kFieldMetadataRuntime.
+const char* const kValidationRuntime = R"(
+#ifndef BASIC_OPTIONS_VALIDATION_
+#define BASIC_OPTIONS_VALIDATION_
+#include <string>
+
+namespace basic_options {
+
+// Sets *error, unless error is null, to the constraint a message does not
+// hold, and returns false for Validate to return.
+inline bool ValidationFailed(std::string* error, const char* constraint) {
+  if (error != nullptr) {
+    *error = constraint;
+  }
+  return false;
+}
+
+}  // namespace basic_options
+#endif  // BASIC_OPTIONS_VALIDATION_
+)";
+
+
+// A min and max, or allowed_values, constraint on a field: the ones
+// ValidateBatch checks a field of many messages at a time.
+struct RangeConstraint {
+  const google::protobuf::FieldDescriptor* field;
+  // The c++ type the values are compared as.
+  std::string type;
+  // The literals of the bounds, either of which can be empty ...
+  std::string min;
+  std::string max;
+  // ... or the numbers of the enum values the field may hold.
+  std::vector<int> allowed;
+  // What the field is not when the constraint does not hold.
+  std::string description;
+};
+
+
+// The condition value holds when it meets constraint. A bitwise one has no
+// branches, which the vectorizer needs: with && it could not compare a
+// double against max before knowing it is not below min.
+std::string RangeCondition(const RangeConstraint& constraint,
+                           const std::string& value, bool bitwise) {
+  std::string condition;
+  if (!constraint.allowed.empty()) {
+    for (int number : constraint.allowed) {
+      auto equal = value + " == " + std::to_string(number);
+      condition += condition.empty() ? "" : bitwise ? " | " : " || ";
+      condition += bitwise ? "(" + equal + ")" : equal;
+    }
+    return condition;
+  }
+
+  std::vector<std::string> bounds;
+  if (!constraint.min.empty()) {
+    bounds.push_back(value + " >= " + constraint.min);
+  }
+  if (!constraint.max.empty()) {
+    bounds.push_back(value + " <= " + constraint.max);
+  }
+  if (bounds.size() == 1) {
+    return bounds[0];
+  }
+  return bitwise ? "(" + bounds[0] + ") & (" + bounds[1] + ")"
+                 : bounds[0] + " && " + bounds[1];
+}
+
+
+// Whether the value option a is below b, both valid for the numeric field.
+bool ValueLess(const google::protobuf::FieldDescriptor* field,
+               const std::string& a, const std::string& b) {
+  using google::protobuf::FieldDescriptor;
+
+  switch (field->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_INT32:
+    case FieldDescriptor::CPPTYPE_INT64:
+      return strtoll(a.c_str(), nullptr, 10) < strtoll(b.c_str(), nullptr, 10);
+    case FieldDescriptor::CPPTYPE_UINT32:
+    case FieldDescriptor::CPPTYPE_UINT64:
+      return strtoull(a.c_str(), nullptr, 10) <
+             strtoull(b.c_str(), nullptr, 10);
+    default:
+      return strtod(a.c_str(), nullptr) < strtod(b.c_str(), nullptr);
+  }
+}
+
+
+bool HasConstraints(const example::CustomFieldOptions& opts) {
+  return !opts.min().empty() || !opts.max().empty() || opts.min_size() > 0 ||
+         opts.max_size() > 0 || opts.non_empty() ||
+         opts.allowed_values_size() > 0;
+}
+
+
+// Whether Validate checks anything of a message, i.e. whether any field of
+// it or of the messages it contains has constraints. Submessages without
+// are not validated, so ones of types basic-options did not generate, like
+// the well-known types, are left alone.
+bool HasConstraints(const google::protobuf::Descriptor* message,
+                    std::set<const google::protobuf::Descriptor*>* seen) {
+  if (!seen->insert(message).second) {
+    return false;
+  }
+
+  for (auto i = 0; i < message->field_count(); ++i) {
+    auto* field = message->field(i);
+    if (HasConstraints(field->options().GetExtension(example::field_options))) {
+      return true;
+    }
+
+    auto* type = field->is_map() ? field->message_type()->map_value()
+                                       ->message_type()
+                                 : field->message_type();
+    if (type != nullptr && HasConstraints(type, seen)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+bool HasConstraints(const google::protobuf::Descriptor* message) {
+  std::set<const google::protobuf::Descriptor*> seen;
+  return message != nullptr && HasConstraints(message, &seen);
+}
+
+
+bool Generator::GenerateValidate(
+    const google::protobuf::Descriptor* message,
+    const google::protobuf::FileDescriptor* file,
+    google::protobuf::compiler::GeneratorContext* context,
+    std::string* error) const {
+  using google::protobuf::FieldDescriptor;
+  using google::protobuf::compiler::StripProto;
+
+  auto hh_filename = StripProto(file->name()) + ".pb.h";
+
+  std::map<std::string, std::string> vars;
+  vars["class"] = convert_unscoped(message);
+
+  // Checks the constraints against the types of their fields while sorting
+  // them: the ranges go to Validate and, a field at a time, ValidateBatch ...
+  std::vector<RangeConstraint> ranges;
+  // ... and the others to ValidateContents, which both call.
+  bool has_contents = false;
+
+  for (auto i = 0; i < message->field_count(); ++i) {
+    auto* field = message->field(i);
+    auto& opts = field->options().GetExtension(example::field_options);
+    auto name = field->full_name();
+    bool is_string = field->cpp_type() == FieldDescriptor::CPPTYPE_STRING;
+
+    if (!opts.min().empty() || !opts.max().empty()) {
+      switch (field->cpp_type()) {
+        case FieldDescriptor::CPPTYPE_INT32:
+        case FieldDescriptor::CPPTYPE_INT64:
+        case FieldDescriptor::CPPTYPE_UINT32:
+        case FieldDescriptor::CPPTYPE_UINT64:
+        case FieldDescriptor::CPPTYPE_DOUBLE:
+        case FieldDescriptor::CPPTYPE_FLOAT:
+          break;
+        default:
+          *error = "min and max are only supported on numeric fields, not on " +
+                   name;
+          return false;
+      }
+
+      RangeConstraint range = {field, "", "", "", {}, ""};
+      if (!opts.min().empty() &&
+          !option_constant(field, "min", opts.min(), &range.type, &range.min,
+                           error)) {
+        return false;
+      }
+      if (!opts.max().empty() &&
+          !option_constant(field, "max", opts.max(), &range.type, &range.max,
+                           error)) {
+        return false;
+      }
+
+      if (range.min.empty()) {
+        range.description = "is above its max " + opts.max();
+      } else if (range.max.empty()) {
+        range.description = "is below its min " + opts.min();
+      } else if (ValueLess(field, opts.max(), opts.min())) {
+        *error = "min " + opts.min() + " is above max " + opts.max() +
+                 " of " + name;
+        return false;
+      } else {
+        range.description =
+            "is not within [" + opts.min() + ", " + opts.max() + "]";
+      }
+      ranges.push_back(range);
+    }
+
+    if (opts.allowed_values_size() > 0) {
+      if (field->cpp_type() != FieldDescriptor::CPPTYPE_ENUM ||
+          field->is_repeated()) {
+        *error = "allowed_values is only supported on singular enum fields, "
+                 "not on " + name;
+        return false;
+      }
+
+      RangeConstraint range = {field, "int", "", "", {}, "is not one of "};
+      for (auto& value_name : opts.allowed_values()) {
+        auto* value = field->enum_type()->FindValueByName(value_name);
+        if (value == nullptr) {
+          *error = "allowed_values of " + name + " names " + value_name +
+                   ", which is not a value of " +
+                   field->enum_type()->full_name();
+          return false;
+        }
+        range.allowed.push_back(value->number());
+        range.description +=
+            (range.allowed.size() > 1 ? ", " : "") + value_name;
+      }
+      ranges.push_back(range);
+    }
+
+    if ((opts.min_size() > 0 || opts.max_size() > 0) && !is_string) {
+      *error = "min_size and max_size are only supported on string and bytes "
+               "fields, not on " + name;
+      return false;
+    }
+    if (opts.max_size() > 0 && opts.min_size() > opts.max_size()) {
+      *error = "min_size " + std::to_string(opts.min_size()) +
+               " is above max_size " + std::to_string(opts.max_size()) +
+               " of " + name;
+      return false;
+    }
+
+    if (opts.non_empty() && !field->is_repeated() && !is_string &&
+        field->message_type() == nullptr) {
+      *error = "non_empty is only supported on string, bytes, repeated, map "
+               "and message fields, not on " + name;
+      return false;
+    }
+
+    has_contents = has_contents || opts.min_size() > 0 ||
+                   opts.max_size() > 0 || opts.non_empty() ||
+                   (field->message_type() != nullptr &&
+                    HasConstraints(field->is_map()
+                                       ? field->message_type()
+                                             ->map_value()
+                                             ->message_type()
+                                       : field->message_type()));
+  }
+
+  // Declare the validators in the class, ...
+  auto class_scope = GetPrinter(hh_filename, "class_scope", context, message);
+  class_scope->Print(vars,
+      "// Checks the (example.field_options) constraints on the fields of the\n"
+      "// message and of its submessages. If one does not hold, sets *error,\n"
+      "// unless error is null, to which, and returns false.\n"
+      "bool Validate(std::string* error = nullptr) const;\n"
+      "\n");
+  if (has_contents) {
+    class_scope->Print(
+        "// The checks of Validate other than min, max and allowed_values,\n"
+        "// which ValidateBatch makes a field at a time instead.\n"
+        "bool ValidateContents(std::string* error = nullptr) const;\n"
+        "\n");
+  }
+  class_scope->Print(vars,
+      "// Validates messages[0, count) and returns a bitmap of those that fail\n"
+      "// Validate: bit i % 64 of word i / 64 is set if messages[i] does. The\n"
+      "// min, max and allowed_values of each field are checked 64 messages at\n"
+      "// a time, in loops the compiler can vectorize.\n"
+      "static std::vector<uint64_t> ValidateBatch(\n"
+      "    const $class$* const* messages, size_t count);\n"
+      "\n");
+
+  // ... and define them after every class of the file is complete, as they
+  // validate message fields whose type may be declared later in the file.
+  auto namespace_scope = GetPrinter(hh_filename, "namespace_scope", context);
+
+  // Validate checks the ranges straight through, then the rest.
+  if (ranges.empty() && !has_contents) {
+    namespace_scope->Print(vars,
+        "inline bool $class$::Validate(std::string*) const {\n"
+        "  return true;\n"
+        "}\n\n");
+  } else {
+    namespace_scope->Print(vars,
+        "inline bool $class$::Validate(std::string* error) const {\n");
+  }
+  for (auto& range : ranges) {
+    std::map<std::string, std::string> field_vars;
+    auto accessor = range.field->lowercase_name() + "()";
+    field_vars["presence"] = range.field->has_presence()
+        ? "has_" + range.field->lowercase_name() + "() && "
+        : "";
+    field_vars["condition"] = RangeCondition(
+        range,
+        range.allowed.empty() ? accessor
+                              : "static_cast<int>(" + accessor + ")",
+        false);
+    field_vars["constraint"] = EscapeStringLiteral(
+        range.field->full_name() + " " + range.description);
+    namespace_scope->Print(field_vars,
+        "  if ($presence$!($condition$)) {\n"
+        "    return ::basic_options::ValidationFailed(\n"
+        "        error, \"$constraint$\");\n"
+        "  }\n");
+  }
+  if (has_contents) {
+    namespace_scope->Print(
+        "  return ValidateContents(error);\n"
+        "}\n\n");
+  } else if (!ranges.empty()) {
+    namespace_scope->Print(
+        "  return true;\n"
+        "}\n\n");
+  }
+
+  if (has_contents) {
+    namespace_scope->Print(vars,
+        "inline bool $class$::ValidateContents(std::string* error) const {\n");
+
+    for (auto i = 0; i < message->field_count(); ++i) {
+      auto* field = message->field(i);
+      auto& opts = field->options().GetExtension(example::field_options);
+
+      std::map<std::string, std::string> field_vars;
+      field_vars["field"] = field->lowercase_name();
+      field_vars["presence"] = field->has_presence() && !field->is_repeated()
+          ? "has_" + field->lowercase_name() + "() && "
+          : "";
+      auto fail = [&](const std::string& description) {
+        field_vars["constraint"] =
+            EscapeStringLiteral(field->full_name() + " " + description);
+      };
+
+      if (opts.min_size() > 0 || opts.max_size() > 0) {
+        std::string condition;
+        if (opts.min_size() > 0) {
+          condition = "$value$.size() < " + std::to_string(opts.min_size()) +
+                      "u";
+        }
+        if (opts.max_size() > 0) {
+          condition += (condition.empty() ? "" : " ||\n      ") +
+                       std::string("$value$.size() > ") +
+                       std::to_string(opts.max_size()) + "u";
+        }
+
+        if (opts.max_size() == 0) {
+          fail("is shorter than its min_size " +
+               std::to_string(opts.min_size()));
+        } else if (opts.min_size() == 0) {
+          fail("is longer than its max_size " +
+               std::to_string(opts.max_size()));
+        } else {
+          fail("is not within its min_size " +
+               std::to_string(opts.min_size()) + " and max_size " +
+               std::to_string(opts.max_size()));
+        }
+
+        if (field->is_repeated()) {
+          field_vars["value"] = "value";
+          namespace_scope->Print(field_vars,
+              ("  for (const auto& value : $field$()) {\n"
+               "    if (" + condition + ") {\n"
+               "      return ::basic_options::ValidationFailed(\n"
+               "          error, \"$constraint$\");\n"
+               "    }\n"
+               "  }\n").c_str());
+        } else {
+          field_vars["value"] = field->lowercase_name() + "()";
+          if (!field_vars["presence"].empty() && opts.min_size() > 0 &&
+              opts.max_size() > 0) {
+            condition = "(" + condition + ")";
+          }
+          namespace_scope->Print(field_vars,
+              ("  if ($presence$" + condition + ") {\n"
+               "    return ::basic_options::ValidationFailed(\n"
+               "        error, \"$constraint$\");\n"
+               "  }\n").c_str());
+        }
+      }
+
+      if (opts.non_empty()) {
+        if (field->is_repeated()) {
+          fail("is empty");
+          field_vars["empty"] = field->lowercase_name() + "_size() == 0";
+        } else if (field->message_type() != nullptr) {
+          fail("is not set");
+          field_vars["empty"] = "!has_" + field->lowercase_name() + "()";
+        } else {
+          fail("is empty");
+          field_vars["empty"] = field->lowercase_name() + "().empty()";
+        }
+        namespace_scope->Print(field_vars,
+            "  if ($empty$) {\n"
+            "    return ::basic_options::ValidationFailed(\n"
+            "        error, \"$constraint$\");\n"
+            "  }\n");
+      }
+
+      // Submessages report their own failures.
+      if (field->is_map()) {
+        if (HasConstraints(field->message_type()->map_value()->message_type())) {
+          namespace_scope->Print(field_vars,
+              "  for (const auto& entry : $field$()) {\n"
+              "    if (!entry.second.Validate(error)) {\n"
+              "      return false;\n"
+              "    }\n"
+              "  }\n");
+        }
+      } else if (HasConstraints(field->message_type())) {
+        namespace_scope->Print(field_vars,
+            field->is_repeated()
+                ? "  for (const auto& value : $field$()) {\n"
+                  "    if (!value.Validate(error)) {\n"
+                  "      return false;\n"
+                  "    }\n"
+                  "  }\n"
+                : "  if (has_$field$() && !$field$().Validate(error)) {\n"
+                  "    return false;\n"
+                  "  }\n");
+      }
+    }
+
+    namespace_scope->Print(
+        "  return true;\n"
+        "}\n\n");
+  }
+
+  // ValidateBatch copies the ranged fields of a block of messages into an
+  // array per field, in one pass over the messages, and checks each array in
+  // a branchless loop of a fixed 64 iterations. GCC vectorizes those of
+  // 32-bit and narrower types at -O2; those of 64-bit ones, doubles
+  // included, take SSE4.2 or wider (-march).
+  if (ranges.empty() && !has_contents) {
+    namespace_scope->Print(vars,
+        "inline std::vector<uint64_t> $class$::ValidateBatch(\n"
+        "    const $class$* const*, size_t count) {\n"
+        "  return std::vector<uint64_t>((count + 63) / 64);\n"
+        "}\n\n");
+    return true;
+  }
+
+  namespace_scope->Print(vars,
+      "inline std::vector<uint64_t> $class$::ValidateBatch(\n"
+      "    const $class$* const* messages, size_t count) {\n"
+      "  std::vector<uint64_t> failures((count + 63) / 64);\n"
+      "  for (size_t first = 0; first < count; first += 64) {\n"
+      "    const $class$* const* block = messages + first;\n"
+      "    size_t size = count - first < 64 ? count - first : 64;\n"
+      "    uint8_t failed[64] = {};\n");
+
+  if (!ranges.empty()) {
+    std::vector<std::map<std::string, std::string>> ranges_vars;
+    for (auto& range : ranges) {
+      std::map<std::string, std::string> field_vars;
+      auto name = range.field->lowercase_name();
+      auto accessor = "message." + name + "()";
+      if (!range.allowed.empty()) {
+        accessor = "static_cast<int>(" + accessor + ")";
+      }
+      field_vars["type"] = range.type;
+      field_vars["values"] = name + "_values";
+      field_vars["value"] = accessor;
+      if (range.field->has_presence()) {
+        // An unset field passes, as it does in Validate.
+        auto passing = !range.allowed.empty() ? std::to_string(range.allowed[0])
+                       : !range.min.empty()   ? range.min
+                                              : range.max;
+        field_vars["value"] =
+            "message.has_" + name + "() ? " + accessor + " : " + passing;
+      }
+      field_vars["condition"] =
+          RangeCondition(range, name + "_values[i]", true);
+      ranges_vars.push_back(field_vars);
+    }
+
+    for (auto& field_vars : ranges_vars) {
+      namespace_scope->Print(field_vars, "    $type$ $values$[64];\n");
+    }
+    namespace_scope->Print(vars,
+        "    for (size_t i = 0; i < 64; ++i) {\n"
+        "      // Past the end of messages the last one is repeated, so the\n"
+        "      // checks can run over all 64 values.\n"
+        "      const $class$& message = *block[i < size ? i : size - 1];\n");
+    for (auto& field_vars : ranges_vars) {
+      namespace_scope->Print(field_vars, "      $values$[i] = $value$;\n");
+    }
+    namespace_scope->Print("    }\n");
+    for (auto& field_vars : ranges_vars) {
+      namespace_scope->Print(field_vars,
+          "    for (size_t i = 0; i < 64; ++i) {\n"
+          "      failed[i] |= static_cast<uint8_t>(!($condition$));\n"
+          "    }\n");
+    }
+  }
+  if (has_contents) {
+    namespace_scope->Print(
+        "    for (size_t i = 0; i < size; ++i) {\n"
+        "      if (failed[i] == 0 && !block[i]->ValidateContents()) {\n"
+        "        failed[i] = 1;\n"
+        "      }\n"
+        "    }\n");
+  }
+  namespace_scope->Print(
+      "    uint64_t bits = 0;\n"
+      "    for (size_t i = 0; i < size; ++i) {\n"
+      "      bits |= static_cast<uint64_t>(failed[i]) << i;\n"
+      "    }\n"
+      "    failures[first / 64] = bits;\n"
+      "  }\n"
+      "  return failures;\n"
+      "}\n\n");
+
+  return true;
+}
+
+
+bool Generator::GenerateFor(
+    const google::protobuf::Descriptor* message,
+    const google::protobuf::FileDescriptor* file,
+    google::protobuf::compiler::GeneratorContext* context,
+    std::string* error) const {
+  // Map entries are generated without insertion points.
+  if (message->options().map_entry()) {
+    return true;
+  }
+
+  TraceSpan span("GenerateFor", message->full_name());
+
   // ----------------------------------------------------------------------
   // H insertion points
   // ----------------------------------------------------------------------
@@ -187,129 +1685,100 @@ bool Generator::GenerateFor(
   // namespace_scope
   // global_scope
 
-  using google::protobuf::compiler::StripProto;
-  auto hh_filename = StripProto(file->name()) + ".pb.h";
-  auto cc_filename = StripProto(file->name()) + ".pb.cc";
-
-  auto arena_constructor_inserter =
-      GetInserter(cc_filename, "arena_constructor", context, message);
-
-  google::protobuf::io::Printer printer(arena_constructor_inserter, '$');
+  {
+    TraceSpan diagnostics_span("diagnostics", message->full_name());
+    auto& diagnostics = GenerationDiagnostics();
 
-  std::cerr << "\n========================================================\n";
-  std::cerr << "MESSAGE: " << message->full_name();
-  std::cerr << "\n========================================================\n";
+    diagnostics << "\n========================================================\n";
+    diagnostics << "MESSAGE: " << message->full_name();
+    diagnostics << "\n========================================================\n";
 
-  std::cerr << message->full_name() << " has " << message->field_count() << " fields\n";
-  for (auto i = 0; i < message->field_count(); ++i) {
-    std::cerr << message->field(i)->DebugString() << "\n";
-    PrintField(message->field(i));
+    diagnostics << message->full_name() << " has " << message->field_count() << " fields\n";
+    for (auto i = 0; i < message->field_count(); ++i) {
+      diagnostics << message->field(i)->DebugString() << "\n";
+      PrintField(message->field(i));
+    }
   }
 
   // ======================================================================
 
-  // Checks for the existence of a "version" field on the message. If found,
-  // inserts code to set the version to the default version whenever the
-  // message is initialized.
-  if (message->FindFieldByName("version")) {
-    printer.Print("\nauto* version_desc = descriptor()->FindFieldByName(\"version\");\n");
-    printer.Print("auto version_opts = version_desc->options();\n");
-    printer.Print("auto version_default = version_opts.GetExtension(example::field_options).default_value();\n");
-    printer.Print("set_version(version_default);\n");
+  // Resolves the (example.field_options).default_value of each field now, so
+  // the constructor only has to assign constants.
+  if (!GenerateDefaults(message, file, context, error)) {
+    return false;
   }
 
+  // Lets messages be built from all of their fields at once, moving the
+  // strings into place.
+  if (!GenerateInitializer(message, file, context, error)) {
+    return false;
+  }
 
+  // Lets generic code visit the fields without Descriptor and Reflection.
+  if (!GenerateFieldMetadata(message, file, context, error)) {
+    return false;
+  }
 
-  // auto arena_constructor_inserter = context->OpenForInsert(
-  //     cc_filename, "arena_constructor:" + message->full_name());
-
-  // auto arena_constructor_inserter = context->OpenForInsert(
-  //     cc_filename, GetFullInsertionPoint("arena_constructor", message));
-
-  // auto arena_constructor_inserter =
-  //     GetInserter(cc_filename, "arena_constructor", context, message);
-
-  // google::protobuf::io::Printer printer(arena_constructor_inserter, '$');
-
-  // --------------------
-
-  // auto arena_constructor_printer =
-  //     GetPrinter(cc_filename, "arena_constructor", context, message);
-  // arena_constructor_printer->Print("// HELLO WORLD 3\n");
-
-  // --------------------
-
-  // auto class_scope_inserter = context->OpenForInsert(
-  //     hh_filename, "class_scope:" + message->full_name());
-
-  // google::protobuf::io::Printer printer(class_scope_inserter, '$');
-
-  // printer.Print("const static std::string TYPE_NAME;\n");
-  // printer.Print("struct initializable_type {\n");
-  // printer.Indent();
-
-  // for (int i = 0; i < message->field_count(); ++i) {
-  //   auto field = message->field(i);
-  //   auto etype = field->cpp_type();
-  //   std::string type =
-  //       "::PROTOBUF_NAMESPACE_ID::" + std::string(field->cpp_type_name());
-
-  //   if (etype == google::protobuf::FieldDescriptor::CPPTYPE_ENUM) {
-  //     type = convert_scoped(field->enum_type());
-  //   } else if (etype == google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE) {
-  //     type = convert_scoped(field->message_type());
-  //   }
-
-  //   printer.Print("$type$ $name$;\n", "type", type.c_str(), "name",
-  //                 field->name().c_str());
-  // }
-
-  // printer.Outdent();
-  // printer.Print(
-  //     "};\n\n$constructor$(const initializable_type &t) : $constructor$()
-  //     {\n", "constructor", convert_unscoped(message));
-  // printer.Indent();
+  // Lets bounded messages be serialized into a buffer on the stack.
+  if (!GenerateMaxEncodedSize(message, file, context)) {
+    return false;
+  }
 
-  // for (int i = 0; i < message->field_count(); ++i) {
-  //   auto field = message->field(i);
-  //   printer.Print("set_$lname$(t.$name$);\n", "lname",
-  //                 field->lowercase_name().c_str(), "name",
-  //                 field->name().c_str());
-  // }
+  // Checks the constraints of the fields without Reflection.
+  if (!GenerateValidate(message, file, context, error)) {
+    return false;
+  }
 
-  // printer.Outdent();
-  // printer.Print("}\n");
+  for (auto i = 0; i < message->nested_type_count(); ++i) {
+    if (!GenerateFor(message->nested_type(i), file, context, error)) {
+      return false;
+    }
+  }
 
-  // for (int i = 0; i < message->nested_type_count(); ++i) {
-  //   GenerateFor(message->nested_type(i), file, context);
-  // }
+  return true;
+}
 
-  // auto namespace_scope_inserter = context->OpenForInsert(
-  //     google::protobuf::compiler::StripProto(file->name()) + ".pb.h",
-  //     "namespace_scope");
 
-  // google::protobuf::io::Printer printer2(namespace_scope_inserter, '$');
+bool Generator::GenerateFile(const google::protobuf::FileDescriptor* file,
+                             const std::string& parameter,
+                             google::protobuf::compiler::GeneratorContext* context,
+                             std::string* error) const {
+  if (file->message_type_count() == 0) {
+    return true;
+  }
 
-  // printer2.Print("inline const std::string $1$::TYPE_NAME = \"$2$\";\n", "1",
-  //                convert_scoped(message), "2", message->full_name());
+  // For the initializable_type, the field metadata and the validators of
+  // each message.
+  using google::protobuf::compiler::StripProto;
+  auto hh_filename = StripProto(file->name()) + ".pb.h";
+  auto includes = GetPrinter(hh_filename, "includes", context);
+  includes->Print(
+      "#include <array>\n"
+      "#include <limits>\n"
+      "#include <memory>\n"
+      "#include <string>\n"
+      "#include <utility>\n"
+      "#include <vector>\n");
+  includes->PrintRaw(kInitializerRuntime);
+  includes->PrintRaw(kFieldMetadataRuntime);
+  includes->PrintRaw(kValidationRuntime);
 
   return true;
 }
 
 
-bool Generator::Generate(const google::protobuf::FileDescriptor* file,
-                         const std::string& parameter,
-                         google::protobuf::compiler::GeneratorContext* context,
-                         std::string* error) const {
-  // Generate for each message. Short circuit on any failures.
-  for (int i = 0; i < file->message_type_count(); ++i) {
-    if (!GenerateFor(file->message_type(i), file, context)) {
-      auto* msg = file->message_type(i);
-      std::cerr << "Failed to generate for message " << msg->full_name()
-                << ". Exiting...\n";
-      return false;
-    }
+bool Generator::GenerateMessage(
+    const google::protobuf::Descriptor* message, const std::string& parameter,
+    google::protobuf::compiler::GeneratorContext* context,
+    std::string* error) const {
+  if (!GenerateFor(message, message->file(), context, error)) {
+    GenerationDiagnostics() << "Failed to generate for message "
+                            << message->full_name() << ": " << *error
+                            << ". Exiting...\n";
+    return false;
   }
 
   return true;
 }
+
+}  // namespace basic_options
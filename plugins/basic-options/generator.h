@@ -1,6 +1,8 @@
 #ifndef MYAPP_BASIC_OPTIONS_GENERATOR
 #define MYAPP_BASIC_OPTIONS_GENERATOR
 
+#include "common/parallel_generator.h"
+
 #include <google/protobuf/compiler/code_generator.h>
 #include <google/protobuf/compiler/plugin.h>
 #include <google/protobuf/descriptor.h>
@@ -9,20 +11,83 @@
 
 #include <string>
 
-class Generator : public google::protobuf::compiler::CodeGenerator {
+namespace basic_options {
+
+class Generator : public ParallelGenerator {
  public:
   inline Generator() {}
   inline ~Generator() {}
 
-  bool Generate(const google::protobuf::FileDescriptor* file,
-                const std::string& parameter,
-                google::protobuf::compiler::GeneratorContext* context,
-                std::string* error) const override;
+ protected:
+  std::string Version() const override;
+
+  bool GenerateFile(const google::protobuf::FileDescriptor* file,
+                    const std::string& parameter,
+                    google::protobuf::compiler::GeneratorContext* context,
+                    std::string* error) const override;
+
+  bool GenerateMessage(const google::protobuf::Descriptor* message,
+                       const std::string& parameter,
+                       google::protobuf::compiler::GeneratorContext* context,
+                       std::string* error) const override;
 
  private:
+  // Generates the code of every helper below for message and, recursively,
+  // its nested messages.
   bool GenerateFor(const google::protobuf::Descriptor* message,
                    const google::protobuf::FileDescriptor* file,
-                   google::protobuf::compiler::GeneratorContext* context) const;
+                   google::protobuf::compiler::GeneratorContext* context,
+                   std::string* error) const;
+
+  // Emits a typed constant for each (example.field_options).default_value of
+  // the message and assigns them in the message's constructor.
+  bool GenerateDefaults(const google::protobuf::Descriptor* message,
+                        const google::protobuf::FileDescriptor* file,
+                        google::protobuf::compiler::GeneratorContext* context,
+                        std::string* error) const;
+
+  // Emits a nested initializable_type struct with a member for each field
+  // of the message, and constructors that set every field from one.
+  bool GenerateInitializer(const google::protobuf::Descriptor* message,
+                           const google::protobuf::FileDescriptor* file,
+                           google::protobuf::compiler::GeneratorContext* context,
+                           std::string* error) const;
+
+  // Emits a constexpr table of the fields of the message, a FieldMetadata
+  // type per field with its metadata and accessors, and a for_each_field
+  // template visiting them.
+  bool GenerateFieldMetadata(const google::protobuf::Descriptor* message,
+                             const google::protobuf::FileDescriptor* file,
+                             google::protobuf::compiler::GeneratorContext* context,
+                             std::string* error) const;
+
+  // Emits kMaxEncodedSize and SerializeToFixedBuffer into messages with a
+  // bounded encoded size, i.e. with no repeated fields, every string and
+  // bytes field with a (example.field_options).max_size and every message
+  // field bounded too, and reports the others on stderr.
+  bool GenerateMaxEncodedSize(const google::protobuf::Descriptor* message,
+                              const google::protobuf::FileDescriptor* file,
+                              google::protobuf::compiler::GeneratorContext* context) const;
+
+  // Checks the constraints of (example.field_options) against the fields
+  // they are on, and emits Validate, which checks them straight through,
+  // ValidateBatch, which checks min, max and allowed_values over many
+  // messages a field at a time, and ValidateContents for the others.
+  bool GenerateValidate(const google::protobuf::Descriptor* message,
+                        const google::protobuf::FileDescriptor* file,
+                        google::protobuf::compiler::GeneratorContext* context,
+                        std::string* error) const;
+
+  // Returns the c++ type of the initializable_type member for field.
+  std::string initializable_member_type(
+      const google::protobuf::FieldDescriptor* field) const;
+
+  // Converts a value option of field (default_value, min or max), written
+  // as in the .proto file, into the c++ type and literal of a constant.
+  bool option_constant(const google::protobuf::FieldDescriptor* field,
+                       const std::string& option, const std::string& value,
+                       std::string* type, std::string* literal,
+                       std::string* error) const;
 
   template <typename T>
   std::string convert_scoped(const T* message) const;
@@ -31,4 +96,6 @@ class Generator : public google::protobuf::compiler::CodeGenerator {
   std::string convert_unscoped(const T* message) const;
 };
 
+}  // namespace basic_options
+
 #endif // MYAPP_BASIC_OPTIONS_GENERATOR
@@ -0,0 +1,521 @@
+#include "generator.h"
+
+#include "common/insertion.h"
+#include "common/trace.h"
+
+#include <google/protobuf/compiler/code_generator.h>
+#include <google/protobuf/compiler/cpp/cpp_generator.h>
+#include <google/protobuf/compiler/plugin.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/io/printer.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+
+// Support code shared by the batches of all messages. It is emitted into the
+// includes of every generated header, so it is guarded against being defined
+// more than once per translation unit.
+const char* const kBatchRuntime = R"(
+#ifndef COLUMNAR_BATCH_RUNTIME_
+#define COLUMNAR_BATCH_RUNTIME_
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+
+namespace columnar_batch {
+
+enum class Compare { kLess, kLessEqual, kEqual, kNotEqual, kGreaterEqual, kGreater };
+
+// The kernels keep this many independent accumulators, so that the compiler
+// can hold them in one vector register and process that many rows per
+// instruction, without reassociating floating point math itself.
+constexpr size_t kLanes = 8;
+
+// Returns the sum of values, accumulated as S.
+template <typename S, typename T>
+S Sum(const T* values, size_t size) {
+  S lanes[kLanes] = {};
+  size_t i = 0;
+  for (; i + kLanes <= size; i += kLanes) {
+    for (size_t lane = 0; lane < kLanes; ++lane) {
+      lanes[lane] += values[i + lane];
+    }
+  }
+
+  S sum = 0;
+  for (size_t lane = 0; lane < kLanes; ++lane) {
+    sum += lanes[lane];
+  }
+  for (; i < size; ++i) {
+    sum += values[i];
+  }
+  return sum;
+}
+
+// Returns the smallest of values, or the largest T if there are none.
+template <typename T>
+T Min(const T* values, size_t size) {
+  T lanes[kLanes];
+  for (size_t lane = 0; lane < kLanes; ++lane) {
+    lanes[lane] = std::numeric_limits<T>::max();
+  }
+
+  size_t i = 0;
+  for (; i + kLanes <= size; i += kLanes) {
+    for (size_t lane = 0; lane < kLanes; ++lane) {
+      lanes[lane] = values[i + lane] < lanes[lane] ? values[i + lane] : lanes[lane];
+    }
+  }
+
+  T min = std::numeric_limits<T>::max();
+  for (size_t lane = 0; lane < kLanes; ++lane) {
+    min = lanes[lane] < min ? lanes[lane] : min;
+  }
+  for (; i < size; ++i) {
+    min = values[i] < min ? values[i] : min;
+  }
+  return min;
+}
+
+// Returns the largest of values, or the lowest T if there are none.
+template <typename T>
+T Max(const T* values, size_t size) {
+  T lanes[kLanes];
+  for (size_t lane = 0; lane < kLanes; ++lane) {
+    lanes[lane] = std::numeric_limits<T>::lowest();
+  }
+
+  size_t i = 0;
+  for (; i + kLanes <= size; i += kLanes) {
+    for (size_t lane = 0; lane < kLanes; ++lane) {
+      lanes[lane] = values[i + lane] > lanes[lane] ? values[i + lane] : lanes[lane];
+    }
+  }
+
+  T max = std::numeric_limits<T>::lowest();
+  for (size_t lane = 0; lane < kLanes; ++lane) {
+    max = lanes[lane] > max ? lanes[lane] : max;
+  }
+  for (; i < size; ++i) {
+    max = values[i] > max ? values[i] : max;
+  }
+  return max;
+}
+
+// Returns the indices of the values that pass. Rows are tested 64 at a time
+// into a byte each, in a loop the compiler vectorizes (with SSE2 for 8 and
+// 32-bit values, SSE4.2 for 64-bit ones); the bytes are then gathered into a
+// 64-bit mask whose set bits are expanded into indices with ctz, so a block
+// costs one step per passing row. The rows past the last block are tested
+// one at a time: every index is written and the count only advanced for
+// passing values, so there is no branch to mispredict.
+template <typename T, typename Predicate>
+std::vector<uint32_t> FilterIf(const T* values, size_t size, Predicate pass) {
+  std::vector<uint32_t> selection(size);
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 64 <= size; i += 64) {
+    uint8_t passed[64];
+    for (size_t j = 0; j < 64; ++j) {
+      passed[j] = pass(values[i + j]) ? 1 : 0;
+    }
+
+    // The multiplication moves the low bit of byte k of the 8 into bit k of
+    // the top byte.
+    uint64_t mask = 0;
+    for (size_t j = 0; j < 64; j += 8) {
+      uint64_t bytes;
+      memcpy(&bytes, passed + j, sizeof(bytes));
+      mask |= ((bytes * 0x0102040810204080ull) >> 56) << j;
+    }
+
+    while (mask != 0) {
+      selection[count++] = static_cast<uint32_t>(i + __builtin_ctzll(mask));
+      mask &= mask - 1;
+    }
+  }
+  for (; i < size; ++i) {
+    selection[count] = static_cast<uint32_t>(i);
+    count += pass(values[i]) ? 1 : 0;
+  }
+  selection.resize(count);
+  return selection;
+}
+
+// Returns the indices of the values that compare to value as op.
+template <typename T>
+std::vector<uint32_t> Filter(const T* values, size_t size, Compare op, T value) {
+  switch (op) {
+    case Compare::kLess:
+      return FilterIf(values, size, [value](T v) { return v < value; });
+    case Compare::kLessEqual:
+      return FilterIf(values, size, [value](T v) { return v <= value; });
+    case Compare::kEqual:
+      return FilterIf(values, size, [value](T v) { return v == value; });
+    case Compare::kNotEqual:
+      return FilterIf(values, size, [value](T v) { return v != value; });
+    case Compare::kGreaterEqual:
+      return FilterIf(values, size, [value](T v) { return v >= value; });
+    case Compare::kGreater:
+      return FilterIf(values, size, [value](T v) { return v > value; });
+  }
+  return {};
+}
+
+// A string in a StringColumn, valid until the column is changed.
+struct StringRef {
+  const char* data;
+  size_t size;
+
+  std::string ToString() const { return std::string(data, size); }
+};
+
+// A column of strings stored back to back in one growing buffer, with the
+// offset of each, so appending a row costs no allocation of its own and
+// scanning the column reads memory in order.
+class StringColumn {
+ public:
+  StringColumn() : offsets_(1, 0) {}
+
+  size_t size() const { return offsets_.size() - 1; }
+
+  void Reserve(size_t rows, size_t bytes) {
+    offsets_.reserve(rows + 1);
+    bytes_.reserve(bytes);
+  }
+
+  void Clear() {
+    bytes_.clear();
+    offsets_.resize(1);
+  }
+
+  void Append(const std::string& value) {
+    bytes_.insert(bytes_.end(), value.begin(), value.end());
+    offsets_.push_back(bytes_.size());
+  }
+
+  StringRef operator[](size_t index) const {
+    return {bytes_.data() + offsets_[index],
+            offsets_[index + 1] - offsets_[index]};
+  }
+
+  // The bytes of all of the strings, in row order.
+  const std::vector<char>& bytes() const { return bytes_; }
+
+ private:
+  std::vector<char> bytes_;
+  std::vector<size_t> offsets_;
+};
+
+}  // namespace columnar_batch
+#endif  // COLUMNAR_BATCH_RUNTIME_
+)";
+
+
+namespace {
+
+// Helper function to get the c++ type of a column, the type its values are
+// summed as (empty if the column has no arithmetic kernels), and whether it is
+// stored as a StringColumn. Returns false for fields that have no column.
+bool ColumnType(const google::protobuf::FieldDescriptor* field,
+                std::string* type, std::string* sum_type, bool* is_string) {
+  using google::protobuf::FieldDescriptor;
+
+  if (field->is_repeated() || field->real_containing_oneof() != nullptr) {
+    return false;
+  }
+
+  *is_string = false;
+  sum_type->clear();
+  switch (field->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_INT32:
+      *type = "int32_t";
+      *sum_type = "int64_t";
+      return true;
+    case FieldDescriptor::CPPTYPE_INT64:
+      *type = "int64_t";
+      *sum_type = "int64_t";
+      return true;
+    case FieldDescriptor::CPPTYPE_UINT32:
+      *type = "uint32_t";
+      *sum_type = "uint64_t";
+      return true;
+    case FieldDescriptor::CPPTYPE_UINT64:
+      *type = "uint64_t";
+      *sum_type = "uint64_t";
+      return true;
+    case FieldDescriptor::CPPTYPE_FLOAT:
+      *type = "float";
+      *sum_type = "double";
+      return true;
+    case FieldDescriptor::CPPTYPE_DOUBLE:
+      *type = "double";
+      *sum_type = "double";
+      return true;
+    // Bools are bytes, as std::vector<bool> is not contiguous, and enums
+    // their numbers; both can be filtered, but not summed.
+    case FieldDescriptor::CPPTYPE_BOOL:
+      *type = "uint8_t";
+      return true;
+    case FieldDescriptor::CPPTYPE_ENUM:
+      *type = "int";
+      return true;
+    case FieldDescriptor::CPPTYPE_STRING:
+      *type = "::columnar_batch::StringColumn";
+      *is_string = true;
+      return true;
+    case FieldDescriptor::CPPTYPE_MESSAGE:
+      return false;
+  }
+
+  return false;
+}
+
+}  // namespace
+
+
+std::string Generator::Version() const {
+  return "columnar-batch/1";
+}
+
+
+bool Generator::GenerateFor(
+    const google::protobuf::Descriptor* message,
+    const google::protobuf::FileDescriptor* file,
+    google::protobuf::compiler::GeneratorContext* context) const {
+  using google::protobuf::FieldDescriptor;
+
+  TraceSpan span("GenerateFor", message->full_name());
+
+  // Map entries are generated without insertion points.
+  if (message->options().map_entry()) {
+    return true;
+  }
+
+  struct Column {
+    std::map<std::string, std::string> vars;
+    bool is_string;
+    // Whether the field has presence, which the batch keeps in a column of
+    // its own so converting back leaves unset fields unset.
+    bool has_presence;
+  };
+
+  std::vector<Column> columns;
+  for (int i = 0; i < message->field_count(); ++i) {
+    auto* field = message->field(i);
+
+    Column column;
+    auto& vars = column.vars;
+    if (!ColumnType(field, &vars["type"], &vars["sum_type"],
+                    &column.is_string)) {
+      continue;
+    }
+
+    column.has_presence = field->has_presence();
+    vars["field"] = field->lowercase_name();
+    vars["Field"] = CamelCase(field->name());
+    vars["append"] = "row.$field$()";
+    vars["get"] = "$field$_column_[index]";
+    if (field->cpp_type() == FieldDescriptor::CPPTYPE_BOOL) {
+      vars["append"] = "row.$field$() ? 1 : 0";
+      vars["get"] = "$field$_column_[index] != 0";
+    } else if (field->cpp_type() == FieldDescriptor::CPPTYPE_ENUM) {
+      vars["get"] = "static_cast<" + EnumName(field->enum_type()) +
+                    ">($field$_column_[index])";
+    }
+
+    columns.push_back(column);
+  }
+
+  std::map<std::string, std::string> vars;
+  vars["class"] = ClassName(message);
+  vars["batch"] = ClassName(message) + "Batch";
+  // A message without columns leaves the parameters of its rows unused.
+  vars["rows"] = columns.empty() ? "" : " rows";
+  vars["row"] = columns.empty() ? "" : " row";
+  vars["index"] = columns.empty() ? "" : " index";
+
+  using google::protobuf::compiler::StripProto;
+  auto hh_filename = StripProto(file->name()) + ".pb.h";
+  auto printer = GetPrinter(hh_filename, "namespace_scope", context);
+
+  printer->Print(vars,
+      "// A batch of $class$ stored as one contiguous column per field\n"
+      "// (columnar-batch plugin), for scanning and aggregating many rows.\n"
+      "// Repeated, message and oneof fields have no column, and are left\n"
+      "// out when converting from and to $class$. Columns are named\n"
+      "// <field>_column(), so they cannot collide with the methods.\n"
+      "class $batch$ {\n"
+      " public:\n");
+  printer->Indent();
+
+  printer->Print(vars,
+      "size_t size() const { return size_; }\n"
+      "\n"
+      "void Reserve(size_t$rows$) {\n");
+  for (auto& column : columns) {
+    printer->Print(column.vars, column.is_string
+        ? "  $field$_column_.Reserve(rows, rows * 16);\n"
+        : "  $field$_column_.reserve(rows);\n");
+    if (column.has_presence) {
+      printer->Print(column.vars, "  $field$_present_.reserve(rows);\n");
+    }
+  }
+  printer->Print("}\n\nvoid Clear() {\n");
+  for (auto& column : columns) {
+    printer->Print(column.vars, column.is_string
+        ? "  $field$_column_.Clear();\n"
+        : "  $field$_column_.clear();\n");
+    if (column.has_presence) {
+      printer->Print(column.vars, "  $field$_present_.clear();\n");
+    }
+  }
+  printer->Print("  size_ = 0;\n}\n\n");
+
+  // Conversions from and to rows.
+  printer->Print(vars, "void Append(const $class$&$row$) {\n");
+  for (auto& column : columns) {
+    // The value is a template of its own, so substitute it first.
+    std::string append = column.is_string
+        ? "  $field$_column_.Append(" + column.vars["append"] + ");\n"
+        : "  $field$_column_.push_back(" + column.vars["append"] + ");\n";
+    printer->Print(column.vars, append.c_str());
+    if (column.has_presence) {
+      printer->Print(column.vars,
+          "  $field$_present_.push_back(row.has_$field$() ? 1 : 0);\n");
+    }
+  }
+  printer->Print("  ++size_;\n}\n\n");
+
+  printer->Print(vars, "void Get(size_t$index$, $class$*$row$) const {\n");
+  for (auto& column : columns) {
+    std::string set;
+    if (column.is_string) {
+      set = "row->set_$field$($field$_column_[index].data, "
+            "$field$_column_[index].size);\n";
+    } else {
+      // The value is a template of its own, so substitute it first.
+      set = "row->set_$field$(" + column.vars["get"] + ");\n";
+    }
+    if (column.has_presence) {
+      set = "if ($field$_present_[index] != 0) {\n  " + set + "}\n";
+    }
+    printer->Indent();
+    printer->Print(column.vars, set.c_str());
+    printer->Outdent();
+  }
+  printer->Print("}\n\n");
+
+  printer->Print(vars,
+      "static $batch$ From(\n"
+      "    const ::google::protobuf::RepeatedPtrField<$class$>& rows) {\n"
+      "  $batch$ batch;\n"
+      "  batch.Reserve(static_cast<size_t>(rows.size()));\n"
+      "  for (const auto& row : rows) {\n"
+      "    batch.Append(row);\n"
+      "  }\n"
+      "  return batch;\n"
+      "}\n"
+      "\n"
+      "void AppendTo(::google::protobuf::RepeatedPtrField<$class$>* rows) const {\n"
+      "  rows->Reserve(rows->size() + static_cast<int>(size_));\n"
+      "  for (size_t index = 0; index < size_; ++index) {\n"
+      "    Get(index, rows->Add());\n"
+      "  }\n"
+      "}\n"
+      "\n");
+
+  // The columns and their kernels. Rows whose field is unset hold its
+  // default in the column.
+  for (auto& column : columns) {
+    if (column.has_presence) {
+      printer->Print(column.vars,
+          "bool has_$field$(size_t index) const {\n"
+          "  return $field$_present_[index] != 0;\n"
+          "}\n");
+    }
+    if (column.is_string) {
+      printer->Print(column.vars,
+          "const $type$& $field$_column() const { return $field$_column_; }\n\n");
+      continue;
+    }
+
+    printer->Print(column.vars,
+        "const std::vector<$type$>& $field$_column() const {\n"
+        "  return $field$_column_;\n"
+        "}\n");
+    if (!column.vars["sum_type"].empty()) {
+      printer->Print(column.vars,
+          "$sum_type$ Sum$Field$() const {\n"
+          "  return ::columnar_batch::Sum<$sum_type$>($field$_column_.data(), size_);\n"
+          "}\n"
+          "$type$ Min$Field$() const {\n"
+          "  return ::columnar_batch::Min($field$_column_.data(), size_);\n"
+          "}\n"
+          "$type$ Max$Field$() const {\n"
+          "  return ::columnar_batch::Max($field$_column_.data(), size_);\n"
+          "}\n");
+    }
+    printer->Print(column.vars,
+        "std::vector<uint32_t> Filter$Field$(\n"
+        "    ::columnar_batch::Compare op, $type$ value) const {\n"
+        "  return ::columnar_batch::Filter($field$_column_.data(), size_, op, value);\n"
+        "}\n\n");
+  }
+
+  printer->Outdent();
+  printer->Print(" private:\n");
+  printer->Indent();
+  printer->Print("size_t size_ = 0;\n");
+  for (auto& column : columns) {
+    printer->Print(column.vars, column.is_string
+        ? "$type$ $field$_column_;\n"
+        : "std::vector<$type$> $field$_column_;\n");
+    if (column.has_presence) {
+      printer->Print(column.vars, "std::vector<uint8_t> $field$_present_;\n");
+    }
+  }
+  printer->Outdent();
+  printer->Print("};\n\n");
+
+  for (int i = 0; i < message->nested_type_count(); ++i) {
+    if (!GenerateFor(message->nested_type(i), file, context)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+bool Generator::GenerateFile(const google::protobuf::FileDescriptor* file,
+                             const std::string& parameter,
+                             google::protobuf::compiler::GeneratorContext* context,
+                             std::string* error) const {
+  if (!parameter.empty()) {
+    *error = "columnar-batch takes no parameters";
+    return false;
+  }
+
+  if (file->message_type_count() > 0) {
+    using google::protobuf::compiler::StripProto;
+    auto hh_filename = StripProto(file->name()) + ".pb.h";
+    GetPrinter(hh_filename, "includes", context)->PrintRaw(kBatchRuntime);
+  }
+
+  return true;
+}
+
+
+bool Generator::GenerateMessage(
+    const google::protobuf::Descriptor* message,
+    const std::string& /*parameter*/,
+    google::protobuf::compiler::GeneratorContext* context,
+    std::string* /*error*/) const {
+  return GenerateFor(message, message->file(), context);
+}
@@ -0,0 +1,261 @@
+#include "generation_cache.h"
+
+#include "recording_context.h"
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/descriptor.pb.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+// The first line of every entry, bumped whenever the format changes.
+const char kEntryMagic[] = "protoc-plugin-cache 1\n";
+
+
+// 128 bit FNV-1a.
+class Hasher {
+ public:
+  Hasher() : state_(Offset()) {}
+
+  void Update(const void* data, size_t size) {
+    auto* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; ++i) {
+      state_ ^= bytes[i];
+      state_ *= Prime();
+    }
+  }
+
+  // Hashes value prefixed by its size, so consecutive values cannot run into
+  // each other.
+  void Update(const std::string& value) {
+    uint64_t size = value.size();
+    Update(&size, sizeof(size));
+    Update(value.data(), value.size());
+  }
+
+  std::string Hex() const {
+    static const char kDigits[] = "0123456789abcdef";
+    std::string hex;
+    for (int shift = 124; shift >= 0; shift -= 4) {
+      hex += kDigits[static_cast<int>(state_ >> shift) & 0xf];
+    }
+    return hex;
+  }
+
+ private:
+  static unsigned __int128 Offset() {
+    return (static_cast<unsigned __int128>(0x6c62272e07bb0142ull) << 64) |
+           0x62b821756295c58dull;
+  }
+
+  static unsigned __int128 Prime() {
+    return (static_cast<unsigned __int128>(1) << 88) | 0x13bu;
+  }
+
+  unsigned __int128 state_;
+};
+
+
+// Helper function to hash the running executable, so that rebuilding a plugin
+// invalidates what it cached. Hashes nothing if the executable can't be read.
+void HashExecutable(Hasher* hasher) {
+  std::ifstream exe("/proc/self/exe", std::ios::binary);
+  char buffer[1 << 16];
+  while (exe.read(buffer, sizeof(buffer)) || exe.gcount() > 0) {
+    hasher->Update(buffer, static_cast<size_t>(exe.gcount()));
+  }
+}
+
+
+// Helper function to hash file and, once each, all of its dependencies.
+void HashFile(const google::protobuf::FileDescriptor* file,
+              std::set<const google::protobuf::FileDescriptor*>* seen,
+              Hasher* hasher) {
+  if (!seen->insert(file).second) {
+    return;
+  }
+
+  google::protobuf::FileDescriptorProto proto;
+  file->CopyTo(&proto);
+  hasher->Update(proto.SerializeAsString());
+
+  for (int i = 0; i < file->dependency_count(); ++i) {
+    HashFile(file->dependency(i), seen, hasher);
+  }
+}
+
+
+// Helper function to create dir and its missing parents.
+bool MakeDirectories(const std::string& dir) {
+  for (size_t i = 1; i <= dir.size(); ++i) {
+    if (i == dir.size() || dir[i] == '/') {
+      auto parent = dir.substr(0, i);
+      if (mkdir(parent.c_str(), 0777) != 0 && errno != EEXIST) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+
+void PutInt(uint64_t value, std::string* out) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+
+void PutString(const std::string& value, std::string* out) {
+  PutInt(value.size(), out);
+  out->append(value);
+}
+
+
+bool GetInt(const std::string& in, size_t* pos, uint64_t* value) {
+  if (in.size() - *pos < sizeof(*value)) {
+    return false;
+  }
+  memcpy(value, in.data() + *pos, sizeof(*value));
+  *pos += sizeof(*value);
+  return true;
+}
+
+
+bool GetString(const std::string& in, size_t* pos, std::string* value) {
+  uint64_t size;
+  if (!GetInt(in, pos, &size) || in.size() - *pos < size) {
+    return false;
+  }
+  value->assign(in, *pos, size);
+  *pos += size;
+  return true;
+}
+
+}  // namespace
+
+
+GenerationCache::GenerationCache(const std::string& dir,
+                                 const std::string& version,
+                                 const std::string& compiler_version,
+                                 const std::string& parameter)
+    : dir_(dir), hits_(0), misses_(0), failed_stores_(0) {
+  Hasher hasher;
+  hasher.Update(kEntryMagic);
+  hasher.Update(version);
+  hasher.Update(compiler_version);
+  hasher.Update(parameter);
+  HashExecutable(&hasher);
+  salt_ = hasher.Hex();
+}
+
+
+std::string GenerationCache::Key(
+    const google::protobuf::FileDescriptor* file) const {
+  Hasher hasher;
+  hasher.Update(salt_);
+
+  std::set<const google::protobuf::FileDescriptor*> seen;
+  HashFile(file, &seen, &hasher);
+
+  return hasher.Hex();
+}
+
+
+std::string GenerationCache::Path(const std::string& key) const {
+  return dir_ + "/" + key;
+}
+
+
+bool GenerationCache::Load(const std::string& key, RecordingContext* context) {
+  std::ifstream file(Path(key), std::ios::binary);
+  std::string entry((std::istreambuf_iterator<char>(file)),
+                    std::istreambuf_iterator<char>());
+
+  size_t pos = sizeof(kEntryMagic) - 1;
+  uint64_t count;
+  bool valid = entry.compare(0, pos, kEntryMagic) == 0 &&
+               GetInt(entry, &pos, &count);
+
+  RecordingContext loaded;
+  for (uint64_t i = 0; valid && i < count; ++i) {
+    uint64_t kind;
+    std::string file_name, insertion_point, content;
+    valid = GetInt(entry, &pos, &kind) && kind <= RecordingContext::Output::kAppend &&
+            GetString(entry, &pos, &file_name) &&
+            GetString(entry, &pos, &insertion_point) &&
+            GetString(entry, &pos, &content);
+
+    if (valid) {
+      loaded.Add(static_cast<RecordingContext::Output::Kind>(kind), file_name,
+                 insertion_point, content);
+    }
+  }
+
+  if (!valid || pos != entry.size()) {
+    ++misses_;
+    return false;
+  }
+
+  for (auto& output : loaded.outputs()) {
+    context->Add(output->kind, output->file_name, output->insertion_point,
+                 output->content);
+  }
+
+  ++hits_;
+  return true;
+}
+
+
+bool GenerationCache::Store(const std::string& key,
+                            const std::vector<const RecordingContext*>& parts) {
+  std::string entry = kEntryMagic;
+
+  uint64_t count = 0;
+  for (auto* part : parts) {
+    count += part->outputs().size();
+  }
+  PutInt(count, &entry);
+
+  for (auto* part : parts) {
+    for (auto& output : part->outputs()) {
+      PutInt(static_cast<uint64_t>(output->kind), &entry);
+      PutString(output->file_name, &entry);
+      PutString(output->insertion_point, &entry);
+      PutString(output->content, &entry);
+    }
+  }
+
+  // Every store writes a file of its own, so that concurrent stores of the
+  // same key never interleave, and renaming it over the entry is atomic.
+  static std::atomic<unsigned> stores(0);
+  std::ostringstream temp;
+  temp << Path(key) << ".tmp." << getpid() << "." << stores++;
+
+  bool stored = MakeDirectories(dir_);
+  if (stored) {
+    std::ofstream file(temp.str(), std::ios::binary | std::ios::trunc);
+    file.write(entry.data(), static_cast<std::streamsize>(entry.size()));
+    file.close();
+    stored = file.good() && rename(temp.str().c_str(), Path(key).c_str()) == 0;
+  }
+
+  if (!stored) {
+    remove(temp.str().c_str());
+    ++failed_stores_;
+  }
+
+  return stored;
+}
@@ -0,0 +1,55 @@
+#ifndef MYAPP_COMMON_GENERATION_CACHE
+#define MYAPP_COMMON_GENERATION_CACHE
+
+#include "recording_context.h"
+
+#include <google/protobuf/descriptor.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// A directory of the outputs a generator produced for a file, keyed by a hash
+// of everything the outputs depend on: the file and its transitive
+// dependencies, the generator (its version and its executable), the protoc
+// version and the parameter.
+//
+// Entries are written to a temporary file and renamed into place, so several
+// protoc runs can share a directory: readers see a whole entry or none.
+class GenerationCache {
+ public:
+  GenerationCache(const std::string& dir, const std::string& version,
+                  const std::string& compiler_version,
+                  const std::string& parameter);
+
+  // Returns the key of the outputs for file.
+  std::string Key(const google::protobuf::FileDescriptor* file) const;
+
+  // Loads the outputs stored under key into context. Returns false (a miss)
+  // when there are none or the entry cannot be read.
+  bool Load(const std::string& key, RecordingContext* context);
+
+  // Stores the outputs of each of parts, in order, under key.
+  bool Store(const std::string& key,
+             const std::vector<const RecordingContext*>& parts);
+
+  const std::string& dir() const { return dir_; }
+  size_t hits() const { return hits_; }
+  size_t misses() const { return misses_; }
+  size_t failed_stores() const { return failed_stores_; }
+
+ private:
+  std::string Path(const std::string& key) const;
+
+  std::string dir_;
+  // The hash of everything but the file, that every key starts from.
+  std::string salt_;
+
+  std::atomic<size_t> hits_;
+  std::atomic<size_t> misses_;
+  std::atomic<size_t> failed_stores_;
+};
+
+#endif // MYAPP_COMMON_GENERATION_CACHE
@@ -0,0 +1,186 @@
+#include "insertion.h"
+
+#include <google/protobuf/compiler/code_generator.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/io/printer.h>
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+std::string GetFullInsertionPoint(
+    const std::string& point_name,
+    const google::protobuf::Descriptor* message) {
+  return message == nullptr ? point_name
+                            : point_name + ":" + message->full_name();
+}
+
+
+google::protobuf::io::ZeroCopyOutputStream* GetInserter(
+    const std::string& file_name, const std::string& insertion_point,
+    google::protobuf::compiler::GeneratorContext* context,
+    const google::protobuf::Descriptor* message) {
+  auto full_insertion_point = GetFullInsertionPoint(insertion_point, message);
+  return context->OpenForInsert(file_name, full_insertion_point);
+}
+
+
+std::shared_ptr<google::protobuf::io::Printer> GetPrinter(
+    const std::string& file_name, const std::string& insertion_point,
+    google::protobuf::compiler::GeneratorContext* context,
+    const google::protobuf::Descriptor* message) {
+  auto* inserter = GetInserter(file_name, insertion_point, context, message);
+
+  // The printer owns the inserter, so the insertion is complete as soon as
+  // the last reference to the printer goes away.
+  std::shared_ptr<google::protobuf::io::ZeroCopyOutputStream> owner(inserter);
+  auto* printer = new google::protobuf::io::Printer(inserter, '$');
+  return std::shared_ptr<google::protobuf::io::Printer>(
+      printer, [owner](google::protobuf::io::Printer* p) { delete p; });
+}
+
+
+std::string ClassName(const google::protobuf::Descriptor* message,
+                      bool qualified) {
+  std::string name = message->name();
+  for (auto* m = message->containing_type(); m; m = m->containing_type()) {
+    name = m->name() + "_" + name;
+  }
+
+  if (!qualified) {
+    return name;
+  }
+
+  std::string scope = "::";
+  for (char c : message->file()->package()) {
+    if (c == '.') {
+      scope += "::";
+    } else {
+      scope += c;
+    }
+  }
+
+  return scope.size() > 2 ? scope + "::" + name : scope + name;
+}
+
+
+// Helper function to get the qualified c++ name of an enum, e.g.
+// ::example::Foo_Kind for the nested enum example.Foo.Kind.
+std::string EnumName(const google::protobuf::EnumDescriptor* enum_type) {
+  if (enum_type->containing_type() != nullptr) {
+    return ClassName(enum_type->containing_type(), true) + "_" +
+           enum_type->name();
+  }
+
+  std::string scope = "::";
+  for (char c : enum_type->file()->package()) {
+    if (c == '.') {
+      scope += "::";
+    } else {
+      scope += c;
+    }
+  }
+
+  return scope.size() > 2 ? scope + "::" + enum_type->name()
+                          : scope + enum_type->name();
+}
+
+
+// Helper function to convert a snake_case field name to CamelCase, the same
+// way protoc names the kFooFieldNumber constants.
+std::string CamelCase(const std::string& name) {
+  std::string s;
+  bool capitalize = true;
+
+  for (char c : name) {
+    if (c == '_') {
+      capitalize = true;
+    } else if (capitalize && c >= 'a' && c <= 'z') {
+      s += static_cast<char>(c - 'a' + 'A');
+      capitalize = false;
+    } else {
+      s += c;
+      capitalize = c >= '0' && c <= '9';
+    }
+  }
+
+  return s;
+}
+
+
+// Helper function to get the insertion points of the accessors that change a
+// field, with the files they are in (true for the header). protoc fills only
+// the first insertion point of a name, so accessor overloads sharing one are
+// not covered: see MutatorsHaveInsertionPoints.
+std::vector<std::pair<std::string, bool>> MutatingInsertionPoints(
+    const google::protobuf::FieldDescriptor* field) {
+  using google::protobuf::FieldDescriptor;
+
+  bool is_string = field->cpp_type() == FieldDescriptor::CPPTYPE_STRING;
+  bool is_message = field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE;
+
+  if (field->is_map()) {
+    return {{"field_mutable_map", true}};
+  }
+
+  if (field->is_repeated()) {
+    std::vector<std::pair<std::string, bool>> points = {
+        {"field_add", true}, {"field_mutable_list", true}};
+    if (!is_message) {
+      points.push_back({"field_set", true});
+    }
+    if (is_string || is_message) {
+      points.push_back({"field_mutable", true});
+    }
+    if (is_string) {
+      points.push_back({"field_set_char", true});
+      points.push_back({"field_set_pointer", true});
+      points.push_back({"field_add_char", true});
+      points.push_back({"field_add_pointer", true});
+      points.push_back({"field_add_mutable", true});
+    }
+    return points;
+  }
+
+  if (is_message) {
+    std::vector<std::pair<std::string, bool>> points = {
+        {"field_mutable", true},
+        {"field_release", true},
+        {"field_unsafe_arena_set_allocated", true}};
+    if (field->real_containing_oneof() != nullptr) {
+      // set_allocated of a oneof message is defined in the source file.
+      points.push_back({"field_set_allocated", false});
+      points.push_back({"field_unsafe_arena_release", true});
+    } else {
+      points.push_back({"field_set_allocated", true});
+    }
+    return points;
+  }
+
+  if (is_string) {
+    return {{"field_set", true},
+            {"field_mutable", true},
+            {"field_release", true},
+            {"field_set_allocated", true}};
+  }
+
+  return {{"field_set", true}};
+}
+
+
+// Helper function to tell whether code inserted at the MutatingInsertionPoints
+// of the fields of a message runs on every change through its accessors.
+bool MutatorsHaveInsertionPoints(const google::protobuf::Descriptor* message) {
+  using google::protobuf::FieldDescriptor;
+
+  for (int i = 0; i < message->field_count(); ++i) {
+    auto* field = message->field(i);
+    if (field->is_repeated() && !field->is_map() &&
+        field->cpp_type() == FieldDescriptor::CPPTYPE_STRING) {
+      return false;
+    }
+  }
+  return true;
+}
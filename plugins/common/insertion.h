@@ -0,0 +1,58 @@
+#ifndef MYAPP_COMMON_INSERTION
+#define MYAPP_COMMON_INSERTION
+
+#include <google/protobuf/compiler/code_generator.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/io/printer.h>
+#include <google/protobuf/io/zero_copy_stream.h>
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Helper function to get the full name for an insertion point.
+std::string GetFullInsertionPoint(
+    const std::string& point_name,
+    const google::protobuf::Descriptor* message = nullptr);
+
+// Helper function to return a pointer to an inserter stream
+google::protobuf::io::ZeroCopyOutputStream* GetInserter(
+    const std::string& file_name, const std::string& insertion_point,
+    google::protobuf::compiler::GeneratorContext* context,
+    const google::protobuf::Descriptor* message = nullptr);
+
+// Helper function to return a printer for an insertion point
+std::shared_ptr<google::protobuf::io::Printer> GetPrinter(
+    const std::string& file_name, const std::string& insertion_point,
+    google::protobuf::compiler::GeneratorContext* context,
+    const google::protobuf::Descriptor* message = nullptr);
+
+// Helper function to get the c++ class name of a message, e.g. Foo_Bar for
+// the nested message example.Foo.Bar, optionally qualified with its namespace.
+std::string ClassName(const google::protobuf::Descriptor* message,
+                      bool qualified = false);
+
+// Helper function to get the qualified c++ name of an enum, e.g.
+// ::example::Foo_Kind for the nested enum example.Foo.Kind.
+std::string EnumName(const google::protobuf::EnumDescriptor* enum_type);
+
+// Helper function to convert a snake_case field name to CamelCase, the same
+// way protoc names the kFooFieldNumber constants.
+std::string CamelCase(const std::string& name);
+
+// Helper function to get the insertion points of the accessors that change a
+// field, with the files they are in (true for the header). protoc fills only
+// the first insertion point of a name, so accessor overloads sharing one are
+// not covered: see MutatorsHaveInsertionPoints.
+std::vector<std::pair<std::string, bool>> MutatingInsertionPoints(
+    const google::protobuf::FieldDescriptor* field);
+
+// Helper function to tell whether code inserted at the MutatingInsertionPoints
+// of the fields of a message runs on every change through its accessors. It
+// does not for repeated string and bytes fields, whose set_<field>(int,
+// std::string&&) and add_<field>(std::string&&) share field_set and field_add
+// with their const std::string& overloads.
+bool MutatorsHaveInsertionPoints(const google::protobuf::Descriptor* message);
+
+#endif // MYAPP_COMMON_INSERTION
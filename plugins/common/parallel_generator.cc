@@ -0,0 +1,307 @@
+#include "parallel_generator.h"
+
+#include "generation_cache.h"
+#include "recording_context.h"
+#include "trace.h"
+#include "worker_pool.h"
+
+#include <google/protobuf/compiler/code_generator.h>
+#include <google/protobuf/compiler/plugin.pb.h>
+#include <google/protobuf/descriptor.h>
+
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// The buffer of the part being generated on this thread, if any.
+thread_local std::ostream* diagnostics = nullptr;
+
+}  // namespace
+
+
+std::ostream& GenerationDiagnostics() {
+  return diagnostics != nullptr ? *diagnostics : std::cerr;
+}
+
+
+bool ParseGenerationParameter(const std::string& parameter,
+                              GenerationOptions* options, std::string* rest,
+                              std::string* error) {
+  std::vector<std::pair<std::string, std::string>> params;
+  google::protobuf::compiler::ParseGeneratorParameter(parameter, &params);
+
+  rest->clear();
+  for (auto& param : params) {
+    if (param.first == "jobs") {
+      char* end = nullptr;
+      auto value = strtoull(param.second.c_str(), &end, 10);
+      if (param.second.empty() || *end != '\0') {
+        *error = "expected a number of jobs, got: " + param.second;
+        return false;
+      }
+      options->jobs = static_cast<size_t>(value);
+      continue;
+    }
+
+    if (param.first == "cache_dir") {
+      if (param.second.empty()) {
+        *error = "expected a directory for cache_dir";
+        return false;
+      }
+      options->cache_dir = param.second;
+      continue;
+    }
+
+    if (param.first == "trace") {
+      if (param.second.empty()) {
+        *error = "expected a path for trace";
+        return false;
+      }
+      options->trace = param.second;
+      continue;
+    }
+
+    if (!rest->empty()) {
+      *rest += ",";
+    }
+    *rest += param.second.empty() ? param.first
+                                  : param.first + "=" + param.second;
+  }
+
+  return true;
+}
+
+
+bool ParallelGenerator::GenerateFile(
+    const google::protobuf::FileDescriptor* file, const std::string& parameter,
+    google::protobuf::compiler::GeneratorContext* context,
+    std::string* error) const {
+  return true;
+}
+
+
+bool ParallelGenerator::Generate(
+    const google::protobuf::FileDescriptor* file, const std::string& parameter,
+    google::protobuf::compiler::GeneratorContext* context,
+    std::string* error) const {
+  GenerationOptions options;
+  std::string rest;
+  if (!ParseGenerationParameter(parameter, &options, &rest, error)) {
+    return false;
+  }
+
+  TraceSpan span("Generate", file->name());
+
+  std::unique_ptr<TracingContext> traced;
+  if (Tracer::active() != nullptr) {
+    traced.reset(new TracingContext(context));
+    context = traced.get();
+  }
+
+  if (!GenerateFile(file, rest, context, error)) {
+    return false;
+  }
+
+  // Generate for each message. Short circuit on any failures.
+  for (int i = 0; i < file->message_type_count(); ++i) {
+    auto* message = file->message_type(i);
+    TraceSpan message_span("GenerateMessage", message->full_name());
+    if (!GenerateMessage(message, rest, context, error)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+bool ParallelGenerator::GenerateAll(
+    const std::vector<const google::protobuf::FileDescriptor*>& files,
+    const std::string& parameter,
+    google::protobuf::compiler::GeneratorContext* context,
+    std::string* error) const {
+  GenerationOptions options;
+  std::string rest;
+  if (!ParseGenerationParameter(parameter, &options, &rest, error)) {
+    return false;
+  }
+
+  // A generator hosted by another plugin (see plugins/multi) is traced by
+  // the host's tracer, if it has one.
+  if (options.trace.empty() || Tracer::active() != nullptr) {
+    return GenerateAllFiles(files, options, rest, context, error);
+  }
+
+  Tracer tracer(options.trace);
+  tracer.Activate();
+
+  // Everything up to now was RunPlugin reading and parsing the request and
+  // building the descriptor pool.
+  tracer.AddSpan("RunPlugin", 0, Tracer::Now(), "");
+
+  auto generated = GenerateAllFiles(files, options, rest, context, error);
+
+  tracer.AddPeakRss();
+  tracer.Deactivate();
+
+  std::string trace_error;
+  if (!tracer.Write(&trace_error) && generated) {
+    *error = trace_error;
+    return false;
+  }
+
+  return generated;
+}
+
+
+bool ParallelGenerator::GenerateAllFiles(
+    const std::vector<const google::protobuf::FileDescriptor*>& files,
+    const GenerationOptions& options, const std::string& rest,
+    google::protobuf::compiler::GeneratorContext* context,
+    std::string* error) const {
+  TraceSpan span("GenerateAll");
+  span.AddArg("files", static_cast<uint64_t>(files.size()));
+
+  // Without workers or a cache the parts can go straight to protoc's context.
+  if (options.jobs == 1 && options.cache_dir.empty()) {
+    for (auto* file : files) {
+      if (!Generate(file, rest, context, error)) {
+        *error = file->name() + ": " + *error;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  std::unique_ptr<GenerationCache> cache;
+  if (!options.cache_dir.empty()) {
+    google::protobuf::compiler::Version compiler_version;
+    context->GetCompilerVersion(&compiler_version);
+    cache.reset(new GenerationCache(options.cache_dir, Version(),
+                                    compiler_version.SerializeAsString(),
+                                    rest));
+  }
+
+  // A part of a file: the file itself when message is null, else one of its
+  // top level messages.
+  struct Part {
+    const google::protobuf::Descriptor* message;
+    RecordingContext context;
+    std::ostringstream diagnostics;
+    std::string error;
+    bool succeeded = false;
+  };
+
+  // The parts of a file, or its outputs from the cache.
+  struct File {
+    const google::protobuf::FileDescriptor* file;
+    std::string key;
+    bool cached = false;
+    RecordingContext cached_context;
+    std::vector<std::unique_ptr<Part>> parts;
+  };
+
+  std::vector<std::unique_ptr<File>> outputs;
+  for (auto* file : files) {
+    outputs.emplace_back(new File());
+    auto& output = *outputs.back();
+    output.file = file;
+
+    if (cache) {
+      TraceSpan load_span("cache lookup", file->name());
+      output.key = cache->Key(file);
+      output.cached = cache->Load(output.key, &output.cached_context);
+      if (output.cached) {
+        continue;
+      }
+    }
+
+    output.parts.emplace_back(new Part());
+    output.parts.back()->message = nullptr;
+
+    for (int i = 0; i < file->message_type_count(); ++i) {
+      output.parts.emplace_back(new Part());
+      output.parts.back()->message = file->message_type(i);
+    }
+  }
+
+  std::vector<std::function<void()>> tasks;
+  for (auto& output : outputs) {
+    auto* file = output->file;
+    for (auto& part : output->parts) {
+      auto* p = part.get();
+      tasks.push_back([this, file, p, &rest]() {
+        google::protobuf::compiler::GeneratorContext* context = &p->context;
+        std::unique_ptr<TracingContext> traced;
+        if (Tracer::active() != nullptr) {
+          traced.reset(new TracingContext(context));
+          context = traced.get();
+        }
+
+        diagnostics = &p->diagnostics;
+        if (p->message == nullptr) {
+          TraceSpan part_span("GenerateFile", file->name());
+          p->succeeded = GenerateFile(file, rest, context, &p->error);
+        } else {
+          TraceSpan part_span("GenerateMessage", p->message->full_name());
+          p->succeeded = GenerateMessage(p->message, rest, context, &p->error);
+        }
+        diagnostics = nullptr;
+      });
+    }
+  }
+
+  RunTasks(tasks, options.jobs);
+
+  for (auto& output : outputs) {
+    for (auto& part : output->parts) {
+      std::cerr << part->diagnostics.str();
+    }
+  }
+
+  // Report the first failure in file order, so errors are deterministic too.
+  for (auto& output : outputs) {
+    for (auto& part : output->parts) {
+      if (!part->succeeded) {
+        *error = output->file->name() + ": " + part->error;
+        return false;
+      }
+    }
+  }
+
+  TraceSpan replay_span("Replay");
+  for (auto& output : outputs) {
+    if (output->cached) {
+      output->cached_context.Replay(context);
+      continue;
+    }
+
+    std::vector<const RecordingContext*> contexts;
+    for (auto& part : output->parts) {
+      part->context.Replay(context);
+      contexts.push_back(&part->context);
+    }
+
+    if (cache) {
+      cache->Store(output->key, contexts);
+    }
+  }
+
+  if (cache) {
+    std::cerr << Version() << ": " << cache->hits() << " cached, "
+              << cache->misses() << " generated";
+    if (cache->failed_stores() > 0) {
+      std::cerr << ", " << cache->failed_stores() << " failed to store";
+    }
+    std::cerr << " (cache_dir=" << cache->dir() << ")\n";
+  }
+
+  return true;
+}
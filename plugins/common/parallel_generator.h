@@ -0,0 +1,96 @@
+#ifndef MYAPP_COMMON_PARALLEL_GENERATOR
+#define MYAPP_COMMON_PARALLEL_GENERATOR
+
+#include <google/protobuf/compiler/code_generator.h>
+#include <google/protobuf/descriptor.h>
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+// A CodeGenerator that generates each file as a part for the file itself
+// followed by a part for each of its top level messages.
+//
+// That lets GenerateAll() spread the files, and the messages within them,
+// across a pool of worker threads when the parameter has jobs=N (N > 1, or 0
+// for a thread per core). Every part writes into a context of its own, and
+// the parts are written to protoc's context in file and message order once
+// they are all done, so the output does not depend on the number of jobs.
+//
+// With cache_dir=DIR, GenerateAll() also stores the outputs of each file in
+// DIR, and replays them instead of generating the file again as long as
+// neither the file, its dependencies, the generator nor the rest of the
+// parameter changed. Hits and misses are reported on stderr.
+//
+// With trace=PATH, GenerateAll() writes a Chrome trace of the run to PATH
+// (see common/trace.h): a span for each file and message, for each insertion
+// (with the bytes written to it) and for whatever the generator traces
+// itself, and the peak RSS of the plugin.
+//
+// The jobs, cache_dir and trace parameters are removed before the parameter
+// is passed on to GenerateFile() and GenerateMessage(), which must be safe to
+// call from several threads at once, and write anything meant for the user to
+// GenerationDiagnostics() rather than std::cerr.
+// The parameters ParallelGenerator handles itself.
+struct GenerationOptions {
+  // jobs=N: the number of threads to generate on, or 0 for one per core.
+  size_t jobs = 1;
+  // cache_dir=DIR: where to cache the outputs of each file, if anywhere.
+  std::string cache_dir;
+  // trace=PATH: where to write a Chrome trace of the run, if anywhere.
+  std::string trace;
+};
+
+class ParallelGenerator : public google::protobuf::compiler::CodeGenerator {
+ public:
+  bool Generate(const google::protobuf::FileDescriptor* file,
+                const std::string& parameter,
+                google::protobuf::compiler::GeneratorContext* context,
+                std::string* error) const override;
+
+  bool GenerateAll(const std::vector<const google::protobuf::FileDescriptor*>& files,
+                   const std::string& parameter,
+                   google::protobuf::compiler::GeneratorContext* context,
+                   std::string* error) const override;
+
+ protected:
+  // Names the generator and the version of the code it generates, e.g.
+  // "basic-options/1". Cached outputs are only reused by the same version.
+  virtual std::string Version() const = 0;
+
+  // Generates the code for the file itself, e.g. support code in its
+  // includes. Nothing by default.
+  virtual bool GenerateFile(const google::protobuf::FileDescriptor* file,
+                            const std::string& parameter,
+                            google::protobuf::compiler::GeneratorContext* context,
+                            std::string* error) const;
+
+  // Generates the code for a top level message and its nested messages.
+  virtual bool GenerateMessage(const google::protobuf::Descriptor* message,
+                               const std::string& parameter,
+                               google::protobuf::compiler::GeneratorContext* context,
+                               std::string* error) const = 0;
+
+ private:
+  bool GenerateAllFiles(
+      const std::vector<const google::protobuf::FileDescriptor*>& files,
+      const GenerationOptions& options, const std::string& parameter,
+      google::protobuf::compiler::GeneratorContext* context,
+      std::string* error) const;
+};
+
+// The stream for the diagnostics of the part being generated on this thread.
+// That is std::cerr, except while GenerateAll() generates the parts on workers
+// or with a cache: each part then writes to a buffer of its own, and the
+// buffers go to std::cerr in file and message order once all parts are done,
+// so the diagnostics of parts generated at once do not interleave.
+std::ostream& GenerationDiagnostics();
+
+// Splits the parameters of GenerationOptions off of parameter into options,
+// returning the rest of the parameter in rest. Options the parameter does not
+// have are left untouched.
+bool ParseGenerationParameter(const std::string& parameter,
+                              GenerationOptions* options, std::string* rest,
+                              std::string* error);
+
+#endif // MYAPP_COMMON_PARALLEL_GENERATOR
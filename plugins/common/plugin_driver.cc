@@ -0,0 +1,417 @@
+#include "plugin_driver.h"
+
+#include "trace.h"
+
+#include <google/protobuf/arena.h>
+#include <google/protobuf/compiler/code_generator.h>
+#include <google/protobuf/compiler/plugin.pb.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/descriptor_database.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// The fields of CodeGeneratorResponse and CodeGeneratorResponse.File that
+// the driver writes itself.
+const int kResponseErrorField = 1;
+const int kResponseSupportedFeaturesField = 2;
+const int kResponseFileField = 15;
+const int kFileNameField = 1;
+const int kFileInsertionPointField = 2;
+const int kFileContentField = 15;
+
+// Reads stdin in blocks of this size rather than FileInputStream's 8KB.
+const int kInputBlockSize = 1 << 16;
+
+// Lets the blocks of the arena the request is parsed into grow past the
+// default 8KB, so a large request is held in few blocks.
+const size_t kArenaMaxBlockSize = 1 << 20;
+
+
+uint32_t Tag(int field, int wire_type) {
+  return static_cast<uint32_t>(field << 3 | wire_type);
+}
+
+
+size_t StringFieldSize(const std::string& value) {
+  return 1 +
+         google::protobuf::io::CodedOutputStream::VarintSize32(
+             static_cast<uint32_t>(value.size())) +
+         value.size();
+}
+
+
+void WriteStringField(int field, const std::string& value,
+                      google::protobuf::io::CodedOutputStream* coded) {
+  coded->WriteTag(Tag(field, 2));
+  coded->WriteVarint32(static_cast<uint32_t>(value.size()));
+  coded->WriteString(value);
+}
+
+
+// The files of a request, by name, without copying them. The pool copies a
+// file only when it builds it.
+class RequestDatabase : public google::protobuf::DescriptorDatabase {
+ public:
+  explicit RequestDatabase(
+      const google::protobuf::compiler::CodeGeneratorRequest& request) {
+    for (auto& file : request.proto_file()) {
+      files_.emplace(file.name(), &file);
+    }
+  }
+
+  bool FindFileByName(const std::string& filename,
+                      google::protobuf::FileDescriptorProto* output) override {
+    auto found = files_.find(filename);
+    if (found == files_.end()) {
+      return false;
+    }
+    output->CopyFrom(*found->second);
+    return true;
+  }
+
+  // Every file the pool needs is a file to generate or one of their
+  // dependencies, which it finds by name.
+  bool FindFileContainingSymbol(
+      const std::string& symbol_name,
+      google::protobuf::FileDescriptorProto* output) override {
+    return false;
+  }
+
+  bool FindFileContainingExtension(
+      const std::string& containing_type, int field_number,
+      google::protobuf::FileDescriptorProto* output) override {
+    return false;
+  }
+
+ private:
+  std::map<std::string, const google::protobuf::FileDescriptorProto*> files_;
+};
+
+
+// Keeps the first error the DescriptorPool reports.
+class PoolErrorCollector
+    : public google::protobuf::DescriptorPool::ErrorCollector {
+ public:
+  void AddError(const std::string& filename, const std::string& element_name,
+                const google::protobuf::Message* descriptor,
+                ErrorLocation location, const std::string& message) override {
+    if (error_.empty()) {
+      error_ = filename + ": " + element_name + ": " + message;
+    }
+  }
+
+  const std::string& error() const { return error_; }
+
+ private:
+  std::string error_;
+};
+
+
+// A GeneratorContext that writes each output to the response on stdout as
+// soon as it is closed. protoc applies the outputs in the order they appear
+// in the response, so an output is held back until every output opened
+// before it is written too.
+class StreamingContext : public google::protobuf::compiler::GeneratorContext {
+ public:
+  StreamingContext(
+      const google::protobuf::compiler::CodeGeneratorRequest& request,
+      const std::vector<const google::protobuf::FileDescriptor*>& files,
+      google::protobuf::io::ZeroCopyOutputStream* output)
+      : request_(request), files_(files), output_(output) {}
+
+  google::protobuf::io::ZeroCopyOutputStream* Open(
+      const std::string& file_name) override {
+    return Add(file_name, nullptr);
+  }
+
+  google::protobuf::io::ZeroCopyOutputStream* OpenForInsert(
+      const std::string& file_name,
+      const std::string& insertion_point) override {
+    return Add(file_name, &insertion_point);
+  }
+
+  void ListParsedFiles(
+      std::vector<const google::protobuf::FileDescriptor*>* output) override {
+    *output = files_;
+  }
+
+  void GetCompilerVersion(
+      google::protobuf::compiler::Version* version) const override {
+    *version = request_.compiler_version();
+  }
+
+  // Writes the field of the response that comes before the outputs.
+  void WriteSupportedFeatures(uint64_t features) {
+    google::protobuf::io::CodedOutputStream coded(output_);
+    coded.WriteTag(Tag(kResponseSupportedFeaturesField, 0));
+    coded.WriteVarint64(features);
+  }
+
+  // Writes the error of the response, after the outputs. protoc ignores the
+  // outputs of a response with an error.
+  void WriteError(const std::string& error) {
+    google::protobuf::io::CodedOutputStream coded(output_);
+    WriteStringField(kResponseErrorField, error, &coded);
+  }
+
+  // The number of outputs written so far, and the microseconds spent
+  // writing them.
+  size_t written() const { return written_; }
+  uint64_t write_time() const { return write_time_; }
+
+ private:
+  struct Output {
+    std::string file_name;
+    bool has_insertion_point;
+    std::string insertion_point;
+    std::string content;
+    bool closed = false;
+  };
+
+  // The stream of an output, which writes it (and whatever is ready after
+  // it) when it is destroyed.
+  class OutputStream : public google::protobuf::io::ZeroCopyOutputStream {
+   public:
+    OutputStream(StreamingContext* context, Output* output)
+        : context_(context), output_(output), stream_(&output->content) {}
+
+    ~OutputStream() override { context_->Close(output_); }
+
+    bool Next(void** data, int* size) override {
+      return stream_.Next(data, size);
+    }
+
+    void BackUp(int count) override { stream_.BackUp(count); }
+
+    int64_t ByteCount() const override { return stream_.ByteCount(); }
+
+   private:
+    StreamingContext* context_;
+    Output* output_;
+    google::protobuf::io::StringOutputStream stream_;
+  };
+
+  google::protobuf::io::ZeroCopyOutputStream* Add(
+      const std::string& file_name, const std::string* insertion_point) {
+    std::unique_ptr<Output> output(new Output());
+    output->file_name = file_name;
+    output->has_insertion_point = insertion_point != nullptr;
+    if (insertion_point != nullptr) {
+      output->insertion_point = *insertion_point;
+    }
+
+    auto* stream = new OutputStream(this, output.get());
+    pending_.push_back(std::move(output));
+    return stream;
+  }
+
+  void Close(Output* output) {
+    output->closed = true;
+
+    auto start = Tracer::Now();
+    while (!pending_.empty() && pending_.front()->closed) {
+      Write(*pending_.front());
+      pending_.pop_front();
+      ++written_;
+    }
+    write_time_ += Tracer::Now() - start;
+  }
+
+  // Writes output as a CodeGeneratorResponse.File, without copying it into
+  // one first.
+  void Write(const Output& output) {
+    size_t size = StringFieldSize(output.file_name) +
+                  StringFieldSize(output.content);
+    if (output.has_insertion_point) {
+      size += StringFieldSize(output.insertion_point);
+    }
+
+    google::protobuf::io::CodedOutputStream coded(output_);
+    coded.WriteTag(Tag(kResponseFileField, 2));
+    coded.WriteVarint32(static_cast<uint32_t>(size));
+    WriteStringField(kFileNameField, output.file_name, &coded);
+    if (output.has_insertion_point) {
+      WriteStringField(kFileInsertionPointField, output.insertion_point,
+                       &coded);
+    }
+    WriteStringField(kFileContentField, output.content, &coded);
+  }
+
+  const google::protobuf::compiler::CodeGeneratorRequest& request_;
+  std::vector<const google::protobuf::FileDescriptor*> files_;
+  google::protobuf::io::ZeroCopyOutputStream* output_;
+
+  // The outputs not written yet, in the order they were opened.
+  std::deque<std::unique_ptr<Output>> pending_;
+  size_t written_ = 0;
+  uint64_t write_time_ = 0;
+};
+
+
+// Splits the stats parameter off of parameter, returning the rest of the
+// parameter in rest.
+bool ParseStatsParameter(const std::string& parameter, bool* stats,
+                         std::string* rest, std::string* error) {
+  std::vector<std::pair<std::string, std::string>> params;
+  google::protobuf::compiler::ParseGeneratorParameter(parameter, &params);
+
+  rest->clear();
+  for (auto& param : params) {
+    if (param.first == "stats") {
+      if (param.second.empty() || param.second == "true") {
+        *stats = true;
+      } else if (param.second == "false") {
+        *stats = false;
+      } else {
+        *error = "expected true or false for stats, got: " + param.second;
+        return false;
+      }
+      continue;
+    }
+
+    if (!rest->empty()) {
+      *rest += ",";
+    }
+    *rest += param.second.empty() ? param.first
+                                  : param.first + "=" + param.second;
+  }
+
+  return true;
+}
+
+
+// Counts files and their transitive dependencies.
+void CountFiles(const google::protobuf::FileDescriptor* file,
+                std::set<const google::protobuf::FileDescriptor*>* seen) {
+  if (!seen->insert(file).second) {
+    return;
+  }
+  for (int i = 0; i < file->dependency_count(); ++i) {
+    CountFiles(file->dependency(i), seen);
+  }
+}
+
+
+double Milliseconds(uint64_t microseconds) {
+  return static_cast<double>(microseconds) / 1000;
+}
+
+}  // namespace
+
+
+int RunPlugin(int argc, char* argv[],
+              const google::protobuf::compiler::CodeGenerator* generator) {
+  if (argc > 1) {
+    std::cerr << argv[0] << ": Unknown option: " << argv[1] << std::endl;
+    return 1;
+  }
+
+  // Read the request into an arena, straight from stdin ...
+  auto read_start = Tracer::Now();
+
+  google::protobuf::ArenaOptions arena_options;
+  arena_options.max_block_size = kArenaMaxBlockSize;
+  google::protobuf::Arena arena(arena_options);
+
+  auto* request = google::protobuf::Arena::CreateMessage<
+      google::protobuf::compiler::CodeGeneratorRequest>(&arena);
+  google::protobuf::io::FileInputStream input(STDIN_FILENO, kInputBlockSize);
+  if (!request->ParseFromZeroCopyStream(&input)) {
+    std::cerr << argv[0] << ": protoc sent unparseable request to plugin."
+              << std::endl;
+    return 1;
+  }
+  auto request_bytes = input.ByteCount();
+
+  // ... build the files to generate and their dependencies, and nothing
+  // else, ...
+  auto pool_start = Tracer::Now();
+
+  RequestDatabase database(*request);
+  PoolErrorCollector pool_errors;
+  google::protobuf::DescriptorPool pool(&database, &pool_errors);
+
+  std::string error;
+  std::vector<const google::protobuf::FileDescriptor*> files;
+  for (auto& name : request->file_to_generate()) {
+    auto* file = pool.FindFileByName(name);
+    if (file == nullptr) {
+      error = pool_errors.error().empty()
+                  ? "protoc asked plugin to generate a file but did not "
+                    "provide a descriptor for the file: " + name
+                  : pool_errors.error();
+      break;
+    }
+    files.push_back(file);
+  }
+
+  // ... and generate, writing each output as soon as it is ready.
+  auto generate_start = Tracer::Now();
+
+  google::protobuf::io::FileOutputStream output(STDOUT_FILENO);
+  StreamingContext context(*request, files, &output);
+  context.WriteSupportedFeatures(generator->GetSupportedFeatures());
+
+  bool stats = false;
+  std::string parameter;
+  if (error.empty() &&
+      ParseStatsParameter(request->parameter(), &stats, &parameter, &error) &&
+      !generator->GenerateAll(files, parameter, &context, &error) &&
+      error.empty()) {
+    error = "Code generator returned false but provided no error description.";
+  }
+
+  if (!error.empty()) {
+    context.WriteError(error);
+  }
+
+  if (!output.Close()) {
+    std::cerr << argv[0] << ": Error writing to stdout." << std::endl;
+    return 1;
+  }
+
+  auto end = Tracer::Now();
+
+  if (stats) {
+    std::set<const google::protobuf::FileDescriptor*> built;
+    for (auto* file : files) {
+      CountFiles(file, &built);
+    }
+
+    char line[512];
+    snprintf(line, sizeof(line),
+             "read %.1fms (%lld bytes, %zu bytes of arena), "
+             "pool %.1fms (%zu of %d files), "
+             "generate %.1fms (%zu outputs, %.1fms writing %lld bytes), "
+             "peak RSS %.1fMB",
+             Milliseconds(pool_start - read_start),
+             static_cast<long long>(request_bytes),
+             static_cast<size_t>(arena.SpaceUsed()),
+             Milliseconds(generate_start - pool_start), built.size(),
+             request->proto_file_size(), Milliseconds(end - generate_start),
+             context.written(), Milliseconds(context.write_time()),
+             static_cast<long long>(output.ByteCount()),
+             static_cast<double>(PeakRssBytes()) / (1 << 20));
+    std::cerr << argv[0] << ": " << line << std::endl;
+  }
+
+  return 0;
+}
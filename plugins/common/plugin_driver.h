@@ -0,0 +1,26 @@
+#ifndef MYAPP_COMMON_PLUGIN_DRIVER
+#define MYAPP_COMMON_PLUGIN_DRIVER
+
+#include <google/protobuf/compiler/code_generator.h>
+
+// Runs generator as a protoc plugin, like PluginMain, but with less memory
+// and startup time on large requests:
+//
+// - the CodeGeneratorRequest is parsed into an Arena, straight from a
+//   zero-copy stream over stdin;
+// - the DescriptorPool is built on demand from the request, so only the
+//   files to generate and their transitive dependencies are built;
+// - every file and insertion is written to stdout as soon as it (and
+//   everything opened before it) is closed, instead of being kept in the
+//   CodeGeneratorResponse until the end.
+//
+// With the stats parameter (e.g. --basic-options_opt=stats), the timings of
+// each phase, the sizes of the request and the response and the peak RSS of
+// the plugin are printed to stderr. stats is removed from the parameter
+// before it is passed on to generator.
+//
+// Returns the exit code of the plugin.
+int RunPlugin(int argc, char* argv[],
+              const google::protobuf::compiler::CodeGenerator* generator);
+
+#endif // MYAPP_COMMON_PLUGIN_DRIVER
@@ -0,0 +1,121 @@
+#include "recording_context.h"
+
+#include <google/protobuf/compiler/code_generator.h>
+#include <google/protobuf/io/zero_copy_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string>
+
+
+google::protobuf::io::ZeroCopyOutputStream* RecordingContext::Open(
+    const std::string& file_name) {
+  return Record(Output::kFile, file_name, "");
+}
+
+
+google::protobuf::io::ZeroCopyOutputStream* RecordingContext::OpenForAppend(
+    const std::string& file_name) {
+  return Record(Output::kAppend, file_name, "");
+}
+
+
+google::protobuf::io::ZeroCopyOutputStream* RecordingContext::OpenForInsert(
+    const std::string& file_name, const std::string& insertion_point) {
+  return Record(Output::kInsert, file_name, insertion_point);
+}
+
+
+void RecordingContext::ListParsedFiles(
+    std::vector<const google::protobuf::FileDescriptor*>* output) {
+  if (parent_ != nullptr) {
+    parent_->ListParsedFiles(output);
+  } else {
+    GeneratorContext::ListParsedFiles(output);
+  }
+}
+
+
+void RecordingContext::GetCompilerVersion(
+    google::protobuf::compiler::Version* version) const {
+  if (parent_ != nullptr) {
+    parent_->GetCompilerVersion(version);
+  } else {
+    GeneratorContext::GetCompilerVersion(version);
+  }
+}
+
+
+google::protobuf::io::ZeroCopyOutputStream* RecordingContext::Record(
+    Output::Kind kind, const std::string& file_name,
+    const std::string& insertion_point) {
+  std::unique_ptr<Output> output(new Output());
+  output->kind = kind;
+  output->file_name = file_name;
+  output->insertion_point = insertion_point;
+
+  // Outputs are heap allocated, so the stream's string stays put as more
+  // outputs are recorded.
+  auto* stream = new google::protobuf::io::StringOutputStream(&output->content);
+  outputs_.push_back(std::move(output));
+  return stream;
+}
+
+
+void RecordingContext::Add(Output::Kind kind, const std::string& file_name,
+                           const std::string& insertion_point,
+                           const std::string& content) {
+  std::unique_ptr<Output> output(new Output());
+  output->kind = kind;
+  output->file_name = file_name;
+  output->insertion_point = insertion_point;
+  output->content = content;
+  outputs_.push_back(std::move(output));
+}
+
+
+void RecordingContext::Replay(
+    google::protobuf::compiler::GeneratorContext* context) const {
+  for (auto& output : outputs_) {
+    std::unique_ptr<google::protobuf::io::ZeroCopyOutputStream> stream;
+
+    switch (output->kind) {
+      case Output::kFile:
+        stream.reset(context->Open(output->file_name));
+        break;
+      case Output::kAppend:
+        stream.reset(context->OpenForAppend(output->file_name));
+        break;
+      case Output::kInsert:
+        stream.reset(context->OpenForInsert(output->file_name,
+                                            output->insertion_point));
+        break;
+    }
+
+    WriteToStream(output->content, stream.get());
+  }
+}
+
+
+void WriteToStream(const std::string& content,
+                   google::protobuf::io::ZeroCopyOutputStream* stream) {
+  size_t written = 0;
+
+  while (written < content.size()) {
+    void* data;
+    int size;
+    if (!stream->Next(&data, &size)) {
+      return;
+    }
+
+    auto count = std::min(static_cast<size_t>(size), content.size() - written);
+    memcpy(data, content.data() + written, count);
+    written += count;
+
+    if (count < static_cast<size_t>(size)) {
+      stream->BackUp(static_cast<int>(static_cast<size_t>(size) - count));
+    }
+  }
+}
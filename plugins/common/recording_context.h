@@ -0,0 +1,74 @@
+#ifndef MYAPP_COMMON_RECORDING_CONTEXT
+#define MYAPP_COMMON_RECORDING_CONTEXT
+
+#include <google/protobuf/compiler/code_generator.h>
+#include <google/protobuf/io/zero_copy_stream.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// A GeneratorContext that keeps everything written to it in memory, so that a
+// generator can run without touching the real context (e.g. on a worker
+// thread) and its output can be written to the real context later.
+class RecordingContext : public google::protobuf::compiler::GeneratorContext {
+ public:
+  // parent, if any, answers the questions about the protoc run (the parsed
+  // files and the compiler version). It is never written to.
+  explicit RecordingContext(
+      google::protobuf::compiler::GeneratorContext* parent = nullptr)
+      : parent_(parent) {}
+
+  // One file, insertion or append that was opened on the context.
+  struct Output {
+    enum Kind { kFile, kInsert, kAppend };
+
+    Kind kind;
+    std::string file_name;
+    std::string insertion_point;
+    std::string content;
+  };
+
+  google::protobuf::io::ZeroCopyOutputStream* Open(
+      const std::string& file_name) override;
+
+  google::protobuf::io::ZeroCopyOutputStream* OpenForAppend(
+      const std::string& file_name) override;
+
+  google::protobuf::io::ZeroCopyOutputStream* OpenForInsert(
+      const std::string& file_name,
+      const std::string& insertion_point) override;
+
+  void ListParsedFiles(
+      std::vector<const google::protobuf::FileDescriptor*>* output) override;
+
+  void GetCompilerVersion(
+      google::protobuf::compiler::Version* version) const override;
+
+  // The outputs in the order they were opened.
+  const std::vector<std::unique_ptr<Output>>& outputs() const {
+    return outputs_;
+  }
+
+  // Records an output as if it had been opened and written to.
+  void Add(Output::Kind kind, const std::string& file_name,
+           const std::string& insertion_point, const std::string& content);
+
+  // Opens each of the outputs on context, in the order they were opened on
+  // this context, and writes their contents.
+  void Replay(google::protobuf::compiler::GeneratorContext* context) const;
+
+ private:
+  google::protobuf::io::ZeroCopyOutputStream* Record(
+      Output::Kind kind, const std::string& file_name,
+      const std::string& insertion_point);
+
+  google::protobuf::compiler::GeneratorContext* parent_;
+  std::vector<std::unique_ptr<Output>> outputs_;
+};
+
+// Writes all of content to stream.
+void WriteToStream(const std::string& content,
+                   google::protobuf::io::ZeroCopyOutputStream* stream);
+
+#endif // MYAPP_COMMON_RECORDING_CONTEXT
@@ -0,0 +1,267 @@
+#include "trace.h"
+
+#include <google/protobuf/compiler/code_generator.h>
+#include <google/protobuf/io/zero_copy_stream.h>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// When the plugin started, near enough: static initialization runs before
+// RunPlugin reads the request.
+const auto kStart = std::chrono::steady_clock::now();
+
+std::atomic<Tracer*> active_tracer(nullptr);
+
+
+// A stream that counts the bytes written to another one, and records a span
+// named after what was opened when it is closed.
+class CountingStream : public google::protobuf::io::ZeroCopyOutputStream {
+ public:
+  CountingStream(google::protobuf::io::ZeroCopyOutputStream* stream,
+                 const std::string& name, const std::string& file_name,
+                 const std::string& insertion_point)
+      : span_(name, insertion_point.empty() ? file_name : insertion_point),
+        stream_(stream) {
+    span_.AddArg("file", file_name);
+  }
+
+  ~CountingStream() override {
+    span_.AddArg("bytes", static_cast<uint64_t>(stream_->ByteCount()));
+  }
+
+  bool Next(void** data, int* size) override {
+    return stream_->Next(data, size);
+  }
+
+  void BackUp(int count) override { stream_->BackUp(count); }
+
+  int64_t ByteCount() const override { return stream_->ByteCount(); }
+
+ private:
+  // Declared before the stream, so it is destroyed after it: the span ends
+  // once the stream is closed, and so covers the close.
+  TraceSpan span_;
+  std::unique_ptr<google::protobuf::io::ZeroCopyOutputStream> stream_;
+};
+
+}  // namespace
+
+
+std::string JsonString(const std::string& value) {
+  std::string json = "\"";
+  for (unsigned char c : value) {
+    switch (c) {
+      case '"':
+        json += "\\\"";
+        break;
+      case '\\':
+        json += "\\\\";
+        break;
+      case '\n':
+        json += "\\n";
+        break;
+      case '\t':
+        json += "\\t";
+        break;
+      default:
+        if (c < 0x20) {
+          char escaped[8];
+          snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+          json += escaped;
+        } else {
+          json += static_cast<char>(c);
+        }
+    }
+  }
+  return json + "\"";
+}
+
+
+uint64_t PeakRssBytes() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+
+  // ru_maxrss is in kilobytes on Linux.
+  return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+}
+
+
+Tracer::Tracer(const std::string& path) : path_(path) {}
+
+
+Tracer* Tracer::active() { return active_tracer.load(); }
+
+
+void Tracer::Activate() { active_tracer = this; }
+
+
+void Tracer::Deactivate() {
+  Tracer* self = this;
+  active_tracer.compare_exchange_strong(self, nullptr);
+}
+
+
+uint64_t Tracer::Now() {
+  auto elapsed = std::chrono::steady_clock::now() - kStart;
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+}
+
+
+int Tracer::ThreadId() {
+  auto id = std::this_thread::get_id();
+  auto found = thread_ids_.find(id);
+  if (found != thread_ids_.end()) {
+    return found->second;
+  }
+
+  int thread_id = static_cast<int>(thread_ids_.size());
+  thread_ids_.emplace(id, thread_id);
+  return thread_id;
+}
+
+
+void Tracer::AddSpan(const std::string& name, uint64_t start, uint64_t end,
+                     const std::string& args) {
+  std::ostringstream event;
+  event << "{\"name\": " << JsonString(name) << ", \"ph\": \"X\""
+        << ", \"ts\": " << start << ", \"dur\": " << end - start
+        << ", \"pid\": " << getpid();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  event << ", \"tid\": " << ThreadId();
+  if (!args.empty()) {
+    event << ", \"args\": {" << args << "}";
+  }
+  event << "}";
+
+  events_.push_back(event.str());
+}
+
+
+void Tracer::AddPeakRss() {
+  auto peak_rss = PeakRssBytes();
+  if (peak_rss == 0) {
+    return;
+  }
+
+  std::ostringstream event;
+  event << "{\"name\": \"peak RSS\", \"ph\": \"C\", \"ts\": " << Now()
+        << ", \"pid\": " << getpid() << ", \"args\": {\"bytes\": "
+        << peak_rss << "}}";
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  events_.push_back(event.str());
+}
+
+
+bool Tracer::Write(std::string* error) const {
+  std::ofstream file(path_, std::ios::trunc);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+  for (size_t i = 0; i < events_.size(); ++i) {
+    file << events_[i] << (i + 1 < events_.size() ? ",\n" : "\n");
+  }
+  file << "]}\n";
+
+  file.close();
+  if (!file.good()) {
+    *error = "could not write the trace to " + path_;
+    return false;
+  }
+
+  return true;
+}
+
+
+TraceSpan::TraceSpan(const std::string& name, const std::string& detail)
+    : tracer_(Tracer::active()), start_(0) {
+  if (tracer_ == nullptr) {
+    return;
+  }
+
+  name_ = detail.empty() ? name : name + " " + detail;
+  start_ = Tracer::Now();
+}
+
+
+TraceSpan::~TraceSpan() {
+  if (tracer_ != nullptr) {
+    tracer_->AddSpan(name_, start_, Tracer::Now(), args_);
+  }
+}
+
+
+void TraceSpan::AddArg(const std::string& key, const std::string& value) {
+  if (tracer_ == nullptr) {
+    return;
+  }
+
+  if (!args_.empty()) {
+    args_ += ", ";
+  }
+  args_ += JsonString(key) + ": " + JsonString(value);
+}
+
+
+void TraceSpan::AddArg(const std::string& key, uint64_t value) {
+  if (tracer_ == nullptr) {
+    return;
+  }
+
+  if (!args_.empty()) {
+    args_ += ", ";
+  }
+  args_ += JsonString(key) + ": " + std::to_string(value);
+}
+
+
+google::protobuf::io::ZeroCopyOutputStream* TracingContext::Open(
+    const std::string& file_name) {
+  return new CountingStream(context_->Open(file_name), "Open", file_name, "");
+}
+
+
+google::protobuf::io::ZeroCopyOutputStream* TracingContext::OpenForAppend(
+    const std::string& file_name) {
+  return new CountingStream(context_->OpenForAppend(file_name),
+                            "OpenForAppend", file_name, "");
+}
+
+
+google::protobuf::io::ZeroCopyOutputStream* TracingContext::OpenForInsert(
+    const std::string& file_name, const std::string& insertion_point) {
+  return new CountingStream(
+      context_->OpenForInsert(file_name, insertion_point), "OpenForInsert",
+      file_name, insertion_point);
+}
+
+
+void TracingContext::ListParsedFiles(
+    std::vector<const google::protobuf::FileDescriptor*>* output) {
+  context_->ListParsedFiles(output);
+}
+
+
+void TracingContext::GetCompilerVersion(
+    google::protobuf::compiler::Version* version) const {
+  context_->GetCompilerVersion(version);
+}
@@ -0,0 +1,111 @@
+#ifndef MYAPP_COMMON_TRACE
+#define MYAPP_COMMON_TRACE
+
+#include <google/protobuf/compiler/code_generator.h>
+#include <google/protobuf/io/zero_copy_stream.h>
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Records what a plugin spends its time on as Chrome trace events, which
+// chrome://tracing and Perfetto can open.
+//
+// A plugin traces while a Tracer is active; TraceSpan and TracingContext do
+// nothing otherwise, so the instrumentation can stay in place.
+class Tracer {
+ public:
+  explicit Tracer(const std::string& path);
+
+  // The active tracer, or null when nothing is being traced.
+  static Tracer* active();
+
+  // Makes this the active tracer, until Deactivate().
+  void Activate();
+  void Deactivate();
+
+  // Microseconds since the plugin started.
+  static uint64_t Now();
+
+  // Records a span of name from start to end. args is the JSON of the
+  // members of its "args" object, if any.
+  void AddSpan(const std::string& name, uint64_t start, uint64_t end,
+               const std::string& args);
+
+  // Records the peak resident set size of the plugin so far.
+  void AddPeakRss();
+
+  // Writes the recorded events to the path of the tracer.
+  bool Write(std::string* error) const;
+
+ private:
+  int ThreadId();
+
+  std::string path_;
+
+  mutable std::mutex mutex_;
+  std::vector<std::string> events_;
+  std::map<std::thread::id, int> thread_ids_;
+};
+
+// Records a span of the active tracer from its construction to its
+// destruction, if there is an active tracer.
+class TraceSpan {
+ public:
+  explicit TraceSpan(const std::string& name, const std::string& detail = "");
+  ~TraceSpan();
+
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+  // Adds an argument to the span.
+  void AddArg(const std::string& key, const std::string& value);
+  void AddArg(const std::string& key, uint64_t value);
+
+ private:
+  Tracer* tracer_;
+  std::string name_;
+  uint64_t start_;
+  std::string args_;
+};
+
+// A GeneratorContext that passes everything on to another context, and
+// records a span, with the number of bytes written, for each file or
+// insertion that is opened, from opening it to closing it (which is when the
+// Printer writing to it is destroyed).
+class TracingContext : public google::protobuf::compiler::GeneratorContext {
+ public:
+  explicit TracingContext(google::protobuf::compiler::GeneratorContext* context)
+      : context_(context) {}
+
+  google::protobuf::io::ZeroCopyOutputStream* Open(
+      const std::string& file_name) override;
+
+  google::protobuf::io::ZeroCopyOutputStream* OpenForAppend(
+      const std::string& file_name) override;
+
+  google::protobuf::io::ZeroCopyOutputStream* OpenForInsert(
+      const std::string& file_name,
+      const std::string& insertion_point) override;
+
+  void ListParsedFiles(
+      std::vector<const google::protobuf::FileDescriptor*>* output) override;
+
+  void GetCompilerVersion(
+      google::protobuf::compiler::Version* version) const override;
+
+ private:
+  google::protobuf::compiler::GeneratorContext* context_;
+};
+
+// Returns the JSON string literal of value.
+std::string JsonString(const std::string& value);
+
+// Returns the peak resident set size of the process in bytes, or 0 if it is
+// not known.
+uint64_t PeakRssBytes();
+
+#endif // MYAPP_COMMON_TRACE
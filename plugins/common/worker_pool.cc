@@ -0,0 +1,34 @@
+#include "worker_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <thread>
+#include <vector>
+
+
+void RunTasks(const std::vector<std::function<void()>>& tasks, size_t jobs) {
+  if (jobs == 0) {
+    jobs = std::max(1u, std::thread::hardware_concurrency());
+  }
+  jobs = std::min(jobs, tasks.size());
+
+  std::atomic<size_t> next(0);
+  auto work = [&tasks, &next]() {
+    for (size_t i = next++; i < tasks.size(); i = next++) {
+      tasks[i]();
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < jobs; ++i) {
+    workers.emplace_back(work);
+  }
+
+  work();
+
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
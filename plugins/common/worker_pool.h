@@ -0,0 +1,13 @@
+#ifndef MYAPP_COMMON_WORKER_POOL
+#define MYAPP_COMMON_WORKER_POOL
+
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+// Runs each of tasks once on a pool of jobs threads (the calling thread
+// included), and returns when all of them are done. Tasks are handed out in
+// order, but may finish in any order. A jobs of 0 uses a thread per core.
+void RunTasks(const std::vector<std::function<void()>>& tasks, size_t jobs);
+
+#endif // MYAPP_COMMON_WORKER_POOL
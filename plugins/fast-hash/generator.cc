@@ -0,0 +1,547 @@
+#include "generator.h"
+
+#include "common/insertion.h"
+#include "common/trace.h"
+
+#include <google/protobuf/compiler/code_generator.h>
+#include <google/protobuf/compiler/cpp/cpp_generator.h>
+#include <google/protobuf/compiler/plugin.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/io/printer.h>
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+// Support code shared by the hashes of all messages. It is emitted into the
+// includes of every generated header, so it is guarded against being defined
+// more than once per translation unit.
+const char* const kHashRuntime = R"(
+#ifndef FAST_HASH_RUNTIME_
+#define FAST_HASH_RUNTIME_
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <type_traits>
+
+namespace fast_hash {
+
+constexpr uint64_t kSeed = 0x243f6a8885a308d3ull;
+
+// Mixes one word into a hash.
+inline uint64_t Mix(uint64_t h, uint64_t word) {
+  h = (h ^ word) * 0x9e3779b97f4a7c15ull;
+  return h ^ (h >> 32);
+}
+
+// Avalanches a hash, so that every bit of it depends on every word mixed
+// into it. The result is never 0, which marks a cached hash as unset.
+inline uint64_t Finish(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  return h != 0 ? h : 1;
+}
+
+// Mixes size bytes into a hash, a word at a time.
+inline uint64_t Bytes(uint64_t h, const void* data, size_t size) {
+  auto* p = static_cast<const unsigned char*>(data);
+  h = Mix(h, size);
+  for (; size >= sizeof(uint64_t); p += sizeof(uint64_t),
+                                   size -= sizeof(uint64_t)) {
+    uint64_t word;
+    std::memcpy(&word, p, sizeof(word));
+    h = Mix(h, word);
+  }
+  if (size > 0) {
+    uint64_t word = 0;
+    std::memcpy(&word, p, size);
+    h = Mix(h, word);
+  }
+  return h;
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_integral<T>::value ||
+                                   std::is_enum<T>::value,
+                               uint64_t>::type
+Value(uint64_t h, T value) {
+  return Mix(h, static_cast<uint64_t>(value));
+}
+
+// Floating point values that compare equal hash the same, so -0.0 hashes as
+// 0.0.
+inline uint64_t Value(uint64_t h, double value) {
+  uint64_t word = 0;
+  if (value != 0) {
+    std::memcpy(&word, &value, sizeof(word));
+  }
+  return Mix(h, word);
+}
+
+inline uint64_t Value(uint64_t h, float value) {
+  return Value(h, static_cast<double>(value));
+}
+
+inline uint64_t Value(uint64_t h, const std::string& value) {
+  return Bytes(h, value.data(), value.size());
+}
+
+// Messages of files not generated with fast-hash (the well-known types)
+// are compared and hashed through their encoding.
+template <typename Message>
+bool SerializedEqual(const Message& lhs, const Message& rhs) {
+  return lhs.SerializeAsString() == rhs.SerializeAsString();
+}
+
+template <typename Message>
+uint64_t SerializedHash(uint64_t h, const Message& message) {
+  return Value(h, message.SerializeAsString());
+}
+
+}  // namespace fast_hash
+#endif  // FAST_HASH_RUNTIME_
+)";
+
+
+namespace {
+
+// Helper function to tell whether a message is one of the well-known types,
+// which are not generated with this plugin.
+bool IsWellKnown(const google::protobuf::Descriptor* message) {
+  return message->file()->package() == "google.protobuf";
+}
+
+
+// Helper function to get the namespace of a message, e.g. ::example::.
+std::string Namespace(const google::protobuf::Descriptor* message) {
+  auto qualified = ClassName(message, true);
+  return qualified.substr(0, qualified.size() - ClassName(message).size());
+}
+
+
+// Helper function to get the expression comparing two values of a field.
+std::string EqualExpr(const google::protobuf::FieldDescriptor* field,
+                      const std::string& lhs, const std::string& rhs) {
+  using google::protobuf::FieldDescriptor;
+
+  if (field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE &&
+      IsWellKnown(field->message_type())) {
+    return "::fast_hash::SerializedEqual(" + lhs + ", " + rhs + ")";
+  }
+  return lhs + " == " + rhs;
+}
+
+
+// Helper function to get the expression mixing a value of a field into h.
+std::string HashExpr(const google::protobuf::FieldDescriptor* field,
+                     const std::string& h, const std::string& value) {
+  using google::protobuf::FieldDescriptor;
+
+  if (field->cpp_type() != FieldDescriptor::CPPTYPE_MESSAGE) {
+    return "::fast_hash::Value(" + h + ", " + value + ")";
+  }
+  if (IsWellKnown(field->message_type())) {
+    return "::fast_hash::SerializedHash(" + h + ", " + value + ")";
+  }
+  return "::fast_hash::Mix(" + h + ", " + Namespace(field->message_type()) +
+         "FastHash(" + value + "))";
+}
+
+
+// Helper function to declare the functions of a message and its nested
+// messages, so their definitions can call each other in any order.
+void Declare(const google::protobuf::Descriptor* message,
+             google::protobuf::io::Printer* printer) {
+  if (message->options().map_entry()) {
+    return;
+  }
+
+  printer->Print(
+      "inline bool operator==(const $class$& lhs, const $class$& rhs);\n"
+      "inline uint64_t FastHash(const $class$& message);\n",
+      "class", ClassName(message));
+  for (int i = 0; i < message->nested_type_count(); ++i) {
+    Declare(message->nested_type(i), printer);
+  }
+}
+
+}  // namespace
+
+
+std::string Generator::Version() const {
+  return "fast-hash/1";
+}
+
+
+bool Generator::GenerateFor(
+    const google::protobuf::Descriptor* message,
+    const google::protobuf::FileDescriptor* file,
+    google::protobuf::compiler::GeneratorContext* context,
+    const Options& options) const {
+  using google::protobuf::FieldDescriptor;
+
+  TraceSpan span("GenerateFor", message->full_name());
+
+  // Map entries are generated without insertion points.
+  if (message->options().map_entry()) {
+    return true;
+  }
+
+  std::map<std::string, std::string> vars;
+  vars["class"] = ClassName(message);
+  vars["qualified_class"] = ClassName(message, true);
+
+  using google::protobuf::compiler::StripProto;
+  auto hh_filename = StripProto(file->name()) + ".pb.h";
+  auto cc_filename = StripProto(file->name()) + ".pb.cc";
+
+  // A hash that some setters would leave stale would put the message in the
+  // wrong bucket, so such a message is hashed every time.
+  bool cached = options.cached_hash && MutatorsHaveInsertionPoints(message);
+  if (options.cached_hash && !cached) {
+    GetPrinter(hh_filename, "class_scope", context, message)->Print(
+        "// No cached hash (fast-hash cached_hash=true): the rvalue\n"
+        "// set_<field>(int, std::string&&) and add_<field>(std::string&&) of\n"
+        "// its repeated string fields could not reset it.\n"
+        "void InvalidateFastHash() {}\n");
+  }
+
+  if (cached) {
+    auto printer = GetPrinter(hh_filename, "class_scope", context, message);
+    printer->Print(
+        "// The hash FastHash last computed, or 0. The setters, Clear, CopyFrom\n"
+        "// and MergeFrom of the message reset it; anything else that changes\n"
+        "// the message must call InvalidateFastHash: merging parses,\n"
+        "// clear_<field>, writing through a pointer kept from a\n"
+        "// mutable_<field>, and Swap and move assignment, which exchange the\n"
+        "// fields of messages on the same arena but not their hashes (so\n"
+        "// std::swap, and the moves of std::sort, too).\n"
+        "mutable ::std::atomic<uint64_t> _fast_hash_{0};\n"
+        "void InvalidateFastHash() {\n"
+        "  _fast_hash_.store(0, ::std::memory_order_relaxed);\n"
+        "}\n");
+
+    // Parsing into a message clears it first, so parses that do not merge
+    // are covered by Clear.
+    GetPrinter(cc_filename, "message_clear_start", context, message)
+        ->Print("_fast_hash_.store(0, ::std::memory_order_relaxed);\n");
+    GetPrinter(cc_filename, "class_specific_merge_from_start", context, message)
+        ->Print("_this->_fast_hash_.store(0, ::std::memory_order_relaxed);\n");
+
+    for (int i = 0; i < message->field_count(); ++i) {
+      auto* field = message->field(i);
+      for (auto& point : MutatingInsertionPoints(field)) {
+        auto inserter = GetPrinter(
+            point.second ? hh_filename : cc_filename,
+            point.first + ":" + field->full_name(), context);
+        inserter->Print("_fast_hash_.store(0, ::std::memory_order_relaxed);\n");
+      }
+    }
+  }
+
+  // Fields are compared and hashed in declaration order, each oneof at its
+  // first member.
+  std::vector<const FieldDescriptor*> fields;
+  std::vector<const google::protobuf::OneofDescriptor*> oneofs;
+  for (int i = 0; i < message->field_count(); ++i) {
+    auto* field = message->field(i);
+    auto* oneof = field->real_containing_oneof();
+    if (oneof == nullptr) {
+      fields.push_back(field);
+      oneofs.push_back(nullptr);
+    } else if (oneof->field(0) == field) {
+      fields.push_back(nullptr);
+      oneofs.push_back(oneof);
+    }
+  }
+
+  auto printer = GetPrinter(hh_filename, "namespace_scope", context);
+
+  // Equality.
+  printer->Print(vars,
+      "// Compares the fields of two $class$ (fast-hash plugin); unknown fields\n"
+      "// and extensions are not compared.\n"
+      "inline bool operator==(const $class$& lhs, const $class$& rhs) {\n");
+  printer->Indent();
+  for (size_t i = 0; i < fields.size(); ++i) {
+    if (oneofs[i] != nullptr) {
+      auto* oneof = oneofs[i];
+      printer->Print(
+          "if (lhs.$oneof$_case() != rhs.$oneof$_case()) return false;\n"
+          "switch (lhs.$oneof$_case()) {\n",
+          "oneof", oneof->name());
+      for (int j = 0; j < oneof->field_count(); ++j) {
+        auto* field = oneof->field(j);
+        std::string equal = EqualExpr(field, "lhs." + field->lowercase_name() + "()",
+                                      "rhs." + field->lowercase_name() + "()");
+        printer->Print(
+            "  case $class$::k$Field$:\n"
+            "    if (!($equal$)) return false;\n"
+            "    break;\n",
+            "class", vars["class"], "Field", CamelCase(field->name()),
+            "equal", equal);
+      }
+      printer->Print(
+          "  default:\n"
+          "    break;\n"
+          "}\n");
+      continue;
+    }
+
+    auto* field = fields[i];
+    std::map<std::string, std::string> field_vars;
+    field_vars["field"] = field->lowercase_name();
+
+    if (field->is_map()) {
+      field_vars["equal"] = EqualExpr(field->message_type()->map_value(),
+                                      "entry.second", "other->second");
+      printer->Print(field_vars,
+          "if (lhs.$field$().size() != rhs.$field$().size()) return false;\n"
+          "for (const auto& entry : lhs.$field$()) {\n"
+          "  auto other = rhs.$field$().find(entry.first);\n"
+          "  if (other == rhs.$field$().end() || !($equal$)) {\n"
+          "    return false;\n"
+          "  }\n"
+          "}\n");
+    } else if (field->is_repeated()) {
+      field_vars["equal"] = EqualExpr(field, "lhs.$field$(i)",
+                                      "rhs.$field$(i)");
+      std::string loop =
+          "if (lhs.$field$_size() != rhs.$field$_size()) return false;\n"
+          "for (int i = 0; i < lhs.$field$_size(); ++i) {\n"
+          "  if (!(" + field_vars["equal"] + ")) return false;\n"
+          "}\n";
+      // Contiguous values are compared in one std::equal, which is a memcmp
+      // for integers.
+      if (field->cpp_type() != FieldDescriptor::CPPTYPE_STRING &&
+          field->cpp_type() != FieldDescriptor::CPPTYPE_MESSAGE) {
+        loop =
+            "if (lhs.$field$_size() != rhs.$field$_size() ||\n"
+            "    !std::equal(lhs.$field$().begin(), lhs.$field$().end(),\n"
+            "                rhs.$field$().begin())) {\n"
+            "  return false;\n"
+            "}\n";
+      }
+      printer->Print(field_vars, loop.c_str());
+    } else if (field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE) {
+      field_vars["equal"] = EqualExpr(field, "lhs." + field->lowercase_name() + "()",
+                                      "rhs." + field->lowercase_name() + "()");
+      printer->Print(field_vars,
+          "if (lhs.has_$field$() != rhs.has_$field$() ||\n"
+          "    (lhs.has_$field$() && !($equal$))) {\n"
+          "  return false;\n"
+          "}\n");
+    } else if (field->has_presence()) {
+      printer->Print(field_vars,
+          "if (lhs.has_$field$() != rhs.has_$field$() ||\n"
+          "    lhs.$field$() != rhs.$field$()) {\n"
+          "  return false;\n"
+          "}\n");
+    } else {
+      printer->Print(field_vars,
+          "if (lhs.$field$() != rhs.$field$()) return false;\n");
+    }
+  }
+  printer->Print("return true;\n");
+  printer->Outdent();
+  printer->Print(vars,
+      "}\n"
+      "\n"
+      "inline bool operator!=(const $class$& lhs, const $class$& rhs) {\n"
+      "  return !(lhs == rhs);\n"
+      "}\n"
+      "\n");
+
+  // Hashing.
+  printer->Print(vars,
+      "// Hashes the fields of a $class$ (fast-hash plugin), consistently with\n"
+      "// operator==.\n"
+      "inline uint64_t FastHash(const $class$& message) {\n");
+  printer->Indent();
+  if (cached) {
+    printer->Print(
+        "uint64_t cached = message._fast_hash_.load(::std::memory_order_relaxed);\n"
+        "if (cached != 0) return cached;\n"
+        "\n");
+  }
+  printer->Print("uint64_t h = ::fast_hash::kSeed;\n");
+  for (size_t i = 0; i < fields.size(); ++i) {
+    if (oneofs[i] != nullptr) {
+      auto* oneof = oneofs[i];
+      printer->Print(
+          "h = ::fast_hash::Mix(h, static_cast<uint64_t>(message.$oneof$_case()));\n"
+          "switch (message.$oneof$_case()) {\n",
+          "oneof", oneof->name());
+      for (int j = 0; j < oneof->field_count(); ++j) {
+        auto* field = oneof->field(j);
+        printer->Print(
+            "  case $class$::k$Field$:\n"
+            "    h = $hash$;\n"
+            "    break;\n",
+            "class", vars["class"], "Field", CamelCase(field->name()),
+            "hash", HashExpr(field, "h", "message." + field->lowercase_name() + "()"));
+      }
+      printer->Print(
+          "  default:\n"
+          "    break;\n"
+          "}\n");
+      continue;
+    }
+
+    auto* field = fields[i];
+    std::map<std::string, std::string> field_vars;
+    field_vars["field"] = field->lowercase_name();
+
+    if (field->is_map()) {
+      // Maps are unordered, so their entries are hashed on their own and
+      // summed.
+      auto* entry = field->message_type();
+      field_vars["entry_hash"] = HashExpr(
+          entry->map_value(),
+          HashExpr(entry->map_key(), "::fast_hash::kSeed", "entry.first"),
+          "entry.second");
+      printer->Print(field_vars,
+          "{\n"
+          "  uint64_t entries = 0;\n"
+          "  for (const auto& entry : message.$field$()) {\n"
+          "    entries += ::fast_hash::Finish($entry_hash$);\n"
+          "  }\n"
+          "  h = ::fast_hash::Mix(::fast_hash::Mix(h, message.$field$().size()),\n"
+          "                       entries);\n"
+          "}\n");
+    } else if (field->is_repeated()) {
+      auto cpp_type = field->cpp_type();
+      if (cpp_type == FieldDescriptor::CPPTYPE_STRING ||
+          cpp_type == FieldDescriptor::CPPTYPE_MESSAGE ||
+          cpp_type == FieldDescriptor::CPPTYPE_FLOAT ||
+          cpp_type == FieldDescriptor::CPPTYPE_DOUBLE) {
+        field_vars["hash"] = HashExpr(field, "h", "value");
+        printer->Print(field_vars,
+            "h = ::fast_hash::Mix(h, static_cast<uint64_t>(message.$field$_size()));\n"
+            "for (const auto& value : message.$field$()) {\n"
+            "  h = $hash$;\n"
+            "}\n");
+      } else {
+        // Integers and enums are contiguous, so they are hashed as bytes.
+        printer->Print(field_vars,
+            "h = ::fast_hash::Bytes(\n"
+            "    h, message.$field$().data(),\n"
+            "    static_cast<size_t>(message.$field$_size()) *\n"
+            "        sizeof(*message.$field$().data()));\n");
+      }
+    } else if (field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE) {
+      field_vars["hash"] = HashExpr(field, "h", "message." + field->lowercase_name() + "()");
+      printer->Print(field_vars,
+          "h = ::fast_hash::Mix(h, message.has_$field$());\n"
+          "if (message.has_$field$()) {\n"
+          "  h = $hash$;\n"
+          "}\n");
+    } else {
+      if (field->has_presence()) {
+        printer->Print(field_vars,
+            "h = ::fast_hash::Mix(h, message.has_$field$());\n");
+      }
+      printer->Print("h = $hash$;\n",
+                     "hash", HashExpr(field, "h", "message." + field->lowercase_name() + "()"));
+    }
+  }
+  printer->Print("h = ::fast_hash::Finish(h);\n");
+  if (cached) {
+    printer->Print(
+        "message._fast_hash_.store(h, ::std::memory_order_relaxed);\n");
+  }
+  printer->Print("return h;\n");
+  printer->Outdent();
+  printer->Print("}\n\n");
+
+  // std::hash can only be specialized in namespace std.
+  printer = GetPrinter(hh_filename, "global_scope", context);
+  printer->Print(vars,
+      "namespace std {\n"
+      "template <>\n"
+      "struct hash<$qualified_class$> {\n"
+      "  size_t operator()(const $qualified_class$& message) const {\n"
+      "    return static_cast<size_t>(FastHash(message));\n"
+      "  }\n"
+      "};\n"
+      "}  // namespace std\n"
+      "\n");
+
+  for (int i = 0; i < message->nested_type_count(); ++i) {
+    if (!GenerateFor(message->nested_type(i), file, context, options)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+bool Generator::ParseOptions(const std::string& parameter, Options* options,
+                             std::string* error) const {
+  std::vector<std::pair<std::string, std::string>> params;
+  google::protobuf::compiler::ParseGeneratorParameter(parameter, &params);
+
+  for (auto& param : params) {
+    if (param.first != "cached_hash") {
+      *error = "unknown parameter: " + param.first;
+      return false;
+    }
+
+    if (param.second.empty() || param.second == "true") {
+      options->cached_hash = true;
+    } else if (param.second == "false") {
+      options->cached_hash = false;
+    } else {
+      *error = "cached_hash must be true or false, not " + param.second;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+bool Generator::GenerateFile(const google::protobuf::FileDescriptor* file,
+                             const std::string& parameter,
+                             google::protobuf::compiler::GeneratorContext* context,
+                             std::string* error) const {
+  Options options;
+  if (!ParseOptions(parameter, &options, error)) {
+    return false;
+  }
+
+  if (file->message_type_count() > 0) {
+    using google::protobuf::compiler::StripProto;
+    auto hh_filename = StripProto(file->name()) + ".pb.h";
+    GetPrinter(hh_filename, "includes", context)->PrintRaw(kHashRuntime);
+
+    auto printer = GetPrinter(hh_filename, "namespace_scope", context);
+    for (int i = 0; i < file->message_type_count(); ++i) {
+      Declare(file->message_type(i), printer.get());
+    }
+    printer->Print("\n");
+  }
+
+  return true;
+}
+
+
+bool Generator::GenerateMessage(
+    const google::protobuf::Descriptor* message, const std::string& parameter,
+    google::protobuf::compiler::GeneratorContext* context,
+    std::string* error) const {
+  Options options;
+  if (!ParseOptions(parameter, &options, error)) {
+    return false;
+  }
+
+  return GenerateFor(message, message->file(), context, options);
+}
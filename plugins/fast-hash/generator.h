@@ -0,0 +1,52 @@
+#ifndef MYAPP_FAST_HASH_GENERATOR
+#define MYAPP_FAST_HASH_GENERATOR
+
+#include "common/parallel_generator.h"
+
+#include <google/protobuf/compiler/code_generator.h>
+#include <google/protobuf/compiler/plugin.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/io/printer.h>
+#include <google/protobuf/io/zero_copy_stream.h>
+
+#include <string>
+
+class Generator : public ParallelGenerator {
+ public:
+  inline Generator() {}
+  inline ~Generator() {}
+
+ protected:
+  std::string Version() const override;
+
+  bool GenerateFile(const google::protobuf::FileDescriptor* file,
+                    const std::string& parameter,
+                    google::protobuf::compiler::GeneratorContext* context,
+                    std::string* error) const override;
+
+  bool GenerateMessage(const google::protobuf::Descriptor* message,
+                       const std::string& parameter,
+                       google::protobuf::compiler::GeneratorContext* context,
+                       std::string* error) const override;
+
+ private:
+  // What to generate, from the plugin parameter, e.g.
+  // --fast-hash_opt=cached_hash=true.
+  struct Options {
+    // cached_hash=true: keep the hash in the message, invalidated by its
+    // setters, so hashing an unchanged message is O(1).
+    bool cached_hash = false;
+  };
+
+  bool ParseOptions(const std::string& parameter, Options* options,
+                    std::string* error) const;
+
+  // Emits operator==, operator!= and FastHash for the message after the
+  // classes of the file, and std::hash for it at global scope.
+  bool GenerateFor(const google::protobuf::Descriptor* message,
+                   const google::protobuf::FileDescriptor* file,
+                   google::protobuf::compiler::GeneratorContext* context,
+                   const Options& options) const;
+};
+
+#endif // MYAPP_FAST_HASH_GENERATOR
@@ -0,0 +1,545 @@
+#include "generator.h"
+
+#include "common/insertion.h"
+#include "common/trace.h"
+
+#include <google/protobuf/compiler/code_generator.h>
+#include <google/protobuf/compiler/cpp/cpp_generator.h>
+#include <google/protobuf/compiler/plugin.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/io/printer.h>
+#include <google/protobuf/wire_format_lite.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+
+// Support code shared by the views of all messages. It is emitted into the
+// includes of every generated header, so it is guarded against being defined
+// more than once per translation unit.
+const char* const kViewRuntime = R"(
+#ifndef LAZY_VIEW_RUNTIME_
+#define LAZY_VIEW_RUNTIME_
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+
+namespace lazy_view {
+
+// A string or bytes field of a view, pointing into the view's buffer.
+struct StringView {
+  const char* data;
+  size_t size;
+
+  std::string ToString() const { return std::string(data, size); }
+#if __cplusplus >= 201703L
+  operator std::string_view() const { return std::string_view(data, size); }
+#endif
+};
+
+// Where the value of a field starts in the buffer (nullptr if the field is
+// not there), and its size if it is length delimited.
+struct Slot {
+  const uint8_t* data;
+  uint32_t size;
+};
+
+// Reads a varint at *p, advancing *p past it.
+inline bool ReadVarint(const uint8_t** p, const uint8_t* end, uint64_t* value) {
+  uint64_t result = 0;
+  for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+    uint8_t byte = *(*p)++;
+    result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (byte < 0x80) {
+      *value = result;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Decodes a varint that was already read once by ReadVarint.
+inline uint64_t Varint(const uint8_t* p) {
+  uint64_t value = 0;
+  ReadVarint(&p, p + 10, &value);
+  return value;
+}
+
+inline uint32_t Fixed32(const uint8_t* p) {
+  uint32_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+inline uint64_t Fixed64(const uint8_t* p) {
+  uint64_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+template <typename T, typename U>
+inline T BitCast(U value) {
+  static_assert(sizeof(T) == sizeof(U), "BitCast between different sizes");
+  T result;
+  std::memcpy(&result, &value, sizeof(result));
+  return result;
+}
+
+inline int32_t ZigZag32(uint32_t n) {
+  return static_cast<int32_t>((n >> 1) ^ (~(n & 1) + 1));
+}
+
+inline int64_t ZigZag64(uint64_t n) {
+  return static_cast<int64_t>((n >> 1) ^ (~(n & 1) + 1));
+}
+
+// The readers below index the value of a field at *p into slot, and advance
+// *p past it. They return false if the value runs past end.
+inline bool IndexVarint(const uint8_t** p, const uint8_t* end, Slot* slot) {
+  uint64_t value;
+  slot->data = *p;
+  return ReadVarint(p, end, &value);
+}
+
+inline bool IndexFixed(const uint8_t** p, const uint8_t* end, size_t size,
+                       Slot* slot) {
+  if (static_cast<size_t>(end - *p) < size) {
+    return false;
+  }
+  slot->data = *p;
+  *p += size;
+  return true;
+}
+
+inline bool IndexLength(const uint8_t** p, const uint8_t* end, Slot* slot) {
+  uint64_t size;
+  if (!ReadVarint(p, end, &size) ||
+      size > static_cast<uint64_t>(end - *p)) {
+    return false;
+  }
+  slot->data = *p;
+  slot->size = static_cast<uint32_t>(size);
+  *p += size;
+  return true;
+}
+
+// Skips a field the view has no slot for. Groups are not supported.
+inline bool SkipField(const uint8_t** p, const uint8_t* end, uint64_t tag) {
+  if (tag >> 3 == 0) {
+    return false;
+  }
+
+  Slot unused;
+  switch (tag & 7) {
+    case 0:
+      return IndexVarint(p, end, &unused);
+    case 1:
+      return IndexFixed(p, end, 8, &unused);
+    case 2:
+      return IndexLength(p, end, &unused);
+    case 5:
+      return IndexFixed(p, end, 4, &unused);
+  }
+  return false;
+}
+
+}  // namespace lazy_view
+#endif  // LAZY_VIEW_RUNTIME_
+)";
+
+
+namespace {
+
+// Helper function to get the c++ type a view returns for a field, the
+// expression decoding it from `slot`, and the call indexing it from the
+// buffer. Returns false for fields the view has no accessor for.
+bool ViewType(const google::protobuf::FieldDescriptor* field,
+              std::string* type, std::string* decode, std::string* index) {
+  using google::protobuf::FieldDescriptor;
+
+  if (field->is_repeated()) {
+    return false;
+  }
+
+  const std::string kVarint = "::lazy_view::IndexVarint(&p, end, &$slot$)";
+  const std::string kFixed32 = "::lazy_view::IndexFixed(&p, end, 4, &$slot$)";
+  const std::string kFixed64 = "::lazy_view::IndexFixed(&p, end, 8, &$slot$)";
+  const std::string kLength = "::lazy_view::IndexLength(&p, end, &$slot$)";
+
+  switch (field->type()) {
+    case FieldDescriptor::TYPE_INT32:
+      *type = "int32_t";
+      *decode = "static_cast<int32_t>(::lazy_view::Varint(slot.data))";
+      *index = kVarint;
+      return true;
+    case FieldDescriptor::TYPE_INT64:
+      *type = "int64_t";
+      *decode = "static_cast<int64_t>(::lazy_view::Varint(slot.data))";
+      *index = kVarint;
+      return true;
+    case FieldDescriptor::TYPE_UINT32:
+      *type = "uint32_t";
+      *decode = "static_cast<uint32_t>(::lazy_view::Varint(slot.data))";
+      *index = kVarint;
+      return true;
+    case FieldDescriptor::TYPE_UINT64:
+      *type = "uint64_t";
+      *decode = "::lazy_view::Varint(slot.data)";
+      *index = kVarint;
+      return true;
+    case FieldDescriptor::TYPE_SINT32:
+      *type = "int32_t";
+      *decode = "::lazy_view::ZigZag32(\n"
+                "      static_cast<uint32_t>(::lazy_view::Varint(slot.data)))";
+      *index = kVarint;
+      return true;
+    case FieldDescriptor::TYPE_SINT64:
+      *type = "int64_t";
+      *decode = "::lazy_view::ZigZag64(::lazy_view::Varint(slot.data))";
+      *index = kVarint;
+      return true;
+    case FieldDescriptor::TYPE_BOOL:
+      *type = "bool";
+      *decode = "::lazy_view::Varint(slot.data) != 0";
+      *index = kVarint;
+      return true;
+    case FieldDescriptor::TYPE_ENUM:
+      *type = EnumName(field->enum_type());
+      *decode = "static_cast<" + *type + ">(\n"
+                "      static_cast<int>(::lazy_view::Varint(slot.data)))";
+      *index = kVarint;
+      return true;
+    case FieldDescriptor::TYPE_FIXED32:
+      *type = "uint32_t";
+      *decode = "::lazy_view::Fixed32(slot.data)";
+      *index = kFixed32;
+      return true;
+    case FieldDescriptor::TYPE_SFIXED32:
+      *type = "int32_t";
+      *decode = "static_cast<int32_t>(::lazy_view::Fixed32(slot.data))";
+      *index = kFixed32;
+      return true;
+    case FieldDescriptor::TYPE_FLOAT:
+      *type = "float";
+      *decode = "::lazy_view::BitCast<float>(::lazy_view::Fixed32(slot.data))";
+      *index = kFixed32;
+      return true;
+    case FieldDescriptor::TYPE_FIXED64:
+      *type = "uint64_t";
+      *decode = "::lazy_view::Fixed64(slot.data)";
+      *index = kFixed64;
+      return true;
+    case FieldDescriptor::TYPE_SFIXED64:
+      *type = "int64_t";
+      *decode = "static_cast<int64_t>(::lazy_view::Fixed64(slot.data))";
+      *index = kFixed64;
+      return true;
+    case FieldDescriptor::TYPE_DOUBLE:
+      *type = "double";
+      *decode =
+          "::lazy_view::BitCast<double>(::lazy_view::Fixed64(slot.data))";
+      *index = kFixed64;
+      return true;
+    case FieldDescriptor::TYPE_STRING:
+    case FieldDescriptor::TYPE_BYTES:
+      *type = "::lazy_view::StringView";
+      *decode =
+          "{reinterpret_cast<const char*>(slot.data), slot.size}";
+      *index = kLength;
+      return true;
+    // Views of other files' messages may not exist, so those fields are
+    // returned as their encoded bytes.
+    case FieldDescriptor::TYPE_MESSAGE:
+      if (field->message_type()->file() == field->file()) {
+        *type = ClassName(field->message_type()) + "View";
+        *decode = *type + "(slot.data, slot.size)";
+      } else {
+        *type = "::lazy_view::StringView";
+        *decode =
+            "{reinterpret_cast<const char*>(slot.data), slot.size}";
+      }
+      *index = kLength;
+      return true;
+    case FieldDescriptor::TYPE_GROUP:
+      return false;
+  }
+
+  return false;
+}
+
+
+// Helper function to get the tag a field is written with, as a literal.
+std::string Tag(const google::protobuf::FieldDescriptor* field) {
+  using google::protobuf::internal::WireFormatLite;
+
+  auto wire_type = WireFormatLite::WireTypeForFieldType(
+      static_cast<WireFormatLite::FieldType>(field->type()));
+  return std::to_string(
+      WireFormatLite::MakeTag(field->number(), wire_type)) + "u";
+}
+
+
+// Helper function to forward declare the views of a message and its nested
+// messages, so views can return the views of messages declared after them.
+void ForwardDeclare(const google::protobuf::Descriptor* message,
+                    google::protobuf::io::Printer* printer) {
+  if (message->options().map_entry()) {
+    return;
+  }
+
+  printer->Print("class $view$;\n", "view", ClassName(message) + "View");
+  for (int i = 0; i < message->nested_type_count(); ++i) {
+    ForwardDeclare(message->nested_type(i), printer);
+  }
+}
+
+}  // namespace
+
+
+std::string Generator::Version() const {
+  return "lazy-view/1";
+}
+
+
+bool Generator::GenerateFor(
+    const google::protobuf::Descriptor* message,
+    const google::protobuf::FileDescriptor* file,
+    google::protobuf::compiler::GeneratorContext* context) const {
+  using google::protobuf::FieldDescriptor;
+
+  TraceSpan span("GenerateFor", message->full_name());
+
+  // Map entries are generated without insertion points.
+  if (message->options().map_entry()) {
+    return true;
+  }
+
+  struct ViewField {
+    const FieldDescriptor* field;
+    std::map<std::string, std::string> vars;
+  };
+
+  std::vector<ViewField> fields;
+  for (int i = 0; i < message->field_count(); ++i) {
+    auto* field = message->field(i);
+
+    ViewField view_field;
+    auto& vars = view_field.vars;
+    if (!ViewType(field, &vars["type"], &vars["decode"], &vars["index"])) {
+      continue;
+    }
+
+    view_field.field = field;
+    vars["field"] = field->lowercase_name();
+    vars["number"] = std::to_string(field->number());
+    vars["tag"] = Tag(field);
+    vars["slot"] = "slots_[" + std::to_string(fields.size()) + "]";
+    fields.push_back(view_field);
+  }
+
+  std::map<std::string, std::string> vars;
+  vars["class"] = ClassName(message);
+  vars["view"] = ClassName(message) + "View";
+  vars["slot_count"] = std::to_string(fields.empty() ? 1 : fields.size());
+
+  using google::protobuf::compiler::StripProto;
+  auto hh_filename = StripProto(file->name()) + ".pb.h";
+  auto cc_filename = StripProto(file->name()) + ".pb.cc";
+
+  auto printer = GetPrinter(hh_filename, "namespace_scope", context);
+  printer->Print(vars,
+      "// A read-only view over a serialized $class$ (lazy-view plugin). It\n"
+      "// does not copy the buffer, which must outlive it, and indexes where\n"
+      "// each field is on the first access; string, bytes and message fields\n"
+      "// point into the buffer. As in parsing, the last occurrence of a\n"
+      "// field wins, but occurrences of a message field are not merged.\n"
+      "// Repeated fields have no accessors. Indexing is not thread safe, so\n"
+      "// call ok() before sharing a view between threads.\n"
+      "class $view$ {\n"
+      " public:\n");
+  printer->Indent();
+  printer->Print(vars,
+      "$view$() : $view$(nullptr, 0) {}\n"
+      "$view$(const void* data, size_t size)\n"
+      "    : data_(static_cast<const uint8_t*>(data)), size_(size) {}\n"
+      "explicit $view$(::lazy_view::StringView bytes)\n"
+      "    : $view$(bytes.data, bytes.size) {}\n"
+      "\n"
+      "// Whether the buffer is well formed, as far as the view reads it.\n"
+      "bool ok() const {\n"
+      "  Index();\n"
+      "  return ok_;\n"
+      "}\n"
+      "\n");
+
+  for (auto& view_field : fields) {
+    auto& field_vars = view_field.vars;
+    auto* field = view_field.field;
+
+    printer->Print(field_vars,
+        "bool has_$field$() const {\n"
+        "  Index();\n"
+        "  return $slot$.data != nullptr;\n"
+        "}\n");
+
+    // Views of messages in this file may be declared after this one, so
+    // their accessors are defined in the source file.
+    if (field->type() == FieldDescriptor::TYPE_MESSAGE &&
+        field->message_type()->file() == field->file()) {
+      printer->Print(field_vars, "$type$ $field$() const;\n\n");
+      continue;
+    }
+
+    // Missing fields read as the default instance does, which also covers
+    // proto2 default values.
+    std::string missing = field->type() == FieldDescriptor::TYPE_MESSAGE
+        ? "  if (slot.data == nullptr) return {\"\", 0};\n"
+        : field->cpp_type() == FieldDescriptor::CPPTYPE_STRING
+            ? "  if (slot.data == nullptr) {\n"
+              "    const auto& value = $class$::default_instance().$field$();\n"
+              "    return {value.data(), value.size()};\n"
+              "  }\n"
+            : "  if (slot.data == nullptr) {\n"
+              "    return $class$::default_instance().$field$();\n"
+              "  }\n";
+    field_vars["class"] = vars["class"];
+
+    // The decoder is a template of its own, so substitute it first.
+    std::string accessor =
+        "$type$ $field$() const {\n"
+        "  Index();\n"
+        "  const auto& slot = $slot$;\n" + missing +
+        "  return " + field_vars["decode"] + ";\n"
+        "}\n\n";
+    printer->Print(field_vars, accessor.c_str());
+  }
+
+  printer->Outdent();
+  printer->Print(" private:\n");
+  printer->Indent();
+  printer->Print(vars,
+      "void Index() const {\n"
+      "  if (!indexed_) {\n"
+      "    ok_ = Scan();\n"
+      "    indexed_ = true;\n"
+      "  }\n"
+      "}\n"
+      "bool Scan() const;\n"
+      "\n"
+      "const uint8_t* data_;\n"
+      "size_t size_;\n"
+      "mutable bool indexed_ = false;\n"
+      "mutable bool ok_ = false;\n"
+      "mutable ::lazy_view::Slot slots_[$slot_count$] = {};\n");
+  printer->Outdent();
+  printer->Print("};\n\n");
+
+  // The scanner, specialized to the tags of the message's fields, and the
+  // accessors of message fields.
+  printer = GetPrinter(cc_filename, "namespace_scope", context);
+  printer->Print(vars,
+      "bool $view$::Scan() const {\n"
+      "  const uint8_t* p = data_;\n"
+      "  const uint8_t* end = data_ + size_;\n"
+      "  while (p < end) {\n"
+      "    uint64_t tag;\n"
+      "    if (!::lazy_view::ReadVarint(&p, end, &tag)) return false;\n"
+      "    switch (tag) {\n");
+  printer->Indent();
+  printer->Indent();
+  printer->Indent();
+  for (auto& view_field : fields) {
+    auto& field_vars = view_field.vars;
+    auto* field = view_field.field;
+
+    // The indexer is a template of its own, so substitute it first.
+    std::string index = "case $tag$:  // $field$\n"
+                        "  if (!" + field_vars["index"] + ") return false;\n";
+    printer->Print(field_vars, index.c_str());
+
+    // Only the last member of a oneof in the buffer is set.
+    auto* oneof = field->real_containing_oneof();
+    for (auto& other : fields) {
+      if (other.field != field && oneof != nullptr &&
+          other.field->real_containing_oneof() == oneof) {
+        printer->Print(other.vars, "  $slot$.data = nullptr;\n");
+      }
+    }
+    printer->Print("  break;\n");
+  }
+  printer->Print(
+      "default:\n"
+      "  if (!::lazy_view::SkipField(&p, end, tag)) return false;\n");
+  printer->Outdent();
+  printer->Outdent();
+  printer->Outdent();
+  printer->Print(
+      "    }\n"
+      "  }\n"
+      "  return true;\n"
+      "}\n"
+      "\n");
+
+  for (auto& view_field : fields) {
+    auto* field = view_field.field;
+    if (field->type() != FieldDescriptor::TYPE_MESSAGE ||
+        field->message_type()->file() != field->file()) {
+      continue;
+    }
+
+    view_field.vars["view"] = vars["view"];
+    printer->Print(view_field.vars,
+        "$type$ $view$::$field$() const {\n"
+        "  Index();\n"
+        "  return $type$($slot$.data, $slot$.size);\n"
+        "}\n"
+        "\n");
+  }
+
+  for (int i = 0; i < message->nested_type_count(); ++i) {
+    if (!GenerateFor(message->nested_type(i), file, context)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+bool Generator::GenerateFile(const google::protobuf::FileDescriptor* file,
+                             const std::string& parameter,
+                             google::protobuf::compiler::GeneratorContext* context,
+                             std::string* error) const {
+  if (!parameter.empty()) {
+    *error = "lazy-view takes no parameters";
+    return false;
+  }
+
+  if (file->message_type_count() > 0) {
+    using google::protobuf::compiler::StripProto;
+    auto hh_filename = StripProto(file->name()) + ".pb.h";
+    GetPrinter(hh_filename, "includes", context)->PrintRaw(kViewRuntime);
+
+    auto printer = GetPrinter(hh_filename, "namespace_scope", context);
+    for (int i = 0; i < file->message_type_count(); ++i) {
+      ForwardDeclare(file->message_type(i), printer.get());
+    }
+    printer->Print("\n");
+  }
+
+  return true;
+}
+
+
+bool Generator::GenerateMessage(
+    const google::protobuf::Descriptor* message,
+    const std::string& /*parameter*/,
+    google::protobuf::compiler::GeneratorContext* context,
+    std::string* /*error*/) const {
+  return GenerateFor(message, message->file(), context);
+}
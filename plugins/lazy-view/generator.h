@@ -0,0 +1,40 @@
+#ifndef MYAPP_LAZY_VIEW_GENERATOR
+#define MYAPP_LAZY_VIEW_GENERATOR
+
+#include "common/parallel_generator.h"
+
+#include <google/protobuf/compiler/code_generator.h>
+#include <google/protobuf/compiler/plugin.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/io/printer.h>
+#include <google/protobuf/io/zero_copy_stream.h>
+
+#include <string>
+
+class Generator : public ParallelGenerator {
+ public:
+  inline Generator() {}
+  inline ~Generator() {}
+
+ protected:
+  std::string Version() const override;
+
+  bool GenerateFile(const google::protobuf::FileDescriptor* file,
+                    const std::string& parameter,
+                    google::protobuf::compiler::GeneratorContext* context,
+                    std::string* error) const override;
+
+  bool GenerateMessage(const google::protobuf::Descriptor* message,
+                       const std::string& parameter,
+                       google::protobuf::compiler::GeneratorContext* context,
+                       std::string* error) const override;
+
+ private:
+  // Emits <Message>View, a read-only view over the serialized message, after
+  // the classes of the file, and its scanner into the source file.
+  bool GenerateFor(const google::protobuf::Descriptor* message,
+                   const google::protobuf::FileDescriptor* file,
+                   google::protobuf::compiler::GeneratorContext* context) const;
+};
+
+#endif // MYAPP_LAZY_VIEW_GENERATOR
@@ -0,0 +1,8 @@
+#include "generator.h"
+
+#include "common/plugin_driver.h"
+
+int main(int argc, char* argv[]) {
+  Generator generator;
+  return RunPlugin(argc, argv, &generator);
+}
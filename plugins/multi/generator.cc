@@ -0,0 +1,183 @@
+#include "generator.h"
+
+#include "common/recording_context.h"
+#include "common/trace.h"
+#include "common/worker_pool.h"
+
+#include <google/protobuf/compiler/code_generator.h>
+#include <google/protobuf/compiler/plugin.h>
+#include <google/protobuf/descriptor.h>
+
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace multi {
+
+
+void Generator::Register(
+    const std::string& name,
+    const google::protobuf::compiler::CodeGenerator* generator) {
+  generators_.emplace_back(name, generator);
+}
+
+
+bool Generator::ParseParameter(const std::string& parameter,
+                               std::vector<std::string>* parameters,
+                               size_t* jobs, std::string* trace,
+                               std::string* error) const {
+  std::vector<std::pair<std::string, std::string>> params;
+  google::protobuf::compiler::ParseGeneratorParameter(parameter, &params);
+
+  parameters->assign(generators_.size(), "");
+  for (auto& param : params) {
+    if (param.first == "jobs") {
+      char* end = nullptr;
+      auto value = strtoull(param.second.c_str(), &end, 10);
+      if (param.second.empty() || *end != '\0') {
+        *error = "expected a number of jobs, got: " + param.second;
+        return false;
+      }
+      *jobs = static_cast<size_t>(value);
+      continue;
+    }
+
+    if (param.first == "trace") {
+      *trace = param.second;
+      continue;
+    }
+
+    auto dot = param.first.find('.');
+    auto name = param.first.substr(0, dot);
+
+    size_t i = 0;
+    while (i < generators_.size() && generators_[i].first != name) {
+      ++i;
+    }
+
+    if (dot == std::string::npos || i == generators_.size()) {
+      *error = "parameter for an unknown generator: " + param.first;
+      return false;
+    }
+
+    auto& generator_parameter = (*parameters)[i];
+    if (!generator_parameter.empty()) {
+      generator_parameter += ",";
+    }
+    generator_parameter += param.first.substr(dot + 1);
+    if (!param.second.empty()) {
+      generator_parameter += "=" + param.second;
+    }
+  }
+
+  return true;
+}
+
+
+bool Generator::Generate(const google::protobuf::FileDescriptor* file,
+                         const std::string& parameter,
+                         google::protobuf::compiler::GeneratorContext* context,
+                         std::string* error) const {
+  return GenerateAll({file}, parameter, context, error);
+}
+
+
+bool Generator::GenerateAll(
+    const std::vector<const google::protobuf::FileDescriptor*>& files,
+    const std::string& parameter,
+    google::protobuf::compiler::GeneratorContext* context,
+    std::string* error) const {
+  std::vector<std::string> parameters;
+  size_t jobs = 1;
+  std::string trace;
+  if (!ParseParameter(parameter, &parameters, &jobs, &trace, error)) {
+    return false;
+  }
+
+  if (trace.empty()) {
+    return GenerateAllWith(files, parameters, jobs, context, error);
+  }
+
+  Tracer tracer(trace);
+  tracer.Activate();
+
+  // Everything up to now was RunPlugin reading and parsing the request and
+  // building the descriptor pool, once for all of the generators.
+  tracer.AddSpan("RunPlugin", 0, Tracer::Now(), "");
+
+  auto generated = GenerateAllWith(files, parameters, jobs, context, error);
+
+  tracer.AddPeakRss();
+  tracer.Deactivate();
+
+  std::string trace_error;
+  if (!tracer.Write(&trace_error) && generated) {
+    *error = trace_error;
+    return false;
+  }
+
+  return generated;
+}
+
+
+bool Generator::GenerateAllWith(
+    const std::vector<const google::protobuf::FileDescriptor*>& files,
+    const std::vector<std::string>& parameters, size_t jobs,
+    google::protobuf::compiler::GeneratorContext* context,
+    std::string* error) const {
+  // The outputs of one of the generators.
+  struct Run {
+    explicit Run(google::protobuf::compiler::GeneratorContext* parent)
+        : context(parent) {}
+
+    RecordingContext context;
+    std::string error;
+    bool succeeded = false;
+  };
+
+  std::vector<std::unique_ptr<Run>> runs;
+  std::vector<std::function<void()>> tasks;
+  for (size_t i = 0; i < generators_.size(); ++i) {
+    runs.emplace_back(new Run(context));
+
+    auto* run = runs.back().get();
+    auto* name = &generators_[i].first;
+    auto* generator = generators_[i].second;
+    auto* generator_parameter = &parameters[i];
+    tasks.push_back([run, name, generator, generator_parameter, &files]() {
+      TraceSpan span("Generator", *name);
+      run->succeeded = generator->GenerateAll(files, *generator_parameter,
+                                              &run->context, &run->error);
+    });
+  }
+
+  RunTasks(tasks, jobs);
+
+  for (size_t i = 0; i < runs.size(); ++i) {
+    if (!runs[i]->succeeded) {
+      *error = generators_[i].first + ": " + runs[i]->error;
+      return false;
+    }
+  }
+
+  for (auto& run : runs) {
+    run->context.Replay(context);
+  }
+
+  return true;
+}
+
+
+uint64_t Generator::GetSupportedFeatures() const {
+  // A feature is only supported if every generator supports it.
+  uint64_t features = ~uint64_t{0};
+  for (auto& generator : generators_) {
+    features &= generator.second->GetSupportedFeatures();
+  }
+  return generators_.empty() ? 0 : features;
+}
+
+}  // namespace multi
@@ -0,0 +1,66 @@
+#ifndef MYAPP_MULTI_GENERATOR
+#define MYAPP_MULTI_GENERATOR
+
+#include <google/protobuf/compiler/code_generator.h>
+#include <google/protobuf/compiler/plugin.h>
+#include <google/protobuf/descriptor.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace multi {
+
+// Hosts several generators in one plugin, so that protoc sends the request,
+// and the plugin parses it and builds its descriptor pool, once for all of
+// them.
+//
+// Parameters are routed by prefix: basic-insertions.mode=counters passes
+// mode=counters to the generator registered as basic-insertions. The
+// unprefixed jobs=N runs up to N generators at the same time (0 for a thread
+// per core). Whatever the number of jobs, the outputs of the generators are
+// written in the order they were registered in. The unprefixed trace=PATH
+// writes a Chrome trace of all of the generators to PATH (see
+// common/trace.h).
+class Generator : public google::protobuf::compiler::CodeGenerator {
+ public:
+  inline Generator() {}
+  inline ~Generator() {}
+
+  // Registers generator under name. generator must outlive this.
+  void Register(const std::string& name,
+                const google::protobuf::compiler::CodeGenerator* generator);
+
+  bool Generate(const google::protobuf::FileDescriptor* file,
+                const std::string& parameter,
+                google::protobuf::compiler::GeneratorContext* context,
+                std::string* error) const override;
+
+  bool GenerateAll(const std::vector<const google::protobuf::FileDescriptor*>& files,
+                   const std::string& parameter,
+                   google::protobuf::compiler::GeneratorContext* context,
+                   std::string* error) const override;
+
+  uint64_t GetSupportedFeatures() const override;
+
+ private:
+  // Splits parameter into the parameter of each generator, in registration
+  // order, the number of jobs and the trace path.
+  bool ParseParameter(const std::string& parameter,
+                      std::vector<std::string>* parameters, size_t* jobs,
+                      std::string* trace, std::string* error) const;
+
+  bool GenerateAllWith(
+      const std::vector<const google::protobuf::FileDescriptor*>& files,
+      const std::vector<std::string>& parameters, size_t jobs,
+      google::protobuf::compiler::GeneratorContext* context,
+      std::string* error) const;
+
+  std::vector<std::pair<std::string,
+                        const google::protobuf::compiler::CodeGenerator*>>
+      generators_;
+};
+
+}  // namespace multi
+
+#endif // MYAPP_MULTI_GENERATOR
@@ -0,0 +1,16 @@
+#include "generator.h"
+
+#include "basic-insertions/generator.h"
+#include "basic-options/generator.h"
+#include "common/plugin_driver.h"
+
+int main(int argc, char* argv[]) {
+  basic_insertions::Generator basic_insertions;
+  basic_options::Generator basic_options;
+
+  multi::Generator generator;
+  generator.Register("basic-insertions", &basic_insertions);
+  generator.Register("basic-options", &basic_options);
+
+  return RunPlugin(argc, argv, &generator);
+}
@@ -0,0 +1,279 @@
+#include "generator.h"
+
+#include "common/insertion.h"
+#include "common/trace.h"
+
+#include <google/protobuf/compiler/code_generator.h>
+#include <google/protobuf/compiler/cpp/cpp_generator.h>
+#include <google/protobuf/compiler/plugin.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/io/printer.h>
+
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+// Support code shared by the pools of all messages. It is emitted into the
+// includes of every generated header, so it is guarded against being defined
+// more than once per translation unit.
+const char* const kPoolRuntime = R"(
+#ifndef OBJECT_POOL_RUNTIME_
+#define OBJECT_POOL_RUNTIME_
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+namespace object_pool {
+
+// A pool of heap allocated messages of type T.
+//
+// Released messages are Clear()ed, which keeps the memory their strings and
+// repeated fields already allocated, and cached in a free list of at most
+// LocalCapacity messages per thread. A full list moves half of its messages
+// to an overflow stack shared by all threads, and an empty list refills from
+// it, so messages released by one thread are reused by the others. Messages
+// that do not fit in the GlobalCapacity of the overflow stack are deleted.
+// Once the free list of a thread is destroyed, e.g. for calls from the
+// destructor of another thread_local, the thread uses the overflow stack
+// directly.
+template <typename T, size_t LocalCapacity, size_t GlobalCapacity>
+class Pool {
+  static_assert(LocalCapacity > 0, "the per-thread cache must hold a message");
+
+ public:
+  // A message in its Clear()ed state, which is not necessarily the state of
+  // a newly constructed message.
+  static T* Acquire() {
+    if (destroyed_) {
+      return AcquireGlobal();
+    }
+
+    auto& local = Local();
+    if (local.size == 0 && !Refill(&local)) {
+      return new T();
+    }
+    return local.messages[--local.size];
+  }
+
+  // Returns a message from Acquire() (or new) to the pool. Messages owned by
+  // an arena are left to their arena.
+  static void Release(T* message) {
+    if (message == nullptr || message->GetArena() != nullptr) {
+      return;
+    }
+
+    message->Clear();
+
+    if (destroyed_) {
+      ReleaseGlobal(message);
+      return;
+    }
+
+    auto& local = Local();
+    if (local.size == LocalCapacity) {
+      Spill(&local, kBatch);
+    }
+    local.messages[local.size++] = message;
+  }
+
+ private:
+  static constexpr size_t kBatch = LocalCapacity > 1 ? LocalCapacity / 2 : 1;
+
+  struct LocalCache {
+    ~LocalCache() {
+      Spill(this, size);
+      destroyed_ = true;
+    }
+
+    T* messages[LocalCapacity];
+    size_t size = 0;
+  };
+
+  struct GlobalStack {
+    std::mutex mutex;
+    std::vector<T*> messages;
+  };
+
+  // Not to be called once destroyed_ is set: the cache of this thread is gone,
+  // and would not be constructed again.
+  static LocalCache& Local() {
+    static thread_local LocalCache cache;
+    return cache;
+  }
+
+  // Never destroyed, as threads may still spill into it during exit.
+  static GlobalStack& Global() {
+    static GlobalStack* global = new GlobalStack();
+    return *global;
+  }
+
+  // Moves the count most recently released messages of local to the global
+  // stack.
+  static void Spill(LocalCache* local, size_t count) {
+    auto& global = Global();
+    std::lock_guard<std::mutex> lock(global.mutex);
+
+    for (size_t i = 0; i < count; ++i) {
+      T* message = local->messages[--local->size];
+      if (global.messages.size() < GlobalCapacity) {
+        global.messages.push_back(message);
+      } else {
+        delete message;
+      }
+    }
+  }
+
+  // Moves up to a batch of messages from the global stack to local.
+  static bool Refill(LocalCache* local) {
+    auto& global = Global();
+    std::lock_guard<std::mutex> lock(global.mutex);
+
+    while (local->size < kBatch && !global.messages.empty()) {
+      local->messages[local->size++] = global.messages.back();
+      global.messages.pop_back();
+    }
+
+    return local->size > 0;
+  }
+
+  static T* AcquireGlobal() {
+    auto& global = Global();
+    {
+      std::lock_guard<std::mutex> lock(global.mutex);
+      if (!global.messages.empty()) {
+        T* message = global.messages.back();
+        global.messages.pop_back();
+        return message;
+      }
+    }
+    return new T();
+  }
+
+  static void ReleaseGlobal(T* message) {
+    auto& global = Global();
+    std::lock_guard<std::mutex> lock(global.mutex);
+
+    if (global.messages.size() < GlobalCapacity) {
+      global.messages.push_back(message);
+    } else {
+      delete message;
+    }
+  }
+
+  static thread_local bool destroyed_;
+};
+
+template <typename T, size_t LocalCapacity, size_t GlobalCapacity>
+thread_local bool Pool<T, LocalCapacity, GlobalCapacity>::destroyed_ = false;
+
+}  // namespace object_pool
+#endif  // OBJECT_POOL_RUNTIME_
+)";
+
+
+std::string Generator::Version() const {
+  return "object-pool/1";
+}
+
+
+bool Generator::GenerateFor(
+    const google::protobuf::Descriptor* message,
+    const google::protobuf::FileDescriptor* file,
+    google::protobuf::compiler::GeneratorContext* context,
+    const Options& options) const {
+  TraceSpan span("GenerateFor", message->full_name());
+
+  // Map entries are generated without insertion points.
+  if (message->options().map_entry()) {
+    return true;
+  }
+
+  using google::protobuf::compiler::StripProto;
+  auto hh_filename = StripProto(file->name()) + ".pb.h";
+
+  std::map<std::string, std::string> vars;
+  vars["class"] = ClassName(message);
+  vars["pool"] = "::object_pool::Pool<" + ClassName(message) + ", " +
+                 std::to_string(options.local_capacity) + ", " +
+                 std::to_string(options.global_capacity) + ">";
+
+  auto printer = GetPrinter(hh_filename, "class_scope", context, message);
+  printer->Print(vars,
+      "// Object pool (object-pool plugin)\n"
+      "static $class$* Acquire() {\n"
+      "  return $pool$::Acquire();\n"
+      "}\n"
+      "static void Release($class$* message) {\n"
+      "  $pool$::Release(message);\n"
+      "}\n\n");
+
+  for (int i = 0; i < message->nested_type_count(); ++i) {
+    if (!GenerateFor(message->nested_type(i), file, context, options)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+bool Generator::ParseOptions(const std::string& parameter, Options* options,
+                             std::string* error) const {
+  std::vector<std::pair<std::string, std::string>> params;
+  google::protobuf::compiler::ParseGeneratorParameter(parameter, &params);
+
+  for (auto& param : params) {
+    char* end = nullptr;
+    auto value = strtoull(param.second.c_str(), &end, 10);
+    if (param.second.empty() || *end != '\0' || value == 0) {
+      *error = "expected a positive number for " + param.first;
+      return false;
+    }
+
+    if (param.first == "local_capacity") {
+      options->local_capacity = static_cast<size_t>(value);
+    } else if (param.first == "global_capacity") {
+      options->global_capacity = static_cast<size_t>(value);
+    } else {
+      *error = "unknown parameter: " + param.first;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+bool Generator::GenerateFile(const google::protobuf::FileDescriptor* file,
+                             const std::string& parameter,
+                             google::protobuf::compiler::GeneratorContext* context,
+                             std::string* error) const {
+  Options options;
+  if (!ParseOptions(parameter, &options, error)) {
+    return false;
+  }
+
+  if (file->message_type_count() > 0) {
+    using google::protobuf::compiler::StripProto;
+    auto hh_filename = StripProto(file->name()) + ".pb.h";
+    GetPrinter(hh_filename, "includes", context)->PrintRaw(kPoolRuntime);
+  }
+
+  return true;
+}
+
+
+bool Generator::GenerateMessage(
+    const google::protobuf::Descriptor* message, const std::string& parameter,
+    google::protobuf::compiler::GeneratorContext* context,
+    std::string* error) const {
+  Options options;
+  if (!ParseOptions(parameter, &options, error)) {
+    return false;
+  }
+
+  return GenerateFor(message, message->file(), context, options);
+}
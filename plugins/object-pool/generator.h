@@ -0,0 +1,52 @@
+#ifndef MYAPP_OBJECT_POOL_GENERATOR
+#define MYAPP_OBJECT_POOL_GENERATOR
+
+#include "common/parallel_generator.h"
+
+#include <google/protobuf/compiler/code_generator.h>
+#include <google/protobuf/compiler/plugin.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/io/printer.h>
+#include <google/protobuf/io/zero_copy_stream.h>
+
+#include <cstddef>
+#include <string>
+
+class Generator : public ParallelGenerator {
+ public:
+  inline Generator() {}
+  inline ~Generator() {}
+
+ protected:
+  std::string Version() const override;
+
+  bool GenerateFile(const google::protobuf::FileDescriptor* file,
+                    const std::string& parameter,
+                    google::protobuf::compiler::GeneratorContext* context,
+                    std::string* error) const override;
+
+  bool GenerateMessage(const google::protobuf::Descriptor* message,
+                       const std::string& parameter,
+                       google::protobuf::compiler::GeneratorContext* context,
+                       std::string* error) const override;
+
+ private:
+  // The bounds of the pools, from the plugin parameter, e.g.
+  // --object-pool_opt=local_capacity=64,global_capacity=4096
+  struct Options {
+    // Messages cached by each thread.
+    size_t local_capacity = 64;
+    // Messages in the overflow stack shared by all threads.
+    size_t global_capacity = 4096;
+  };
+
+  bool ParseOptions(const std::string& parameter, Options* options,
+                    std::string* error) const;
+
+  bool GenerateFor(const google::protobuf::Descriptor* message,
+                   const google::protobuf::FileDescriptor* file,
+                   google::protobuf::compiler::GeneratorContext* context,
+                   const Options& options) const;
+};
+
+#endif // MYAPP_OBJECT_POOL_GENERATOR
@@ -0,0 +1,918 @@
+#include "generator.h"
+
+#include "common/insertion.h"
+#include "common/trace.h"
+
+#include <google/protobuf/compiler/code_generator.h>
+#include <google/protobuf/compiler/cpp/cpp_generator.h>
+#include <google/protobuf/compiler/plugin.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/printer.h>
+#include <google/protobuf/wire_format_lite.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+
+// Support code shared by the readers and writers of all messages. It is
+// emitted into the includes of every generated header, so it is guarded
+// against being defined more than once per translation unit.
+const char* const kRecordRuntime = R"(
+#ifndef RECORD_IO_RUNTIME_
+#define RECORD_IO_RUNTIME_
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <google/protobuf/arena.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl.h>
+#include <google/protobuf/wire_format_lite.h>
+
+namespace record_io {
+
+// The size of the buffer records are encoded into before they are written to
+// the file, in one write() per buffer.
+constexpr int kDefaultWriteBufferSize = 1 << 20;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+constexpr bool kLittleEndian = true;
+#else
+constexpr bool kLittleEndian = false;
+#endif
+
+// Appends messages[0, count) to output as length-delimited records, one
+// message at a time. T::EncodeBatch falls back on it for the messages it
+// cannot encode a field at a time. Returns false, and leaves output as it
+// was, if a message is larger than 2 GB.
+template <typename T>
+bool EncodeEach(const T* const* messages, size_t count, std::string* output) {
+  using google::protobuf::io::CodedOutputStream;
+
+  size_t base = output->size();
+  for (size_t i = 0; i < count; ++i) {
+    size_t size = messages[i]->ByteSizeLong();
+    if (size > INT_MAX) {
+      output->resize(base);
+      return false;
+    }
+    size_t offset = output->size();
+    output->resize(offset +
+                   CodedOutputStream::VarintSize32(static_cast<uint32_t>(size)) +
+                   size);
+    auto* p = reinterpret_cast<uint8_t*>(&(*output)[offset]);
+    p = CodedOutputStream::WriteVarint32ToArray(static_cast<uint32_t>(size), p);
+    messages[i]->SerializeWithCachedSizesToArray(p);
+  }
+  return true;
+}
+
+// The bytes value takes as a varint.
+inline uint32_t Varint32Size(uint32_t value) {
+  return 1 + (value >= 1u << 7) + (value >= 1u << 14) + (value >= 1u << 21) +
+         (value >= 1u << 28);
+}
+
+// The tag_size bytes of tag followed by value as a varint, in the order
+// they are written, in the bytes of a uint64_t from the lowest. Without
+// branches or loops, so the compiler can vectorize a loop of them.
+inline uint64_t PackVarint32(uint64_t tag, int tag_size, uint32_t value) {
+  uint64_t x = value;
+  uint64_t bytes = (x & 0x7f) | (x & 0x3f80) << 1 | (x & 0x1fc000) << 2 |
+                   (x & 0xfe00000) << 3 | (x & 0xf0000000) << 4;
+  // The continuation bits of all the bytes but the last.
+  bytes |= (0 - static_cast<uint64_t>(value >= 1u << 7)) & 0x80;
+  bytes |= (0 - static_cast<uint64_t>(value >= 1u << 14)) & 0x8000;
+  bytes |= (0 - static_cast<uint64_t>(value >= 1u << 21)) & 0x800000;
+  bytes |= (0 - static_cast<uint64_t>(value >= 1u << 28)) & 0x80000000;
+  return tag | bytes << (8 * tag_size);
+}
+
+// size, or 0 if value is 0, as a mask rather than a branch the compiler may
+// thread through the other comparisons of value and stop vectorizing.
+inline uint32_t SizeUnlessZero(uint32_t value, uint32_t size) {
+  return (0u - static_cast<uint32_t>(value != 0)) & size;
+}
+
+// The same for a fixed32, float or sfixed32 value.
+inline uint64_t PackFixed32(uint64_t tag, int tag_size, uint32_t value) {
+  return tag | static_cast<uint64_t>(value) << (8 * tag_size);
+}
+
+// Writes the size bytes of packed at *cursor and advances it. When at least
+// 8 bytes are left before end, the end of the record, all 8 are stored at
+// once: those past size are overwritten by the fields written after it.
+inline void WritePacked(uint64_t packed, uint32_t size, uint8_t** cursor,
+                        const uint8_t* end) {
+  if (kLittleEndian && end - *cursor >= 8) {
+    memcpy(*cursor, &packed, 8);
+  } else {
+    for (uint32_t i = 0; i < size; ++i) {
+      (*cursor)[i] = static_cast<uint8_t>(packed >> (8 * i));
+    }
+  }
+  *cursor += size;
+}
+
+inline uint32_t FloatBits(float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+inline uint64_t DoubleBits(double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+// Appends messages of type T to a file as length-delimited records: the size
+// of each message as a varint, then the message. This is the framing of
+// google/protobuf/util/delimited_message_util.h, so the files can also be
+// read and written with SerializeDelimitedToFileDescriptor and
+// ParseDelimitedFromZeroCopyStream.
+//
+// Records are encoded straight into the buffer of a FileOutputStream, which
+// is written to the file whenever it fills up, so each write() covers many
+// records.
+template <typename T>
+class RecordWriter {
+ public:
+  // Truncates the file at path, or appends to it.
+  explicit RecordWriter(const std::string& path, bool append = false,
+                        int buffer_size = kDefaultWriteBufferSize) {
+    int fd = open(path.c_str(),
+                  O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC),
+                  0644);
+    if (fd < 0) {
+      error_ = path + ": " + strerror(errno);
+      return;
+    }
+    stream_.reset(new google::protobuf::io::FileOutputStream(fd, buffer_size));
+    coded_.reset(new google::protobuf::io::CodedOutputStream(stream_.get()));
+  }
+
+  ~RecordWriter() { Close(); }
+
+  RecordWriter(const RecordWriter&) = delete;
+  RecordWriter& operator=(const RecordWriter&) = delete;
+
+  bool ok() const { return error_.empty(); }
+  const std::string& error() const { return error_; }
+  uint64_t records() const { return records_; }
+
+  // Appends message to the buffer, writing the buffer out if it is full.
+  bool Write(const T& message) {
+    if (!ok() || coded_ == nullptr) {
+      return false;
+    }
+
+    size_t size = message.ByteSizeLong();
+    if (size > INT_MAX) {
+      error_ = message.GetTypeName() + " record of " + std::to_string(size) +
+               " bytes is too large";
+      return false;
+    }
+
+    coded_->WriteVarint32(static_cast<uint32_t>(size));
+    message.SerializeWithCachedSizes(coded_.get());
+    ++records_;
+    return CheckStream();
+  }
+
+  // Appends messages[0, count) to the buffer like Write, encoded with
+  // T::EncodeBatch, a field at a time across the messages.
+  bool WriteBatch(const T* const* messages, size_t count) {
+    if (!ok() || coded_ == nullptr) {
+      return false;
+    }
+
+    batch_.clear();
+    if (!T::EncodeBatch(messages, count, &batch_)) {
+      error_ = T::default_instance().GetTypeName() +
+               " record of more than 2 GB in the batch";
+      return false;
+    }
+
+    for (size_t offset = 0; offset < batch_.size(); offset += INT_MAX) {
+      size_t size = batch_.size() - offset;
+      coded_->WriteRaw(batch_.data() + offset,
+                       static_cast<int>(size < INT_MAX ? size : INT_MAX));
+    }
+    records_ += count;
+    return CheckStream();
+  }
+
+  // Writes the records buffered so far to the file.
+  bool Flush() {
+    if (!ok() || coded_ == nullptr) {
+      return false;
+    }
+    coded_->Trim();
+    if (!CheckStream()) {
+      return false;
+    }
+    if (!stream_->Flush()) {
+      error_ = std::string("write: ") + strerror(stream_->GetErrno());
+      return false;
+    }
+    return true;
+  }
+
+  // Flushes and closes the file. Returns whether every record was written.
+  bool Close() {
+    if (stream_ == nullptr) {
+      return ok();
+    }
+    Flush();
+    coded_.reset();
+    if (!stream_->Close() && ok()) {
+      error_ = std::string("close: ") + strerror(stream_->GetErrno());
+    }
+    stream_.reset();
+    return ok();
+  }
+
+ private:
+  bool CheckStream() {
+    if (coded_->HadError()) {
+      error_ = std::string("write: ") + strerror(stream_->GetErrno());
+      return false;
+    }
+    return true;
+  }
+
+  std::unique_ptr<google::protobuf::io::FileOutputStream> stream_;
+  std::unique_ptr<google::protobuf::io::CodedOutputStream> coded_;
+  // The encoding of the last batch, kept for its capacity.
+  std::string batch_;
+  uint64_t records_ = 0;
+  std::string error_;
+};
+
+// A whole file mapped read-only into memory.
+class MappedFile {
+ public:
+  explicit MappedFile(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      error_ = path + ": " + strerror(errno);
+      if (fd >= 0) {
+        close(fd);
+      }
+      return;
+    }
+
+    size_ = static_cast<size_t>(st.st_size);
+    if (size_ > 0) {
+      void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED) {
+        error_ = path + ": " + strerror(errno);
+        size_ = 0;
+      } else {
+        // Records are read front to back, so the kernel can read ahead.
+        madvise(data, size_, MADV_SEQUENTIAL);
+        data_ = static_cast<const uint8_t*>(data);
+      }
+    }
+    close(fd);
+  }
+
+  ~MappedFile() {
+    if (data_ != nullptr) {
+      munmap(const_cast<uint8_t*>(data_), size_);
+    }
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  bool ok() const { return error_.empty(); }
+  const std::string& error() const { return error_; }
+  const uint8_t* begin() const { return data_; }
+  const uint8_t* end() const { return data_ + size_; }
+  size_t size() const { return size_; }
+
+ private:
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+  std::string error_;
+};
+
+// Reads the record at *p, up to end, advancing *p past it. Fails if the
+// record is truncated, or its size is not a varint of at most INT_MAX.
+inline bool NextRecord(const uint8_t** p, const uint8_t* end,
+                       const uint8_t** data, int* size) {
+  uint64_t value = 0;
+  for (int shift = 0; shift < 35 && *p < end; shift += 7) {
+    uint8_t byte = *(*p)++;
+    value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (byte < 0x80) {
+      if (value > INT_MAX || value > static_cast<uint64_t>(end - *p)) {
+        return false;
+      }
+      *data = *p;
+      *size = static_cast<int>(value);
+      *p += value;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Splits [begin, end) at record boundaries into shards runs of records of
+// about the same size, and sets *bounds to the start of each run followed by
+// end. Only the sizes of the records are read.
+inline bool SplitRecords(const uint8_t* begin, const uint8_t* end,
+                         unsigned shards, std::vector<const uint8_t*>* bounds) {
+  bounds->assign(1, begin);
+  size_t shard_size = static_cast<size_t>(end - begin) / shards;
+  const uint8_t* p = begin;
+  const uint8_t* data;
+  int size;
+  for (unsigned shard = 1; shard < shards; ++shard) {
+    while (p < begin + shard_size * shard) {
+      if (!NextRecord(&p, end, &data, &size)) {
+        return false;
+      }
+    }
+    bounds->push_back(p);
+  }
+  bounds->push_back(end);
+  return true;
+}
+
+// Reads the records RecordWriter<T> writes from a memory-mapped file. Each
+// record is parsed straight from the mapping, without being copied or read
+// into a buffer first.
+//
+// Every method returns false at the first malformed record, after visiting
+// the records before it (in ParallelForEach, those of the other shards may
+// have been visited too).
+template <typename T>
+class RecordReader {
+ public:
+  explicit RecordReader(const std::string& path) : file_(path) {}
+
+  bool ok() const { return file_.ok(); }
+  const std::string& error() const { return file_.error(); }
+  size_t size() const { return file_.size(); }
+
+  // Parses every record into the same message in turn, and calls
+  // fn(const T&) with it. The message keeps the memory of its strings and
+  // repeated fields from one record to the next, so once it has seen a
+  // record of each size, parsing allocates nothing.
+  template <typename Fn>
+  bool ForEach(Fn&& fn) const {
+    return ForEachIn(file_.begin(), file_.end(), fn);
+  }
+
+  // Parses up to batch_size records at a time onto an arena, and calls
+  // fn(const std::vector<T*>&) with each batch. The messages are valid until
+  // fn returns, when the arena is reset for the next batch; its first block
+  // is sized from the largest batch so far, so batches of similar size are
+  // parsed without allocating.
+  template <typename Fn>
+  bool ForEachBatch(size_t batch_size, Fn&& fn) const {
+    std::vector<char> block;
+    std::unique_ptr<google::protobuf::Arena> arena(
+        new google::protobuf::Arena());
+    std::vector<T*> batch;
+    batch.reserve(batch_size);
+
+    const uint8_t* p = file_.begin();
+    const uint8_t* data;
+    int size;
+    while (p != file_.end()) {
+      T* message = google::protobuf::Arena::CreateMessage<T>(arena.get());
+      if (!NextRecord(&p, file_.end(), &data, &size) ||
+          !message->ParseFromArray(data, size)) {
+        return false;
+      }
+
+      batch.push_back(message);
+      if (batch.size() < batch_size && p != file_.end()) {
+        continue;
+      }
+
+      fn(static_cast<const std::vector<T*>&>(batch));
+      batch.clear();
+
+      auto used = static_cast<size_t>(arena->SpaceAllocated());
+      if (used <= block.size()) {
+        arena->Reset();
+        continue;
+      }
+      arena.reset();
+      block.resize(used);
+      google::protobuf::ArenaOptions options;
+      options.initial_block = block.data();
+      options.initial_block_size = block.size();
+      arena.reset(new google::protobuf::Arena(options));
+    }
+    return true;
+  }
+
+  // Splits the file at record boundaries into shards of about the same size
+  // (one per core if shards is 0), and reads each on a thread of its own as
+  // ForEach does, calling fn(shard, const T&). fn is called concurrently for
+  // different shards, and in file order within a shard. Finding the
+  // boundaries reads the size of every record before the last shard.
+  template <typename Fn>
+  bool ParallelForEach(unsigned shards, Fn&& fn) const {
+    if (shards == 0) {
+      shards = std::thread::hardware_concurrency();
+    }
+    if (shards == 0) {
+      shards = 1;
+    }
+
+    std::vector<const uint8_t*> bounds;
+    if (!SplitRecords(file_.begin(), file_.end(), shards, &bounds)) {
+      return false;
+    }
+
+    std::unique_ptr<bool[]> results(new bool[shards]);
+    std::vector<std::thread> threads;
+    for (unsigned shard = 0; shard < shards; ++shard) {
+      threads.emplace_back([&, shard]() {
+        auto shard_fn = [&](const T& message) { fn(shard, message); };
+        results[shard] = ForEachIn(bounds[shard], bounds[shard + 1], shard_fn);
+      });
+    }
+
+    bool result = true;
+    for (unsigned shard = 0; shard < shards; ++shard) {
+      threads[shard].join();
+      result = result && results[shard];
+    }
+    return result;
+  }
+
+ private:
+  template <typename Fn>
+  static bool ForEachIn(const uint8_t* p, const uint8_t* end, Fn& fn) {
+    T message;
+    const uint8_t* data;
+    int size;
+    while (p != end) {
+      if (!NextRecord(&p, end, &data, &size) ||
+          !message.ParseFromArray(data, size)) {
+        return false;
+      }
+      fn(static_cast<const T&>(message));
+    }
+    return true;
+  }
+
+  MappedFile file_;
+};
+
+}  // namespace record_io
+#endif  // RECORD_IO_RUNTIME_
+)";
+
+
+// How EncodeBatch sizes and writes a field.
+enum class FieldEncoding {
+  // Values of up to 8 bytes with their tag, sized and laid out by a loop the
+  // compiler can vectorize: 32-bit varints (int32 and enum ones unless they
+  // are negative) and fixed32s.
+  kPackedVarint32,
+  kPackedFixed32,
+  // The others, one at a time.
+  kVarint64,
+  kFixed64,
+  kString,
+};
+
+
+struct EncodedField {
+  const google::protobuf::FieldDescriptor* field;
+  FieldEncoding encoding;
+  // Whether the value is an int32 or enum, sign extended to 10 bytes when
+  // negative.
+  bool sign_extended;
+  // The c++ type of the value as it is encoded, and how to get it from
+  // message.
+  std::string type;
+  std::string value;
+};
+
+
+// Why EncodeBatch cannot encode message a field at a time, or "" if it can:
+// every field has to be a singular scalar, enum, string or bytes field of a
+// proto3 message, outside of a oneof, with a tag that packs with its value
+// into 8 bytes.
+std::string EncodeBatchUnsupported(
+    const google::protobuf::Descriptor* message) {
+  using google::protobuf::FieldDescriptor;
+  using google::protobuf::FileDescriptor;
+
+  if (message->file()->syntax() != FileDescriptor::SYNTAX_PROTO3) {
+    return "it is not a proto3 message";
+  }
+  for (int i = 0; i < message->field_count(); ++i) {
+    auto* field = message->field(i);
+    if (field->is_repeated()) {
+      return field->name() + " is repeated";
+    }
+    if (field->containing_oneof() != nullptr) {
+      return field->name() + " is in a oneof";
+    }
+    if (field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE) {
+      return field->name() + " is a message";
+    }
+    if (field->number() >= 1 << 18) {
+      return "the tag of " + field->name() + " takes more than 3 bytes";
+    }
+  }
+  return "";
+}
+
+
+EncodedField Encoding(const google::protobuf::FieldDescriptor* field) {
+  using google::protobuf::FieldDescriptor;
+
+  auto value = "message." + field->lowercase_name() + "()";
+  switch (field->type()) {
+    case FieldDescriptor::TYPE_INT32:
+      return {field, FieldEncoding::kPackedVarint32, true, "int32_t", value};
+    case FieldDescriptor::TYPE_ENUM:
+      return {field, FieldEncoding::kPackedVarint32, true, "int32_t",
+              "static_cast<int32_t>(" + value + ")"};
+    case FieldDescriptor::TYPE_UINT32:
+    case FieldDescriptor::TYPE_BOOL:
+      return {field, FieldEncoding::kPackedVarint32, false, "uint32_t",
+              "static_cast<uint32_t>(" + value + ")"};
+    case FieldDescriptor::TYPE_SINT32:
+      return {field, FieldEncoding::kPackedVarint32, false, "uint32_t",
+              "::google::protobuf::internal::WireFormatLite::ZigZagEncode32(" +
+                  value + ")"};
+    case FieldDescriptor::TYPE_FIXED32:
+    case FieldDescriptor::TYPE_SFIXED32:
+      return {field, FieldEncoding::kPackedFixed32, false, "uint32_t",
+              "static_cast<uint32_t>(" + value + ")"};
+    case FieldDescriptor::TYPE_FLOAT:
+      return {field, FieldEncoding::kPackedFixed32, false, "uint32_t",
+              "::record_io::FloatBits(" + value + ")"};
+    case FieldDescriptor::TYPE_INT64:
+    case FieldDescriptor::TYPE_UINT64:
+      return {field, FieldEncoding::kVarint64, false, "uint64_t",
+              "static_cast<uint64_t>(" + value + ")"};
+    case FieldDescriptor::TYPE_SINT64:
+      return {field, FieldEncoding::kVarint64, false, "uint64_t",
+              "::google::protobuf::internal::WireFormatLite::ZigZagEncode64(" +
+                  value + ")"};
+    case FieldDescriptor::TYPE_FIXED64:
+    case FieldDescriptor::TYPE_SFIXED64:
+      return {field, FieldEncoding::kFixed64, false, "uint64_t",
+              "static_cast<uint64_t>(" + value + ")"};
+    case FieldDescriptor::TYPE_DOUBLE:
+      return {field, FieldEncoding::kFixed64, false, "uint64_t",
+              "::record_io::DoubleBits(" + value + ")"};
+    default:
+      return {field, FieldEncoding::kString, false, "const std::string&",
+              value};
+  }
+}
+
+
+std::string Generator::Version() const {
+  return "record-io/1";
+}
+
+
+bool Generator::GenerateFor(
+    const google::protobuf::Descriptor* message,
+    const google::protobuf::FileDescriptor* file,
+    google::protobuf::compiler::GeneratorContext* context) const {
+  TraceSpan span("GenerateFor", message->full_name());
+
+  // Map entries are not read or written on their own.
+  if (message->options().map_entry()) {
+    return true;
+  }
+
+  using google::protobuf::compiler::StripProto;
+  auto hh_filename = StripProto(file->name()) + ".pb.h";
+
+  std::map<std::string, std::string> vars;
+  vars["class"] = ClassName(message);
+
+  GetPrinter(hh_filename, "namespace_scope", context)->Print(vars,
+      "// Record I/O (record-io plugin)\n"
+      "using $class$Writer = ::record_io::RecordWriter<$class$>;\n"
+      "using $class$Reader = ::record_io::RecordReader<$class$>;\n"
+      "\n");
+
+  if (!GenerateEncodeBatch(message, file, context)) {
+    return false;
+  }
+
+  for (int i = 0; i < message->nested_type_count(); ++i) {
+    if (!GenerateFor(message->nested_type(i), file, context)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+bool Generator::GenerateEncodeBatch(
+    const google::protobuf::Descriptor* message,
+    const google::protobuf::FileDescriptor* file,
+    google::protobuf::compiler::GeneratorContext* context) const {
+  using google::protobuf::FieldDescriptor;
+  using google::protobuf::compiler::StripProto;
+  using google::protobuf::internal::WireFormatLite;
+
+  auto hh_filename = StripProto(file->name()) + ".pb.h";
+  auto class_scope = GetPrinter(hh_filename, "class_scope", context, message);
+
+  std::map<std::string, std::string> vars;
+  vars["class"] = ClassName(message);
+
+  class_scope->Print(vars,
+      "// Appends messages[0, count) to output as length-delimited records,\n"
+      "// the same bytes as encoding them one at a time. Returns false, and\n"
+      "// leaves output as it was, if a message is larger than 2 GB.\n");
+
+  auto unsupported = EncodeBatchUnsupported(message);
+  if (!unsupported.empty()) {
+    vars["reason"] = unsupported;
+    class_scope->Print(vars,
+        "// They are encoded one at a time, as $reason$.\n"
+        "static bool EncodeBatch(const $class$* const* messages, size_t count,\n"
+        "                        std::string* output) {\n"
+        "  return ::record_io::EncodeEach(messages, count, output);\n"
+        "}\n\n");
+    return true;
+  }
+
+  // Fields are encoded in the order of their numbers, as they are by
+  // SerializeToArray.
+  std::vector<EncodedField> fields;
+  for (int i = 0; i < message->field_count(); ++i) {
+    fields.push_back(Encoding(message->field(i)));
+  }
+  std::sort(fields.begin(), fields.end(),
+            [](const EncodedField& a, const EncodedField& b) {
+              return a.field->number() < b.field->number();
+            });
+
+  std::vector<std::map<std::string, std::string>> fields_vars;
+  for (auto& encoded : fields) {
+    auto field_vars = vars;
+    auto wire_type = WireFormatLite::WireTypeForFieldType(
+        static_cast<WireFormatLite::FieldType>(encoded.field->type()));
+    auto tag = WireFormatLite::MakeTag(encoded.field->number(), wire_type);
+    field_vars["field"] = encoded.field->lowercase_name();
+    field_vars["type"] = encoded.type;
+    field_vars["value"] = encoded.value;
+    field_vars["tag"] = std::to_string(tag) + "u";
+    field_vars["tag_size"] = std::to_string(
+        google::protobuf::io::CodedOutputStream::VarintSize32(tag));
+
+    // The bytes of the tag as a varint, as PackVarint32 lays them out.
+    uint64_t tag_bytes = 0;
+    int shift = 0;
+    for (uint32_t rest = tag; rest != 0 || shift == 0; rest >>= 7, shift += 8) {
+      tag_bytes |= static_cast<uint64_t>((rest & 0x7f) | (rest >= 0x80 ? 0x80 : 0))
+                   << shift;
+    }
+    char literal[32];
+    snprintf(literal, sizeof(literal), "0x%llxull",
+             static_cast<unsigned long long>(tag_bytes));
+    field_vars["tag_bytes"] = literal;
+    fields_vars.push_back(field_vars);
+  }
+
+  class_scope->Print(vars,
+      "//\n"
+      "// Messages are encoded 64 at a time: each is sized in one pass over\n"
+      "// them, with the 32-bit fields packed with their precomputed tags in a\n"
+      "// loop per field the compiler vectorizes, and then each field is\n"
+      "// written into the records of all 64 in turn.\n"
+      "static bool EncodeBatch(const $class$* const* messages, size_t count,\n"
+      "                        std::string* output) {\n"
+      "  using ::google::protobuf::io::CodedOutputStream;\n"
+      "\n"
+      "  size_t base = output->size();\n"
+      "  for (size_t first = 0; first < count; first += 64) {\n"
+      "    const $class$* const* block = messages + first;\n"
+      "    size_t n = count - first < 64 ? count - first : 64;\n"
+      "\n"
+      "    // Sizes the messages, gathering the values of the packed fields.\n"
+      "    uint64_t sizes[64] = {};\n"
+      "    bool unknown = false;\n");
+  for (size_t f = 0; f < fields.size(); ++f) {
+    auto encoding = fields[f].encoding;
+    if (encoding == FieldEncoding::kPackedVarint32 ||
+        encoding == FieldEncoding::kPackedFixed32) {
+      class_scope->Print(fields_vars[f], "    $type$ $field$_values[64] = {};\n");
+    }
+  }
+  class_scope->Print(vars,
+      "    for (size_t i = 0; i < n; ++i) {\n"
+      "      const $class$& message = *block[i];\n"
+      "      unknown = unknown || message._internal_metadata_.have_unknown_fields();\n");
+  for (size_t f = 0; f < fields.size(); ++f) {
+    auto& field_vars = fields_vars[f];
+    switch (fields[f].encoding) {
+      case FieldEncoding::kPackedVarint32:
+      case FieldEncoding::kPackedFixed32:
+        class_scope->Print(field_vars, "      $field$_values[i] = $value$;\n");
+        break;
+      case FieldEncoding::kVarint64:
+        class_scope->Print(field_vars,
+            "      $type$ $field$_value = $value$;\n"
+            "      sizes[i] += $field$_value == 0 ? 0 : $tag_size$ + CodedOutputStream::VarintSize64($field$_value);\n");
+        break;
+      case FieldEncoding::kFixed64:
+        class_scope->Print(field_vars,
+            "      sizes[i] += $value$ == 0 ? 0 : $tag_size$ + 8;\n");
+        break;
+      case FieldEncoding::kString:
+        class_scope->Print(field_vars,
+            "      $type$ $field$_value = $value$;\n"
+            "      sizes[i] += $field$_value.empty() ? 0 : $tag_size$ + CodedOutputStream::VarintSize64($field$_value.size()) + $field$_value.size();\n");
+        break;
+    }
+  }
+  class_scope->Print(
+      "    }\n"
+      "    if (unknown) {\n"
+      "      // Unknown fields go after the others, so the block is encoded\n"
+      "      // one message at a time.\n"
+      "      if (!::record_io::EncodeEach(block, n, output)) {\n"
+      "        output->resize(base);\n"
+      "        return false;\n"
+      "      }\n"
+      "      continue;\n"
+      "    }\n");
+
+  for (size_t f = 0; f < fields.size(); ++f) {
+    auto& field_vars = fields_vars[f];
+    switch (fields[f].encoding) {
+      case FieldEncoding::kPackedVarint32:
+        class_scope->Print(field_vars,
+            "    uint64_t $field$_packed[64];\n"
+            "    uint32_t $field$_sizes[64];\n"
+            "    for (size_t i = 0; i < 64; ++i) {\n"
+            "      uint32_t value = static_cast<uint32_t>($field$_values[i]);\n"
+            "      $field$_packed[i] = ::record_io::PackVarint32($tag_bytes$, $tag_size$, value);\n");
+        class_scope->Print(field_vars, fields[f].sign_extended
+            ? "      // Negative values take 5 bytes as a uint32_t and 10 sign extended.\n"
+              "      uint32_t size = $tag_size$ + ::record_io::Varint32Size(value) + 5 * static_cast<uint32_t>($field$_values[i] < 0);\n"
+              "      $field$_sizes[i] = ::record_io::SizeUnlessZero(value, size);\n"
+            : "      $field$_sizes[i] = ::record_io::SizeUnlessZero(value, $tag_size$ + ::record_io::Varint32Size(value));\n");
+        class_scope->Print(field_vars,
+            "      sizes[i] += $field$_sizes[i];\n"
+            "    }\n");
+        break;
+      case FieldEncoding::kPackedFixed32:
+        class_scope->Print(field_vars,
+            "    uint64_t $field$_packed[64];\n"
+            "    uint32_t $field$_sizes[64];\n"
+            "    for (size_t i = 0; i < 64; ++i) {\n"
+            "      $field$_packed[i] = ::record_io::PackFixed32($tag_bytes$, $tag_size$, $field$_values[i]);\n"
+            "      $field$_sizes[i] = ::record_io::SizeUnlessZero($field$_values[i], $tag_size$ + 4);\n"
+            "      sizes[i] += $field$_sizes[i];\n"
+            "    }\n");
+        break;
+      default:
+        break;
+    }
+  }
+
+  class_scope->Print(vars,
+      "\n"
+      "    // Writes the size of each record ...\n"
+      "    size_t total = 0;\n"
+      "    for (size_t i = 0; i < n; ++i) {\n"
+      "      if (sizes[i] > INT_MAX) {\n"
+      "        output->resize(base);\n"
+      "        return false;\n"
+      "      }\n"
+      "      total += CodedOutputStream::VarintSize32(static_cast<uint32_t>(sizes[i])) + sizes[i];\n"
+      "    }\n"
+      "    size_t offset = output->size();\n"
+      "    output->resize(offset + total);\n"
+      "    uint8_t* cursors[64];\n"
+      "    uint8_t* ends[64];\n"
+      "    uint8_t* p = reinterpret_cast<uint8_t*>(&(*output)[offset]);\n"
+      "    for (size_t i = 0; i < n; ++i) {\n"
+      "      cursors[i] = CodedOutputStream::WriteVarint32ToArray(static_cast<uint32_t>(sizes[i]), p);\n"
+      "      p = ends[i] = cursors[i] + sizes[i];\n"
+      "    }\n"
+      "\n"
+      "    // ... and then each field into all of them.\n");
+  for (size_t f = 0; f < fields.size(); ++f) {
+    auto& field_vars = fields_vars[f];
+    switch (fields[f].encoding) {
+      case FieldEncoding::kPackedVarint32:
+      case FieldEncoding::kPackedFixed32:
+        class_scope->Print(field_vars,
+            "    for (size_t i = 0; i < n; ++i) {\n");
+        if (fields[f].sign_extended) {
+          class_scope->Print(field_vars,
+              "      if ($field$_values[i] < 0) {\n"
+              "        cursors[i] = CodedOutputStream::WriteVarint64ToArray(\n"
+              "            static_cast<uint64_t>($field$_values[i]),\n"
+              "            CodedOutputStream::WriteTagToArray($tag$, cursors[i]));\n"
+              "        continue;\n"
+              "      }\n");
+        }
+        class_scope->Print(field_vars,
+            "      ::record_io::WritePacked($field$_packed[i], $field$_sizes[i], &cursors[i], ends[i]);\n"
+            "    }\n");
+        break;
+      case FieldEncoding::kVarint64:
+        class_scope->Print(field_vars,
+            "    for (size_t i = 0; i < n; ++i) {\n"
+            "      const $class$& message = *block[i];\n"
+            "      $type$ value = $value$;\n"
+            "      if (value != 0) {\n"
+            "        cursors[i] = CodedOutputStream::WriteVarint64ToArray(\n"
+            "            value, CodedOutputStream::WriteTagToArray($tag$, cursors[i]));\n"
+            "      }\n"
+            "    }\n");
+        break;
+      case FieldEncoding::kFixed64:
+        class_scope->Print(field_vars,
+            "    for (size_t i = 0; i < n; ++i) {\n"
+            "      const $class$& message = *block[i];\n"
+            "      $type$ value = $value$;\n"
+            "      if (value != 0) {\n"
+            "        cursors[i] = CodedOutputStream::WriteLittleEndian64ToArray(\n"
+            "            value, CodedOutputStream::WriteTagToArray($tag$, cursors[i]));\n"
+            "      }\n"
+            "    }\n");
+        break;
+      case FieldEncoding::kString:
+        class_scope->Print(field_vars,
+            "    for (size_t i = 0; i < n; ++i) {\n"
+            "      const $class$& message = *block[i];\n"
+            "      $type$ value = $value$;\n"
+            "      if (!value.empty()) {\n"
+            "        cursors[i] = CodedOutputStream::WriteStringWithSizeToArray(\n"
+            "            value, CodedOutputStream::WriteTagToArray($tag$, cursors[i]));\n"
+            "      }\n"
+            "    }\n");
+        break;
+    }
+  }
+  class_scope->Print(
+      "  }\n"
+      "  return true;\n"
+      "}\n\n");
+
+  return true;
+}
+
+
+bool Generator::GenerateFile(const google::protobuf::FileDescriptor* file,
+                             const std::string& parameter,
+                             google::protobuf::compiler::GeneratorContext* context,
+                             std::string* error) const {
+  if (!parameter.empty()) {
+    *error = "record-io takes no parameters";
+    return false;
+  }
+
+  if (file->message_type_count() > 0) {
+    using google::protobuf::compiler::StripProto;
+    auto hh_filename = StripProto(file->name()) + ".pb.h";
+    GetPrinter(hh_filename, "includes", context)->PrintRaw(kRecordRuntime);
+  }
+
+  return true;
+}
+
+
+bool Generator::GenerateMessage(
+    const google::protobuf::Descriptor* message,
+    const std::string& /*parameter*/,
+    google::protobuf::compiler::GeneratorContext* context,
+    std::string* /*error*/) const {
+  return GenerateFor(message, message->file(), context);
+}
@@ -0,0 +1,47 @@
+#ifndef MYAPP_RECORD_IO_GENERATOR
+#define MYAPP_RECORD_IO_GENERATOR
+
+#include "common/parallel_generator.h"
+
+#include <google/protobuf/compiler/code_generator.h>
+#include <google/protobuf/compiler/plugin.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/io/printer.h>
+#include <google/protobuf/io/zero_copy_stream.h>
+
+#include <string>
+
+class Generator : public ParallelGenerator {
+ public:
+  inline Generator() {}
+  inline ~Generator() {}
+
+ protected:
+  std::string Version() const override;
+
+  bool GenerateFile(const google::protobuf::FileDescriptor* file,
+                    const std::string& parameter,
+                    google::protobuf::compiler::GeneratorContext* context,
+                    std::string* error) const override;
+
+  bool GenerateMessage(const google::protobuf::Descriptor* message,
+                       const std::string& parameter,
+                       google::protobuf::compiler::GeneratorContext* context,
+                       std::string* error) const override;
+
+ private:
+  // Emits <Message>Writer and <Message>Reader, which write and read files of
+  // length-delimited records of the message, after the classes of the file.
+  bool GenerateFor(const google::protobuf::Descriptor* message,
+                   const google::protobuf::FileDescriptor* file,
+                   google::protobuf::compiler::GeneratorContext* context) const;
+
+  // Emits the static EncodeBatch of the message into its class, which
+  // RecordWriter::WriteBatch encodes batches of records with.
+  bool GenerateEncodeBatch(
+      const google::protobuf::Descriptor* message,
+      const google::protobuf::FileDescriptor* file,
+      google::protobuf::compiler::GeneratorContext* context) const;
+};
+
+#endif // MYAPP_RECORD_IO_GENERATOR
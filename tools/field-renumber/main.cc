@@ -0,0 +1,222 @@
+// Suggests field numbers and a declaration order for messages from the field
+// access counts basic-insertions writes in mode=field_access.
+//
+// Usage: field-renumber <descriptor set> <field access report>
+//
+// The descriptor set is written by protoc --include_imports
+// --descriptor_set_out=<file>, and the report by
+// basic_insertions::WriteFieldAccessReport().
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/descriptor.pb.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// protoc reserves these numbers for its own use.
+const int kFirstReservedNumber = 19000;
+const int kLastReservedNumber = 19999;
+
+// Share of the accesses of a message that its hot fields account for.
+const double kHotShare = 0.9;
+
+struct FieldAccess {
+  const google::protobuf::FieldDescriptor* field;
+  uint64_t reads;
+  uint64_t writes;
+  int suggested_number;
+
+  uint64_t accesses() const { return reads + writes; }
+};
+
+// The size of the tag of a field, which is a varint of its number and wire
+// type. Numbers 1-15 take one byte, up to 2047 two, and so on.
+int TagSize(int number) {
+  uint32_t tag = static_cast<uint32_t>(number) << 3;
+  int size = 1;
+  while (tag >= 0x80) {
+    tag >>= 7;
+    ++size;
+  }
+  return size;
+}
+
+// Whether number can be given to a field of message, whose current numbers are
+// all free to reuse.
+bool IsAvailable(const google::protobuf::Descriptor* message, int number) {
+  return !(number >= kFirstReservedNumber && number <= kLastReservedNumber) &&
+         !message->IsReservedNumber(number) &&
+         message->FindExtensionRangeContainingNumber(number) == nullptr;
+}
+
+// Tag bytes per access, weighting every field by its accesses.
+double TagBytesPerAccess(const std::vector<FieldAccess>& fields,
+                         bool suggested) {
+  uint64_t accesses = 0;
+  double bytes = 0;
+  for (auto& field : fields) {
+    int number = suggested ? field.suggested_number : field.field->number();
+    accesses += field.accesses();
+    bytes += static_cast<double>(field.accesses()) * TagSize(number);
+  }
+  return accesses == 0 ? 0 : bytes / static_cast<double>(accesses);
+}
+
+// How many declarations the hot fields (the most accessed fields that make up
+// kHotShare of the accesses) are spread over in the current declaration order.
+// Reordered, they are declared first, one after the other.
+std::pair<int, int> HotFieldSpread(
+    const std::vector<FieldAccess>& by_accesses) {
+  uint64_t total = 0;
+  for (auto& field : by_accesses) {
+    total += field.accesses();
+  }
+
+  int first = by_accesses.front().field->index();
+  int last = first;
+  int hot = 0;
+  uint64_t seen = 0;
+  for (auto& field : by_accesses) {
+    if (hot > 0 && static_cast<double>(seen) >=
+                       kHotShare * static_cast<double>(total)) {
+      break;
+    }
+    first = std::min(first, field.field->index());
+    last = std::max(last, field.field->index());
+    seen += field.accesses();
+    ++hot;
+  }
+
+  return {last - first + 1, hot};
+}
+
+void Suggest(const google::protobuf::Descriptor* message,
+             std::vector<FieldAccess> fields) {
+  // The most accessed fields get the smallest numbers, and are declared
+  // first. Fields accessed as often keep their relative order.
+  std::stable_sort(fields.begin(), fields.end(),
+                   [](const FieldAccess& a, const FieldAccess& b) {
+                     return a.accesses() > b.accesses();
+                   });
+
+  int number = 0;
+  uint64_t total = 0;
+  for (auto& field : fields) {
+    do {
+      ++number;
+    } while (!IsAvailable(message, number));
+    field.suggested_number = number;
+    total += field.accesses();
+  }
+
+  auto spread = HotFieldSpread(fields);
+  char summary[160];
+  snprintf(summary, sizeof(summary),
+           "tag bytes per access %.2f -> %.2f, hot fields spread over %d -> %d "
+           "declarations",
+           TagBytesPerAccess(fields, false), TagBytesPerAccess(fields, true),
+           spread.first, spread.second);
+  std::cout << message->full_name() << ": " << summary << "\n";
+
+  for (auto& field : fields) {
+    char line[256];
+    snprintf(line, sizeof(line),
+             "  %-24s %12llu reads %12llu writes %6.1f%%  %d -> %d\n",
+             field.field->name().c_str(),
+             static_cast<unsigned long long>(field.reads),
+             static_cast<unsigned long long>(field.writes),
+             total == 0 ? 0.0 : 100.0 * static_cast<double>(field.accesses()) /
+                                    static_cast<double>(total),
+             field.field->number(), field.suggested_number);
+    std::cout << line;
+  }
+  std::cout << "\n";
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    std::cerr << "usage: " << argv[0]
+              << " <descriptor set> <field access report>\n";
+    return 2;
+  }
+
+  // The descriptors, which must include the imports of each file ...
+  google::protobuf::FileDescriptorSet descriptor_set;
+  std::ifstream descriptor_input(argv[1], std::ios::binary);
+  if (!descriptor_set.ParseFromIstream(&descriptor_input)) {
+    std::cerr << argv[1] << ": not a FileDescriptorSet\n";
+    return 1;
+  }
+
+  google::protobuf::DescriptorPool pool;
+  for (auto& file : descriptor_set.file()) {
+    if (pool.BuildFile(file) == nullptr) {
+      std::cerr << argv[1] << ": cannot build " << file.name()
+                << " (was it written with --include_imports?)\n";
+      return 1;
+    }
+  }
+
+  // ... and the counts, by message in the order they first appear.
+  std::ifstream report(argv[2]);
+  if (!report) {
+    std::cerr << argv[2] << ": cannot be read\n";
+    return 1;
+  }
+
+  std::vector<const google::protobuf::Descriptor*> messages;
+  std::map<const google::protobuf::Descriptor*, std::vector<FieldAccess>>
+      accesses;
+
+  std::string line;
+  for (int line_number = 1; std::getline(report, line); ++line_number) {
+    std::istringstream columns(line);
+    std::string message_name, field_name;
+    uint64_t reads, writes;
+    if (!(columns >> message_name >> field_name >> reads >> writes)) {
+      std::cerr << argv[2] << ":" << line_number << ": expected "
+                << "<message> <field> <reads> <writes>\n";
+      return 1;
+    }
+
+    auto* message = pool.FindMessageTypeByName(message_name);
+    auto* field = message ? message->FindFieldByName(field_name) : nullptr;
+    if (field == nullptr) {
+      std::cerr << argv[2] << ":" << line_number << ": " << message_name
+                << "." << field_name << " is not in " << argv[1] << "\n";
+      return 1;
+    }
+
+    auto& fields = accesses[message];
+    if (fields.empty()) {
+      messages.push_back(message);
+      for (int i = 0; i < message->field_count(); ++i) {
+        fields.push_back({message->field(i), 0, 0, 0});
+      }
+    }
+    fields[field->index()].reads += reads;
+    fields[field->index()].writes += writes;
+  }
+
+  std::cout << "# Renumbering fields changes the wire format: only renumber "
+               "messages that are\n"
+               "# never persisted or exchanged with binaries built from the "
+               "old numbers.\n\n";
+  for (auto* message : messages) {
+    Suggest(message, accesses[message]);
+  }
+
+  return 0;
+}
@@ -0,0 +1,332 @@
+// Writes a synthetic corpus of .proto files for exercising the plugins at the
+// scale of a large schema: many files, messages nested several levels deep,
+// fields of every kind (many carrying (example.field_options) defaults and
+// constraints), messages referring to one declared later in their file, and
+// each file importing several others.
+//
+// Usage: proto-corpus <output dir> [--files=N] [--messages=N] [--depth=N]
+//                     [--nested=N] [--fields=N] [--imports=N] [--seed=N]
+//
+// The files are written to <output dir>/corpus/ and import
+// protos/options.proto, so protoc needs both <output dir> and the project
+// root on its import path. <output dir>/corpus.list lists the files, relative
+// to <output dir>, one per line. The same arguments always give the same
+// corpus.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+namespace {
+
+struct Options {
+  // Files in the corpus.
+  int files;
+  // Top level messages per file.
+  int messages;
+  // Levels of nested messages below each top level message.
+  int depth;
+  // Nested messages per message, down to depth.
+  int nested;
+  // Fields per message, besides those referencing nested or imported ones.
+  int fields;
+  // Files each file imports, from those written before it.
+  int imports;
+  uint32_t seed;
+};
+
+// The kinds of fields the corpus is made of. Singular scalars, strings and
+// enums, the kinds before kRepeatedInt32, can carry a default_value option;
+// numbers can carry a min and max, and strings a max_size.
+enum FieldKind {
+  kInt32,
+  kInt64,
+  kUint32,
+  kUint64,
+  kSint32,
+  kFixed64,
+  kDouble,
+  kFloat,
+  kBool,
+  kString,
+  kBytes,
+  kEnum,
+  kRepeatedInt32,
+  kRepeatedString,
+  kMap,
+  kFieldKindCount
+};
+
+struct FieldType {
+  const char* type;
+  const char* name;
+  // The default_value of the field, or nullptr if it cannot have one.
+  const char* default_value;
+  // The min and max of the field, or nullptr if it has none. Both hold the
+  // default_value.
+  const char* min;
+  const char* max;
+  // The max_size of the field, or 0 if it cannot have one.
+  uint32_t max_size;
+};
+
+const FieldType kFieldTypes[kFieldKindCount] = {
+    {"int32", "count", "42", "0", "1000", 0},
+    {"int64", "offset", "-9000000000", "-10000000000", "10000000000", 0},
+    {"uint32", "flags", "7", nullptr, "255", 0},
+    {"uint64", "id", "18000000000000000000", "1", nullptr, 0},
+    {"sint32", "delta", "-3", "-100", "100", 0},
+    {"fixed64", "hash", "12345678901234", "1", nullptr, 0},
+    {"double", "ratio", "0.25", "0", "1", 0},
+    {"float", "weight", "1.5", "0", "100", 0},
+    {"bool", "enabled", "true", nullptr, nullptr, 0},
+    {"string", "label", "corpus \\\"default\\\"", nullptr, nullptr, 64},
+    {"bytes", "payload", "\\001\\002", nullptr, nullptr, 256},
+    {"Kind", "kind", "KIND_SECOND", nullptr, nullptr, 0},
+    {"repeated int32", "counts", nullptr, nullptr, nullptr, 0},
+    {"repeated string", "labels", nullptr, nullptr, nullptr, 32},
+    {"map<string, int64>", "totals", nullptr, nullptr, nullptr, 0},
+};
+
+std::string FileName(int file) {
+  char name[32];
+  snprintf(name, sizeof(name), "corpus/file_%05d.proto", file);
+  return name;
+}
+
+
+std::string Package(int file) {
+  char name[32];
+  snprintf(name, sizeof(name), "corpus.file_%05d", file);
+  return name;
+}
+
+
+class FileWriter {
+ public:
+  FileWriter(const Options& options, std::mt19937* random)
+      : options_(options), random_(random) {}
+
+  std::string Write(int file, const std::vector<int>& imports) {
+    out_.str("");
+    out_ << "// Generated by proto-corpus. Do not edit.\n"
+         << "syntax = \"proto3\";\n\n"
+         << "package " << Package(file) << ";\n\n"
+         << "import \"protos/options.proto\";\n";
+    for (int imported : imports) {
+      out_ << "import \"" << FileName(imported) << "\";\n";
+    }
+
+    out_ << "\nenum Kind {\n"
+         << "  KIND_UNSPECIFIED = 0;\n"
+         << "  KIND_FIRST = 1;\n"
+         << "  KIND_SECOND = 2;\n"
+         << "}\n";
+
+    for (int i = 0; i < options_.messages; ++i) {
+      out_ << "\n";
+      // The first message references the top level messages of the imported
+      // files, so none of the imports is unused.
+      WriteMessage("Message" + std::to_string(i), 0,
+                   i == 0 ? imports : std::vector<int>());
+    }
+
+    // Every top level message has a Summary, which is declared after them,
+    // as Checksum is after Summary, so the code generated for a message
+    // comes before the classes of some of its fields are complete. Both are
+    // bounded and constrained, so that code includes the fixed buffer
+    // serializer and the validators.
+    out_ << "\nmessage Summary {\n"
+         << "  uint32 total = 1 [(example.field_options).max = \"1000000\"];\n"
+         << "  string digest = 2 [(example.field_options).max_size = 64];\n"
+         << "  Checksum checksum = 3;\n"
+         << "}\n"
+         << "\nmessage Checksum {\n"
+         << "  int32 rounds = 1 [(example.field_options).min = \"0\",\n"
+         << "                    (example.field_options).max = \"64\"];\n"
+         << "  string algorithm = 2 [(example.field_options).max_size = 16];\n"
+         << "}\n";
+
+    return out_.str();
+  }
+
+ private:
+  void WriteMessage(const std::string& name, int level,
+                    const std::vector<int>& imports) {
+    std::string indent(static_cast<size_t>(level) * 2, ' ');
+    out_ << indent << "message " << name << " {\n";
+
+    int number = 0;
+    for (int i = 0; i < options_.fields; ++i) {
+      // The first field is one that can have a default, and has one, so the
+      // import of options.proto is always used. Half of the others that can
+      // have one do, and half of those that can have constraints.
+      auto kinds = i == 0 ? kRepeatedInt32 : kFieldKindCount;
+      auto& type = kFieldTypes[(*random_)() % static_cast<uint32_t>(kinds)];
+      std::vector<std::string> field_options;
+      if (type.default_value != nullptr && (i == 0 || (*random_)() % 2 == 0)) {
+        field_options.push_back(std::string("default_value = \"") +
+                                type.default_value + "\"");
+      }
+      if ((type.min != nullptr || type.max != nullptr || type.max_size > 0) &&
+          (*random_)() % 2 == 0) {
+        if (type.min != nullptr) {
+          field_options.push_back(std::string("min = \"") + type.min + "\"");
+        }
+        if (type.max != nullptr) {
+          field_options.push_back(std::string("max = \"") + type.max + "\"");
+        }
+        if (type.max_size > 0) {
+          field_options.push_back("max_size = " +
+                                  std::to_string(type.max_size));
+        }
+      }
+
+      out_ << indent << "  " << type.type << " " << type.name << "_" << i
+           << " = " << ++number;
+      for (size_t j = 0; j < field_options.size(); ++j) {
+        out_ << (j == 0 ? " [" : ", ") << "(example.field_options)."
+             << field_options[j];
+      }
+      out_ << (field_options.empty() ? ";\n" : "];\n");
+    }
+
+    for (int imported : imports) {
+      out_ << indent << "  " << Package(imported) << ".Message0 imported_"
+           << imported << " = " << ++number << ";\n";
+    }
+    if (level == 0) {
+      out_ << "  Summary summary = " << ++number << ";\n";
+    }
+
+    if (level < options_.depth) {
+      for (int i = 0; i < options_.nested; ++i) {
+        auto nested = "Level" + std::to_string(level + 1) + "_" +
+                      std::to_string(i);
+        out_ << "\n";
+        WriteMessage(nested, level + 1, std::vector<int>());
+        out_ << indent << "  " << nested << " nested_" << i << " = "
+             << ++number << ";\n";
+      }
+    }
+
+    out_ << indent << "}\n";
+  }
+
+  const Options& options_;
+  std::mt19937* random_;
+  std::ostringstream out_;
+};
+
+
+bool ParseFlag(const std::string& arg, const std::string& name,
+               unsigned long max, unsigned long* value) {
+  auto prefix = "--" + name + "=";
+  if (arg.compare(0, prefix.size(), prefix) != 0) {
+    return false;
+  }
+
+  auto text = arg.substr(prefix.size());
+  char* end = nullptr;
+  errno = 0;
+  *value = strtoul(text.c_str(), &end, 10);
+  if (text.empty() || text[0] == '-' || *end != '\0' || errno == ERANGE ||
+      *value > max) {
+    std::cerr << "expected a number up to " << max << " for --" << name
+              << ", got: " << text << "\n";
+    exit(2);
+  }
+  return true;
+}
+
+
+bool MakeDirectory(const std::string& path) {
+  return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0] << " <output dir> [--files=N] "
+              << "[--messages=N] [--depth=N] [--nested=N] [--fields=N] "
+              << "[--imports=N] [--seed=N]\n";
+    return 2;
+  }
+
+  // 6000 messages and about 57000 fields by default, which protoc --cpp_out
+  // alone takes around half a minute over.
+  Options options = {1000, 1, 3, 1, 10, 8, 1};
+  for (int i = 2; i < argc; ++i) {
+    unsigned long value;
+    if (ParseFlag(argv[i], "files", 99999, &value)) {
+      options.files = static_cast<int>(value);
+    } else if (ParseFlag(argv[i], "messages", 1000, &value)) {
+      options.messages = static_cast<int>(value);
+    } else if (ParseFlag(argv[i], "depth", 30, &value)) {
+      options.depth = static_cast<int>(value);
+    } else if (ParseFlag(argv[i], "nested", 10, &value)) {
+      options.nested = static_cast<int>(value);
+    } else if (ParseFlag(argv[i], "fields", 1000, &value)) {
+      options.fields = static_cast<int>(value);
+    } else if (ParseFlag(argv[i], "imports", 1000, &value)) {
+      options.imports = static_cast<int>(value);
+    } else if (ParseFlag(argv[i], "seed", UINT32_MAX, &value)) {
+      options.seed = static_cast<uint32_t>(value);
+    } else {
+      std::cerr << "unknown argument: " << argv[i] << "\n";
+      return 2;
+    }
+  }
+
+  if (options.messages == 0) {
+    std::cerr << "--messages must be at least 1\n";
+    return 2;
+  }
+
+  std::string output_dir = argv[1];
+  if (!MakeDirectory(output_dir) || !MakeDirectory(output_dir + "/corpus")) {
+    std::cerr << output_dir << ": cannot create the corpus directory\n";
+    return 1;
+  }
+
+  std::mt19937 random(options.seed);
+  FileWriter writer(options, &random);
+  std::ofstream list(output_dir + "/corpus.list");
+
+  for (int file = 0; file < options.files; ++file) {
+    // Each file imports files written before it, so there are no cycles,
+    // and files picked at random, so some are imported by many others.
+    std::set<int> imports;
+    while (static_cast<int>(imports.size()) < std::min(file, options.imports)) {
+      imports.insert(static_cast<int>(random() % static_cast<uint32_t>(file)));
+    }
+
+    auto name = FileName(file);
+    std::ofstream proto(output_dir + "/" + name);
+    proto << writer.Write(file,
+                          std::vector<int>(imports.begin(), imports.end()));
+    list << name << "\n";
+    if (!proto) {
+      std::cerr << output_dir << "/" << name << ": cannot be written\n";
+      return 1;
+    }
+  }
+
+  if (!list.flush()) {
+    std::cerr << output_dir << "/corpus.list: cannot be written\n";
+    return 1;
+  }
+
+  return 0;
+}